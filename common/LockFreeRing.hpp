@@ -0,0 +1,117 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_LOCKFREERING_HPP
+#define INCLUDED_LOCKFREERING_HPP
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/// A bounded FIFO that any number of threads push into, without a lock,
+/// and a single thread at a time pops from.
+///
+/// Each cell has a sequence number, telling whether it is free for the
+/// push at that position, or holds the value for the pop at that
+/// position; the pushers claim their position with a compare-and-swap.
+template <typename T>
+class LockFreeRing
+{
+    struct Cell
+    {
+        std::atomic<size_t> _sequence;
+        T _value;
+    };
+
+public:
+    /// The capacity is rounded up to a power of two.
+    explicit LockFreeRing(size_t capacity)
+        : _pushPos(0)
+        , _popPos(0)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size *= 2;
+
+        _mask = size - 1;
+        _cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i)
+            _cells[i]._sequence.store(i, std::memory_order_relaxed);
+    }
+
+    LockFreeRing(const LockFreeRing&) = delete;
+    LockFreeRing& operator=(const LockFreeRing&) = delete;
+
+    /// Adds a value, from any thread; returns false when the ring is full.
+    bool push(T&& value)
+    {
+        size_t pos = _pushPos.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;)
+        {
+            cell = &_cells[pos & _mask];
+            const size_t sequence = cell->_sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (_pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                // Not popped yet since the last round.
+                return false;
+            }
+            else
+            {
+                pos = _pushPos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->_value = std::move(value);
+        cell->_sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Takes the oldest value, returns false when there is none.
+    /// Only one thread at a time may pop.
+    bool pop(T& value)
+    {
+        Cell& cell = _cells[_popPos & _mask];
+        if (cell._sequence.load(std::memory_order_acquire) != _popPos + 1)
+            return false;
+
+        value = std::move(cell._value);
+        cell._value = T();
+        cell._sequence.store(_popPos + _mask + 1, std::memory_order_release);
+        ++_popPos;
+        return true;
+    }
+
+    /// Whether there is nothing to pop, as seen by the popping thread.
+    bool empty() const
+    {
+        return _cells[_popPos & _mask]._sequence.load(std::memory_order_acquire) != _popPos + 1;
+    }
+
+    size_t capacity() const { return _mask + 1; }
+
+private:
+    std::unique_ptr<Cell[]> _cells;
+    size_t _mask;
+    std::atomic<size_t> _pushPos;
+    /// Only used by the popping thread.
+    size_t _popPos;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -11,6 +11,7 @@
 #define INCLUDED_MESSAGE_HPP
 
 #include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -76,9 +77,23 @@ public:
         LOG_TRC("Message " << _abbr);
     }
 
+    /// Construct a message of a header, which must include the full
+    /// first-line, followed by a payload shared with other messages,
+    /// eg. the same tile sent to several clients.
+    Message(const std::string& header,
+            const std::shared_ptr<const std::vector<char>>& payload,
+            const enum Dir dir) :
+        Message(header, dir)
+    {
+        _payload = payload;
+    }
+
     size_t size() const { return _data.size(); }
     const std::vector<char>& data() const { return _data; }
 
+    /// The shared part of the message, sent after data(), if any.
+    const std::shared_ptr<const std::vector<char>>& payload() const { return _payload; }
+
     const std::vector<std::string>& tokens() const { return _tokens; }
     const std::string& forwardToken() const { return _forwardToken; }
     const std::string& firstToken() const { return _tokens[0]; }
@@ -164,6 +179,7 @@ private:
 private:
     const std::string _forwardToken;
     std::vector<char> _data;
+    std::shared_ptr<const std::vector<char>> _payload;
     const std::vector<std::string> _tokens;
     const std::string _id;
     const std::string _firstLine;
@@ -12,6 +12,7 @@
 #include "MessageQueue.hpp"
 
 #include <algorithm>
+#include <limits>
 
 #include <Poco/JSON/JSON.h>
 #include <Poco/JSON/Object.h>
@@ -24,118 +25,445 @@
 
 using Poco::StringTokenizer;
 
+namespace {
+
+/// The command of a "child-<session>" message, without tokenizing the
+/// rest of it, eg. a paste.
+std::string getChildCommand(const TileQueue::Payload& value, const std::string& firstToken)
+{
+    const auto end = value.begin() + std::min(value.size(), firstToken.size() + 64);
+    auto start = value.begin() + firstToken.size();
+    while (start != end && *start == ' ')
+        ++start;
+
+    return std::string(start, std::find_if(start, end, [](char c) { return c == ' ' || c == '\n'; }));
+}
+
+}
+
 void TileQueue::put_impl(const Payload& value)
 {
-    const std::string msg = std::string(value.data(), value.size());
+    // Keep the order of the callbacks put before.
+    drainCallbacks();
+
     const std::string firstToken = LOOLProtocol::getFirstToken(value);
 
     if (firstToken == "canceltiles")
     {
-        LOG_TRC("Processing [" << LOOLProtocol::getAbbreviatedMessage(msg) << "]. Before canceltiles have " << getQueue().size() << " in queue.");
+        const std::string msg = std::string(value.data(), value.size());
+        LOG_TRC("Processing [" << LOOLProtocol::getAbbreviatedMessage(msg) << "]. Before canceltiles have " << getQueueSize() << " in queue.");
         const std::string seqs = msg.substr(12);
         StringTokenizer tokens(seqs, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-        getQueue().erase(std::remove_if(getQueue().begin(), getQueue().end(),
-                [&tokens](const Payload& v)
-                {
-                    const std::string s(v.data(), v.size());
-                    // Tile is for a thumbnail, don't cancel it
-                    if (s.find("id=") != std::string::npos)
-                        return false;
-                    for (size_t i = 0; i < tokens.count(); ++i)
-                    {
-                        if (s.find("ver=" + tokens[i]) != std::string::npos)
-                        {
-                            LOG_TRC("Matched " << tokens[i] << ", Removing [" << s << "]");
-                            return true;
-                        }
-                    }
-
-                    return false;
-
-                }), getQueue().end());
+        std::set<int> versions;
+        for (size_t i = 0; i < tokens.count(); ++i)
+        {
+            int version = 0;
+            if (LOOLProtocol::stringToInteger(tokens[i], version))
+                versions.insert(version);
+        }
+
+        // Previews are not in _tiles, they are never cancelled.
+        for (auto it = _tiles.begin(); it != _tiles.end(); )
+        {
+            const auto next = std::next(it);
+            if (versions.find(it->second._tile.getVersion()) != versions.end())
+            {
+                LOG_TRC("Matched " << it->second._tile.getVersion() << ", Removing [" << it->second._tile.serialize("tile") << "]");
+                removeTile(it);
+                ++_tilesCancelled;
+            }
+
+            it = next;
+        }
 
         // Don't push canceltiles into the queue.
-        LOG_TRC("After canceltiles have " << getQueue().size() << " in queue.");
+        LOG_TRC("After canceltiles have " << getQueueSize() << " in queue.");
         return;
     }
     else if (firstToken == "tilecombine")
     {
         // Breakup tilecombine and deduplicate (we are re-combining the tiles
         // in the get_impl() again)
-        const TileCombined tileCombined = TileCombined::parse(msg);
-        for (auto& tile : tileCombined.getTiles())
+        const TileCombined tileCombined = TileCombined::parse(std::string(value.data(), value.size()));
+        for (const auto& tile : tileCombined.getTiles())
         {
-            const std::string newMsg = tile.serialize("tile");
-
-            removeTileDuplicate(newMsg);
-
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+            putTile(tile, Payload());
         }
         return;
     }
     else if (firstToken == "tile")
     {
-        removeTileDuplicate(msg);
-
-        MessageQueue::put_impl(value);
+        putTile(TileDesc::parse(std::string(value.data(), value.size())), value);
         return;
     }
     else if (firstToken == "callback")
     {
-        const std::string newMsg = removeCallbackDuplicate(msg);
+        Callback callback;
+        if (Callback::parse(std::string(value.data(), value.size()), callback))
+            queueCallback(std::move(callback));
+        else
+            LOG_ERR("Invalid callback message: [" << LOOLProtocol::getAbbreviatedMessage(value) << "].");
+
+        return;
+    }
+
+    const uint64_t seq = _nextSeq++;
+    if (getMessageClass(value) == MessageClass::Input)
+        _inputs.emplace(seq, std::chrono::steady_clock::now());
+
+    _messages.emplace(seq, value);
+
+    if (LOOLProtocol::matchPrefix("child-", firstToken))
+        updateView(firstToken.substr(6), getChildCommand(value, firstToken), value);
+}
+
+void TileQueue::updateView(const std::string& sessionId, const std::string& command, const Payload& value)
+{
+    if (command == "disconnect")
+    {
+        _views.erase(sessionId);
+        cancelInvisibleTiles();
+        return;
+    }
 
-        if (newMsg.empty())
+    View& view = _views[sessionId];
+    if (command == "clientvisiblearea")
+    {
+        const std::vector<std::string> tokens = LOOLProtocol::tokenize(value.data(), value.size());
+        int x, y, width, height;
+        if (tokens.size() == 6 &&
+            LOOLProtocol::getTokenInteger(tokens[2], "x", x) &&
+            LOOLProtocol::getTokenInteger(tokens[3], "y", y) &&
+            LOOLProtocol::getTokenInteger(tokens[4], "width", width) &&
+            LOOLProtocol::getTokenInteger(tokens[5], "height", height) &&
+            width > 0 && height > 0)
         {
-            MessageQueue::put_impl(value);
+            // Keep the tiles around the area too, eg. prefetched or scrolled back to.
+            view._hasArea = true;
+            view._x = x - width;
+            view._y = y - height;
+            view._width = 3 * width;
+            view._height = 3 * height;
+            cancelInvisibleTiles();
         }
-        else
+    }
+    else if (command == "clientzoom")
+    {
+        const std::vector<std::string> tokens = LOOLProtocol::tokenize(value.data(), value.size());
+        if (tokens.size() == 6 &&
+            LOOLProtocol::getTokenInteger(tokens[4], "tiletwipwidth", view._tileTwipWidth) &&
+            LOOLProtocol::getTokenInteger(tokens[5], "tiletwipheight", view._tileTwipHeight))
         {
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+            view._hasZoom = true;
+            cancelOtherZoomTiles();
         }
+    }
+}
 
+void TileQueue::cancelInvisibleTiles()
+{
+    // Only when we know what all the views see.
+    if (_views.empty() || _tiles.empty())
         return;
+
+    for (const auto& it : _views)
+    {
+        if (!it.second._hasArea)
+            return;
     }
 
-    MessageQueue::put_impl(value);
+    for (auto it = _tiles.begin(); it != _tiles.end(); )
+    {
+        const auto next = std::next(it);
+        const TileDesc& tile = it->second._tile;
+
+        bool visible = false;
+        for (const auto& view : _views)
+        {
+            if (tile.intersectsWithRect(view.second._x, view.second._y,
+                                        view.second._width, view.second._height))
+            {
+                visible = true;
+                break;
+            }
+        }
+
+        if (!visible)
+        {
+            LOG_TRC("Removing tile out of the views: " << tile.serialize("tile"));
+            _cancelledVersions.push_back(tile.getVersion());
+            removeTile(it);
+            ++_tilesInvisible;
+        }
+
+        it = next;
+    }
 }
 
-void TileQueue::removeTileDuplicate(const std::string& tileMsg)
+void TileQueue::cancelOtherZoomTiles()
 {
-    assert(LOOLProtocol::matchPrefix("tile", tileMsg, /*ignoreWhitespace*/ true));
+    // Only when we know the zoom of all the views.
+    if (_tiles.empty())
+        return;
+
+    for (const auto& it : _views)
+    {
+        if (!it.second._hasZoom)
+            return;
+    }
+
+    for (auto it = _tiles.begin(); it != _tiles.end(); )
+    {
+        const auto next = std::next(it);
+        const TileDesc& tile = it->second._tile;
+
+        bool zoomed = false;
+        for (const auto& view : _views)
+        {
+            // The pixel size may differ, eg. on hidpi, the zoom is in twips.
+            if (tile.getTileWidth() == view.second._tileTwipWidth &&
+                tile.getTileHeight() == view.second._tileTwipHeight)
+            {
+                zoomed = true;
+                break;
+            }
+        }
+
+        if (!zoomed)
+        {
+            LOG_TRC("Removing tile of another zoom: " << tile.serialize("tile"));
+            _cancelledVersions.push_back(tile.getVersion());
+            removeTile(it);
+            ++_tilesOtherZoom;
+        }
+
+        it = next;
+    }
+}
 
+TileQueue::MessageClass TileQueue::getMessageClass(const Payload& value)
+{
+    const std::string firstToken = LOOLProtocol::getFirstToken(value);
+    if (firstToken == "tile" || firstToken == "tilecombine")
+    {
+        int id = -1;
+        const std::vector<std::string> tokens = LOOLProtocol::tokenize(value.data(), value.size());
+        return (LOOLProtocol::getTokenInteger(tokens, "id", id) && id >= 0 ? MessageClass::Preview
+                                                                            : MessageClass::Tile);
+    }
+
+    if (!LOOLProtocol::matchPrefix("child-", firstToken))
+        return MessageClass::Background;
+
+    const std::string command = getChildCommand(value, firstToken);
+    if (command == "key" || command == "textinput" || command == "windowkey" ||
+        command == "mouse" || command == "windowmouse" || command == "selecttext" ||
+        command == "selectgraphic" || command == "resetselection")
+    {
+        return MessageClass::Input;
+    }
+
+    return MessageClass::Background;
+}
+
+void TileQueue::putTile(const TileDesc& tile, const Payload& value)
+{
+    const TileKey key(tile);
+    removeTileDuplicate(key);
+
+    const uint64_t seq = _nextSeq++;
+    if (tile.getId() >= 0)
+    {
+        // Previews are not combined, nor prioritized, keep them as they came.
+        if (value.empty())
+        {
+            const std::string msg = tile.serialize("tile");
+            _messages.emplace(seq, Payload(msg.data(), msg.data() + msg.size()));
+        }
+        else
+        {
+            _messages.emplace(seq, value);
+        }
+
+        _previews.emplace(seq, key);
+    }
+    else
+    {
+        const int prio = _prioritiesValid ? priority(tile) : -1;
+        _tiles.emplace(seq, QueuedTile{ tile, prio });
+        _rows[RowKey(tile)][tile.getTilePosY()].insert(seq);
+        if (_prioritiesValid)
+            _priorities[prio].insert(seq);
+    }
+
+    _tileIndex.emplace(key, seq);
+}
+
+void TileQueue::removeTileDuplicate(const TileKey& key)
+{
     // Ver is always provided at this point and it is necessary to
     // return back to clients the last rendered version of a tile
     // in case there are new invalidations and requests while rendering.
     // Here we compare duplicates without 'ver' since that's irrelevant.
-    size_t newMsgPos = tileMsg.find(" ver");
-    if (newMsgPos == std::string::npos)
+    const auto index = _tileIndex.find(key);
+    if (index == _tileIndex.end())
+        return;
+
+    const uint64_t seq = index->second;
+    const auto it = _tiles.find(seq);
+    if (it != _tiles.end())
     {
-        newMsgPos = tileMsg.size() - 1;
+        LOG_TRC("Remove duplicate tile request: " << it->second._tile.serialize("tile"));
+        removeTile(it);
+        ++_tilesSuperseded;
     }
+    else
+    {
+        LOG_TRC("Remove duplicate preview request: " << LOOLProtocol::getAbbreviatedMessage(_messages[seq]));
+        removePreview(seq);
+    }
+}
 
-    for (size_t i = 0; i < getQueue().size(); ++i)
+void TileQueue::removeTile(Tiles::iterator it)
+{
+    const uint64_t seq = it->first;
+    const QueuedTile& queued = it->second;
+
+    _tileIndex.erase(TileKey(queued._tile));
+
+    const auto row = _rows.find(RowKey(queued._tile));
+    assert(row != _rows.end());
+    const auto position = row->second.find(queued._tile.getTilePosY());
+    assert(position != row->second.end());
+    position->second.erase(seq);
+    if (position->second.empty())
     {
-        auto& it = getQueue()[i];
-        if (it.size() > newMsgPos &&
-            strncmp(tileMsg.data(), it.data(), newMsgPos) == 0)
-        {
-            LOG_TRC("Remove duplicate tile request: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(tileMsg));
-            getQueue().erase(getQueue().begin() + i);
+        row->second.erase(position);
+        if (row->second.empty())
+            _rows.erase(row);
+    }
+
+    if (_prioritiesValid)
+    {
+        const auto prio = _priorities.find(queued._priority);
+        assert(prio != _priorities.end());
+        prio->second.erase(seq);
+        if (prio->second.empty())
+            _priorities.erase(prio);
+    }
+
+    _tiles.erase(it);
+}
+
+void TileQueue::removePreview(uint64_t seq)
+{
+    const auto preview = _previews.find(seq);
+    assert(preview != _previews.end());
+    _tileIndex.erase(preview->second);
+    _previews.erase(preview);
+    _messages.erase(seq);
+}
+
+void TileQueue::clear_impl()
+{
+    Callback callback;
+    while (_callbackRing.pop(callback))
+        ;
+
+    _callbacks.clear();
+    _callbackIndex.clear();
+    _tiles.clear();
+    _messages.clear();
+    _previews.clear();
+    _inputs.clear();
+    _cancelledVersions.clear();
+    _tileIndex.clear();
+    _rows.clear();
+    _priorities.clear();
+}
+
+std::string TileQueue::Callback::serialize() const
+{
+    std::string target;
+    switch (_target)
+    {
+        case Target::View:
+            target = std::to_string(_viewId);
+            break;
+        case Target::All:
+            target = "all";
+            break;
+        case Target::AllExcept:
+            target = "except-" + std::to_string(_viewId);
             break;
-        }
     }
+
+    return "callback " + target + ' ' + std::to_string(_type) + ' ' + _payload;
 }
 
-namespace {
+bool TileQueue::Callback::parse(const std::string& message, Callback& callback)
+{
+    // the message is "callback <view> <id> ..."
+    const std::vector<std::string> tokens = LOOLProtocol::tokenize(message);
+    if (tokens.size() < 3 || tokens[0] != "callback")
+        return false;
+
+    const std::string& target = tokens[1];
+    if (target == "all")
+    {
+        callback._target = Target::All;
+        callback._viewId = -1;
+    }
+    else if (LOOLProtocol::matchPrefix("except-", target))
+    {
+        callback._target = Target::AllExcept;
+        if (!LOOLProtocol::stringToInteger(target.substr(7), callback._viewId))
+            return false;
+    }
+    else
+    {
+        callback._target = Target::View;
+        if (!LOOLProtocol::stringToInteger(target, callback._viewId))
+            return false;
+    }
+
+    if (!LOOLProtocol::stringToInteger(tokens[2], callback._type) || callback._type < 0)
+        return false;
+
+    // payload is the rest of the message
+    const size_t offset = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3; // + delims
+    callback._payload = (offset < message.size() ? message.substr(offset) : std::string());
+    return true;
+}
 
-/// Read the viewId from the tokens.
-std::string extractViewId(const std::string& origMsg, const std::vector<std::string>& tokens)
+TileQueue::Payload TileQueue::get(const unsigned timeoutMs, Callback& callback)
 {
-    size_t nonJson = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3; // including spaces
-    std::string jsonString(origMsg.data() + nonJson, origMsg.size() - nonJson);
+    std::unique_lock<std::mutex> lock = getLock();
 
+    if (!wait(lock, timeoutMs))
+    {
+        return Payload();
+    }
+
+    return getMessage(&callback);
+}
+
+void TileQueue::drainCallbacks()
+{
+    Callback callback;
+    while (_callbackRing.pop(callback))
+    {
+        queueCallback(std::move(callback));
+    }
+}
+
+namespace {
+
+/// Read the viewId from the JSON payload.
+std::string extractViewId(const std::string& payload)
+{
     Poco::JSON::Parser parser;
-    const Poco::Dynamic::Var result = parser.parse(jsonString);
+    const Poco::Dynamic::Var result = parser.parse(payload);
     const auto& json = result.extract<Poco::JSON::Object::Ptr>();
     return json->get("viewId").toString();
 }
@@ -153,7 +481,7 @@ std::string extractUnoCommand(const std::string& command)
     return command;
 }
 
-/// Extract rectangle from the invalidation callback
+/// Extract rectangle from the invalidation callback payload
 bool extractRectangle(const std::vector<std::string>& tokens, int& x, int& y, int& w, int& h, int& part)
 {
     x = 0;
@@ -162,95 +490,143 @@ bool extractRectangle(const std::vector<std::string>& tokens, int& x, int& y, in
     h = INT_MAX;
     part = 0;
 
-    if (tokens.size() < 5)
+    if (tokens.size() < 2)
         return false;
 
-    if (tokens[3] == "EMPTY,")
+    if (tokens[0] == "EMPTY,")
     {
-        part = std::atoi(tokens[4].c_str());
+        part = std::atoi(tokens[1].c_str());
         return true;
     }
 
-    if (tokens.size() < 8)
+    if (tokens.size() < 5)
         return false;
 
-    x = std::atoi(tokens[3].c_str());
-    y = std::atoi(tokens[4].c_str());
-    w = std::atoi(tokens[5].c_str());
-    h = std::atoi(tokens[6].c_str());
-    part = std::atoi(tokens[7].c_str());
+    x = std::atoi(tokens[0].c_str());
+    y = std::atoi(tokens[1].c_str());
+    w = std::atoi(tokens[2].c_str());
+    h = std::atoi(tokens[3].c_str());
+    part = std::atoi(tokens[4].c_str());
 
     return true;
 }
 
+/// Whether the callback is about the view in its payload.
+bool isViewCallback(int type)
+{
+    return type == LOK_CALLBACK_INVALIDATE_VIEW_CURSOR ||
+           type == LOK_CALLBACK_CELL_VIEW_CURSOR ||
+           type == LOK_CALLBACK_VIEW_CURSOR_VISIBLE;
 }
 
-std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
+/// Whether the callback replaces the previous one of the same type and view.
+bool isReplacingCallback(int type)
 {
-    assert(LOOLProtocol::matchPrefix("callback", callbackMsg, /*ignoreWhitespace*/ true));
-
-    std::vector<std::string> tokens = LOOLProtocol::tokenize(callbackMsg);
+    return type == LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR ||
+           type == LOK_CALLBACK_CURSOR_VISIBLE ||
+           type == LOK_CALLBACK_STATUS_INDICATOR_SET_VALUE ||
+           type == LOK_CALLBACK_DOCUMENT_SIZE_CHANGED ||
+           type == LOK_CALLBACK_CELL_CURSOR ||
+           isViewCallback(type);
+}
 
-    if (tokens.size() < 3)
-        return std::string();
+}
 
-    // the message is "callback <view> <id> ..."
-    const std::string& callbackType = tokens[2];
+void TileQueue::queueCallback(Callback&& callback)
+{
+    QueuedCallback queued{ std::move(callback), false, 0, 0, 0, 0, 0, std::string() };
 
-    // FIXME: Good grief, why don't we use the symbolic LOK_CALLBACK_FOO names here? Doing it this
-    // way is somewhat fragile and certainly bad style.
-    if (callbackType == "0")        // invalidation
+    // Parse what is needed to merge the callbacks once, when they are queued.
+    const std::string& payload = queued._callback._payload;
+    if (queued._callback._type == LOK_CALLBACK_INVALIDATE_TILES)
     {
-        int msgX, msgY, msgW, msgH, msgPart;
+        queued._hasRectangle = extractRectangle(LOOLProtocol::tokenize(payload), queued._x, queued._y,
+                                                queued._width, queued._height, queued._part);
+    }
+    else if (isViewCallback(queued._callback._type))
+    {
+        try
+        {
+            queued._payloadViewId = extractViewId(payload);
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERR("Invalid view callback payload [" << payload << "]: " << exc.what());
+        }
+    }
 
-        if (!extractRectangle(tokens, msgX, msgY, msgW, msgH, msgPart))
-            return std::string();
+    removeCallbackDuplicate(queued);
 
-        bool performedMerge = false;
+    const uint64_t seq = _nextSeq++;
+    _callbackIndex[getCallbackKey(queued._callback)].insert(seq);
+    _callbacks.emplace(seq, std::move(queued));
+}
 
-        // we always travel the entire queue
-        size_t i = 0;
-        while (i < getQueue().size())
-        {
-            auto& it = getQueue()[i];
+void TileQueue::removeCallback(std::map<uint64_t, QueuedCallback>::iterator it)
+{
+    const auto index = _callbackIndex.find(getCallbackKey(it->second._callback));
+    assert(index != _callbackIndex.end());
+    index->second.erase(it->first);
+    if (index->second.empty())
+        _callbackIndex.erase(index);
 
-            std::vector<std::string> queuedTokens = LOOLProtocol::tokenize(it.data(), it.size());
-            if (queuedTokens.size() < 3)
-            {
-                ++i;
-                continue;
-            }
+    _callbacks.erase(it);
+}
 
-            // not a invalidation callback
-            if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1] || queuedTokens[2] != tokens[2])
-            {
-                ++i;
-                continue;
-            }
+void TileQueue::removeCallbackDuplicate(QueuedCallback& queued)
+{
+    Callback& callback = queued._callback;
+    if (callback._type != LOK_CALLBACK_INVALIDATE_TILES &&
+        callback._type != LOK_CALLBACK_STATE_CHANGED &&
+        !isReplacingCallback(callback._type))
+    {
+        return;
+    }
 
-            int queuedX, queuedY, queuedW, queuedH, queuedPart;
+    // Only the callbacks of the same type and target are merged.
+    const auto index = _callbackIndex.find(getCallbackKey(callback));
+    if (index == _callbackIndex.end())
+        return;
 
-            if (!extractRectangle(queuedTokens, queuedX, queuedY, queuedW, queuedH, queuedPart))
-            {
-                ++i;
-                continue;
-            }
+    // Copy, the index changes as they are removed.
+    const std::vector<uint64_t> candidates(index->second.begin(), index->second.end());
 
-            if (msgPart != queuedPart)
-            {
-                ++i;
+    if (callback._type == LOK_CALLBACK_INVALIDATE_TILES)
+    {
+        if (!queued._hasRectangle)
+            return;
+
+        int msgX = queued._x;
+        int msgY = queued._y;
+        int msgW = queued._width;
+        int msgH = queued._height;
+        const int msgPart = queued._part;
+
+        bool performedMerge = false;
+
+        // we always travel the entire queue
+        for (const uint64_t seq : candidates)
+        {
+            const auto it = _callbacks.find(seq);
+            const QueuedCallback& other = it->second;
+            if (!other._hasRectangle || msgPart != other._part)
                 continue;
-            }
+
+            const int queuedX = other._x;
+            const int queuedY = other._y;
+            const int queuedW = other._width;
+            const int queuedH = other._height;
 
             // the invalidation in the queue is fully covered by the message,
             // just remove it
             if (msgX <= queuedX && queuedX + queuedW <= msgX + msgW && msgY <= queuedY && queuedY + queuedH <= msgY + msgH)
             {
-                LOG_TRC("Removing smaller invalidation: " << std::string(it.data(), it.size()) << " -> " <<
-                        tokens[0] << " " << tokens[1] << " " << tokens[2] << " " << msgX << " " << msgY << " " << msgW << " " << msgH << " " << msgPart);
+                LOG_TRC("Removing smaller invalidation: " << other._callback.serialize() << " -> " <<
+                        msgX << " " << msgY << " " << msgW << " " << msgH << " " << msgPart);
 
                 // remove from the queue
-                getQueue().erase(getQueue().begin() + i);
+                removeCallback(it);
+                ++_callbacksCoalesced;
                 continue;
             }
 
@@ -266,14 +642,11 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                 const int reasonableSizeX = 4*3840; // 4x tile at 100% zoom
                 const int reasonableSizeY = 2*3840; // 2x tile at 100% zoom
                 if (joinW > reasonableSizeX || joinH > reasonableSizeY)
-                {
-                    ++i;
                     continue;
-                }
 
-                LOG_TRC("Merging invalidations: " << std::string(it.data(), it.size()) << " and " <<
-                        tokens[0] << " " << tokens[1] << " " << tokens[2] << " " << msgX << " " << msgY << " " << msgW << " " << msgH << " " << msgPart << " -> " <<
-                        tokens[0] << " " << tokens[1] << " " << tokens[2] << " " << joinX << " " << joinY << " " << joinW << " " << joinH << " " << msgPart);
+                LOG_TRC("Merging invalidations: " << other._callback.serialize() << " and " <<
+                        msgX << " " << msgY << " " << msgW << " " << msgH << " " << msgPart << " -> " <<
+                        joinX << " " << joinY << " " << joinW << " " << joinH << " " << msgPart);
 
                 msgX = joinX;
                 msgY = joinY;
@@ -282,123 +655,73 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                 performedMerge = true;
 
                 // remove from the queue
-                getQueue().erase(getQueue().begin() + i);
-                continue;
+                removeCallback(it);
+                ++_callbacksCoalesced;
             }
-
-            ++i;
         }
 
         if (performedMerge)
         {
-            size_t pre = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3;
-            size_t post = pre + tokens[3].size() + tokens[4].size() + tokens[5].size() + tokens[6].size() + 4;
+            // Keep what follows the rectangle in the payload, the part.
+            const std::vector<std::string> tokens = LOOLProtocol::tokenize(callback._payload);
+            const size_t post = tokens[0].size() + tokens[1].size() + tokens[2].size() + tokens[3].size() + 4;
 
-            std::string result = callbackMsg.substr(0, pre) +
-                std::to_string(msgX) + ", " +
+            callback._payload = std::to_string(msgX) + ", " +
                 std::to_string(msgY) + ", " +
                 std::to_string(msgW) + ", " +
-                std::to_string(msgH) + ", " + callbackMsg.substr(post);
+                std::to_string(msgH) + ", " + callback._payload.substr(post);
+            queued._x = msgX;
+            queued._y = msgY;
+            queued._width = msgW;
+            queued._height = msgH;
 
-            LOG_TRC("Merge result: " << result);
-
-            return result;
+            LOG_TRC("Merge result: " << callback.serialize());
         }
     }
-    else if (callbackType == "8")        // state changed
+    else if (callback._type == LOK_CALLBACK_STATE_CHANGED)
     {
-        if (tokens.size() < 4)
-            return std::string();
-
-        std::string unoCommand = extractUnoCommand(tokens[3]);
+        const std::string unoCommand = extractUnoCommand(LOOLProtocol::getFirstToken(callback._payload));
         if (unoCommand.empty())
-            return std::string();
+            return;
 
         // remove obsolete states of the same .uno: command
-        for (size_t i = 0; i < getQueue().size(); ++i)
+        for (const uint64_t seq : candidates)
         {
-            auto& it = getQueue()[i];
-
-            std::vector<std::string> queuedTokens = LOOLProtocol::tokenize(it.data(), it.size());
-            if (queuedTokens.size() < 4)
-                continue;
-
-            if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1] || queuedTokens[2] != tokens[2])
-                continue;
-
-            // callback, the same target, state changed; now check it's
-            // the same .uno: command
-            std::string queuedUnoCommand = extractUnoCommand(queuedTokens[3]);
-            if (queuedUnoCommand.empty())
-                continue;
-
-            if (unoCommand == queuedUnoCommand)
+            const auto it = _callbacks.find(seq);
+            const Callback& other = it->second._callback;
+            if (unoCommand == extractUnoCommand(LOOLProtocol::getFirstToken(other._payload)))
             {
-                LOG_TRC("Remove obsolete uno command: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                getQueue().erase(getQueue().begin() + i);
+                LOG_TRC("Remove obsolete uno command: " << other.serialize() << " -> " << callback.serialize());
+                removeCallback(it);
+                ++_callbacksCoalesced;
                 break;
             }
         }
     }
-    else if (callbackType == "1" || // the cursor has moved
-            callbackType == "5" ||  // the cursor visibility has changed
-            callbackType == "10" || // setting the indicator value
-            callbackType == "13" || // setting the document size
-            callbackType == "17" || // the cell cursor has moved
-            callbackType == "24" || // the view cursor has moved
-            callbackType == "26" || // the view cell cursor has moved
-            callbackType == "28")   // the view cursor visibility has changed
+    else if (isReplacingCallback(callback._type))
     {
-        const bool isViewCallback = (callbackType == "24" || callbackType == "26" || callbackType == "28");
-
-        std::string viewId;
-        if (isViewCallback)
+        const bool isView = isViewCallback(callback._type);
+        for (const uint64_t seq : candidates)
         {
-            viewId = extractViewId(callbackMsg, tokens);
-        }
+            const auto it = _callbacks.find(seq);
 
-        for (size_t i = 0; i < getQueue().size(); ++i)
-        {
-            auto& it = getQueue()[i];
-
-            // skip non-callbacks quickly
-            if (!LOOLProtocol::matchPrefix("callback", it))
-                continue;
-
-            std::vector<std::string> queuedTokens = LOOLProtocol::tokenize(it.data(), it.size());
-            if (queuedTokens.size() < 3)
-                continue;
-
-            if (!isViewCallback && (queuedTokens[1] == tokens[1] && queuedTokens[2] == tokens[2]))
+            // we additionally need to ensure that the payload is about
+            // the same viewid (otherwise we'd merge them all views into
+            // one)
+            if (!isView || queued._payloadViewId == it->second._payloadViewId)
             {
-                LOG_TRC("Remove obsolete callback: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                getQueue().erase(getQueue().begin() + i);
+                LOG_TRC("Remove obsolete " << (isView ? "view " : "") << "callback: " <<
+                        it->second._callback.serialize() << " -> " << callback.serialize());
+                removeCallback(it);
+                ++_callbacksCoalesced;
                 break;
             }
-            else if (isViewCallback && (queuedTokens[1] == tokens[1] && queuedTokens[2] == tokens[2]))
-            {
-                // we additionally need to ensure that the payload is about
-                // the same viewid (otherwise we'd merge them all views into
-                // one)
-                const std::string queuedViewId = extractViewId(std::string(it.data(), it.size()), queuedTokens);
-
-                if (viewId == queuedViewId)
-                {
-                    LOG_TRC("Remove obsolete view callback: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                    getQueue().erase(getQueue().begin() + i);
-                    break;
-                }
-            }
         }
     }
-
-    return std::string();
 }
 
-int TileQueue::priority(const std::string& tileMsg)
+int TileQueue::priority(const TileDesc& tile)
 {
-    TileDesc tile = TileDesc::parse(tileMsg); //FIXME: Expensive, avoid.
-
     for (int i = static_cast<int>(_viewOrder.size()) - 1; i >= 0; --i)
     {
         auto& cursor = _cursorPositions[_viewOrder[i]];
@@ -410,122 +733,193 @@ int TileQueue::priority(const std::string& tileMsg)
     return -1;
 }
 
+void TileQueue::updatePriorities()
+{
+    if (_prioritiesValid)
+        return;
+
+    _priorities.clear();
+    for (auto& it : _tiles)
+    {
+        it.second._priority = priority(it.second._tile);
+        _priorities[it.second._priority].insert(it.first);
+    }
+
+    _prioritiesValid = true;
+}
+
 void TileQueue::deprioritizePreviews()
 {
-    for (size_t i = 0; i < getQueue().size(); ++i)
+    // Nothing to let through when there are only previews.
+    if (_previews.size() == getQueueSize())
+        return;
+
+    // stop at the first non-tile or non-'id' (preview) message
+    while (!_messages.empty())
     {
-        const Payload front = getQueue().front();
-        const std::string message(front.data(), front.size());
+        const auto front = _messages.begin();
+        if ((!_tiles.empty() && _tiles.begin()->first < front->first) ||
+            (!_callbacks.empty() && _callbacks.begin()->first < front->first))
+            break;
 
-        // stop at the first non-tile or non-'id' (preview) message
-        std::string id;
-        if (!LOOLProtocol::matchPrefix("tile", message) ||
-            !LOOLProtocol::getTokenStringFromMessage(message, "id", id))
-        {
+        const auto preview = _previews.find(front->first);
+        if (preview == _previews.end())
             break;
-        }
 
-        getQueue().erase(getQueue().begin());
-        getQueue().push_back(front);
+        const uint64_t seq = _nextSeq++;
+        _messages.emplace(seq, std::move(front->second));
+        _previews.emplace(seq, preview->second);
+        _tileIndex.find(preview->second)->second = seq;
+
+        _previews.erase(preview);
+        _messages.erase(front);
     }
 }
 
 TileQueue::Payload TileQueue::get_impl()
 {
-    LOG_TRC("MessageQueue depth: " << getQueue().size());
+    return getMessage(nullptr);
+}
 
-    const Payload front = getQueue().front();
+TileQueue::Payload TileQueue::takeCallback(Callback* callback)
+{
+    const auto it = _callbacks.begin();
+    if (callback)
+    {
+        // The key of the callback is left as it is by the move.
+        *callback = std::move(it->second._callback);
+        removeCallback(it);
+        return Payload();
+    }
 
-    std::string msg(front.data(), front.size());
+    const std::string msg = it->second._callback.serialize();
+    removeCallback(it);
+    LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
+    return Payload(msg.data(), msg.data() + msg.size());
+}
 
-    std::string id;
-    bool isTile = LOOLProtocol::matchPrefix("tile", msg);
-    bool isPreview = isTile && LOOLProtocol::getTokenStringFromMessage(msg, "id", id);
-    if (!isTile || isPreview)
+bool TileQueue::isInputNext(uint64_t seq) const
+{
+    for (auto it = _messages.begin(); it != _messages.end() && it->first < seq; ++it)
+    {
+        if (_previews.find(it->first) == _previews.end())
+            return false;
+    }
+
+    return true;
+}
+
+TileQueue::Payload TileQueue::takeInput()
+{
+    const auto input = _inputs.begin();
+    const auto it = _messages.find(input->first);
+    assert(it != _messages.end());
+    _lastInputTime = input->second;
+    _inputs.erase(input);
+
+    Payload front = std::move(it->second);
+    _messages.erase(it);
+    LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(front));
+    return front;
+}
+
+TileQueue::Payload TileQueue::getMessage(Callback* callback)
+{
+    drainCallbacks();
+
+    LOG_TRC("MessageQueue depth: " << getQueueSize());
+
+    // Don't take anything over the first message that is not a tile, or is
+    // a preview, to avoid starving it.
+    const uint64_t none = std::numeric_limits<uint64_t>::max();
+    const uint64_t firstMessage = _messages.empty() ? none : _messages.begin()->first;
+    const uint64_t firstCallback = _callbacks.empty() ? none : _callbacks.begin()->first;
+    const uint64_t barrier = std::min(firstMessage, firstCallback);
+    if (firstCallback < firstMessage && (_tiles.empty() || firstCallback < _tiles.begin()->first))
+        return takeCallback(callback);
+
+    // The input overtakes the tiles and previews, after the callbacks before it.
+    if (!_inputs.empty() && isInputNext(_inputs.begin()->first))
+    {
+        if (firstCallback < _inputs.begin()->first)
+            return takeCallback(callback);
+
+        return takeInput();
+    }
+
+    if (_tiles.empty() || barrier < _tiles.begin()->first)
     {
         // Don't combine non-tiles or tiles with id.
-        LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
-        getQueue().erase(getQueue().begin());
+        const uint64_t seq = _messages.begin()->first;
+        const Payload front = _messages.begin()->second;
+        LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(front));
 
-        // de-prioritize the other tiles with id - usually the previews in
-        // Impress
+        const bool isPreview = (_previews.find(seq) != _previews.end());
         if (isPreview)
+        {
+            removePreview(seq);
+
+            // de-prioritize the other tiles with id - usually the previews in
+            // Impress
             deprioritizePreviews();
+        }
+        else
+        {
+            _messages.erase(seq);
+        }
 
         return front;
     }
 
     // We are handling a tile; first try to find one that is at the cursor's
     // position, otherwise handle the one that is at the front
-    int prioritized = 0;
-    int prioritySoFar = -1;
-    for (size_t i = 0; i < getQueue().size(); ++i)
-    {
-        auto& it = getQueue()[i];
-        const std::string prio(it.data(), it.size());
-
-        // avoid starving - stop the search when we reach a non-tile,
-        // otherwise we may keep growing the queue of unhandled stuff (both
-        // tiles and non-tiles)
-        if (!LOOLProtocol::matchPrefix("tile", prio) ||
-            LOOLProtocol::getTokenStringFromMessage(prio, "id", id))
+    updatePriorities();
+    auto top = _tiles.begin();
+    for (auto it = _priorities.rbegin(); it != _priorities.rend() && it->first >= 0; ++it)
+    {
+        // The oldest request of this priority.
+        const uint64_t seq = *it->second.begin();
+        if (seq < barrier)
         {
+            top = _tiles.find(seq);
             break;
         }
-
-        const int p = priority(prio);
-        if (p > prioritySoFar)
-        {
-            prioritySoFar = p;
-            prioritized = i;
-            msg = prio;
-
-            // found the highest priority already?
-            if (prioritySoFar == static_cast<int>(_viewOrder.size()) - 1)
-            {
-                break;
-            }
-        }
     }
 
-    getQueue().erase(getQueue().begin() + prioritized);
-
     std::vector<TileDesc> tiles;
-    tiles.emplace_back(TileDesc::parse(msg));
-
-    // Combine as many tiles as possible with the top one.
-    for (size_t i = 0; i < getQueue().size(); )
+    tiles.emplace_back(top->second._tile);
+    removeTile(top);
+
+    // Combine as many tiles as possible with the top one, in the order they
+    // were requested.
+    std::vector<uint64_t> combined;
+    const auto row = _rows.find(RowKey(tiles[0]));
+    if (row != _rows.end())
     {
-        auto& it = getQueue()[i];
-        msg = std::string(it.data(), it.size());
-        if (!LOOLProtocol::matchPrefix("tile", msg) ||
-            LOOLProtocol::getTokenStringFromMessage(msg, "id", id))
+        const int tilePosY = tiles[0].getTilePosY();
+        const int tileHeight = tiles[0].getTileHeight();
+        for (auto it = row->second.lower_bound(tilePosY - tileHeight);
+             it != row->second.end() && it->first <= tilePosY + tileHeight; ++it)
         {
-            // Don't combine non-tiles or tiles with id.
-            ++i;
-            continue;
+            combined.insert(combined.end(), it->second.begin(), it->second.end());
         }
 
-        TileDesc tile2 = TileDesc::parse(msg);
-        LOG_TRC("Combining candidate: " << LOOLProtocol::getAbbreviatedMessage(msg));
+        std::sort(combined.begin(), combined.end());
+    }
 
-        // Check if it's on the same row.
-        if (tiles[0].onSameRow(tile2))
-        {
-            tiles.emplace_back(tile2);
-            getQueue().erase(getQueue().begin() + i);
-        }
-        else
-        {
-            ++i;
-        }
+    for (const uint64_t seq : combined)
+    {
+        const auto it = _tiles.find(seq);
+        LOG_TRC("Combining candidate: " << it->second._tile.serialize("tile"));
+        tiles.emplace_back(it->second._tile);
+        removeTile(it);
     }
 
-    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << getQueue().size() << " in queue.");
+    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << getQueueSize() << " in queue.");
 
     if (tiles.size() == 1)
     {
-        msg = tiles[0].serialize("tile");
+        const std::string msg = tiles[0].serialize("tile");
         LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
         return Payload(msg.data(), msg.data() + msg.size());
     }
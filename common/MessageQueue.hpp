@@ -11,13 +11,21 @@
 #define INCLUDED_MESSAGEQUEUE_HPP
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <map>
 #include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 
+#include "LockFreeRing.hpp"
+#include "TileDesc.hpp"
+
 /// Thread-safe message queue (FIFO).
 template <typename T>
 class MessageQueueBase
@@ -26,6 +34,7 @@ public:
     typedef T Payload;
 
     MessageQueueBase()
+        : _waiters(0)
     {
     }
 
@@ -63,17 +72,9 @@ public:
     {
         std::unique_lock<std::mutex> lock(_mutex);
 
-        if (timeoutMs > 0)
-        {
-            if (!_cv.wait_for(lock, std::chrono::milliseconds(timeoutMs),
-                              [this] { return wait_impl(); }))
-            {
-                return Payload();
-            }
-        }
-        else
+        if (!wait(lock, timeoutMs))
         {
-            _cv.wait(lock, [this] { return wait_impl(); });
+            return Payload();
         }
 
         return get_impl();
@@ -94,12 +95,51 @@ public:
     }
 
 protected:
+    /// Wait, with the lock, until there is a message.
+    /// timeoutMs can be 0 to signify infinity.
+    /// Returns false on timeout.
+    bool wait(std::unique_lock<std::mutex>& lock, const unsigned timeoutMs)
+    {
+        // See notify().
+        _waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool ready = true;
+        if (timeoutMs > 0)
+        {
+            ready = _cv.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                                 [this] { return wait_impl(); });
+        }
+        else
+        {
+            _cv.wait(lock, [this] { return wait_impl(); });
+        }
+
+        _waiters.fetch_sub(1);
+        return ready;
+    }
+
+    /// Wake a get() up, after queuing without the lock in a way
+    /// wait_impl() can see.
+    void notify()
+    {
+        // Either the waiter sees what was queued, or we see the waiter.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiters.load() > 0)
+        {
+            // Don't notify between its check and its wait.
+            std::unique_lock<std::mutex> lock(_mutex);
+            lock.unlock();
+            _cv.notify_one();
+        }
+    }
+
     virtual void put_impl(const Payload& value)
     {
         _queue.push_back(value);
     }
 
-    bool wait_impl() const
+    virtual bool wait_impl() const
     {
         return _queue.size() > 0;
     }
@@ -111,7 +151,7 @@ protected:
         return result;
     }
 
-    void clear_impl()
+    virtual void clear_impl()
     {
         _queue.clear();
     }
@@ -125,15 +165,186 @@ private:
     std::vector<Payload> _queue;
     mutable std::mutex _mutex;
     std::condition_variable _cv;
+    /// The get() calls waiting.
+    std::atomic<int> _waiters;
 };
 
 typedef MessageQueueBase<std::vector<char>> MessageQueue;
 
 /// MessageQueue specialized for priority handling of tiles.
+///
+/// The tiles are parsed when they are put, and indexed by their key, to
+/// replace the older requests of the same tile, by their rows, to combine
+/// them, and by their priority, to find the ones at the cursors first.
+/// The other messages, and the previews, are kept as they came.
+///
+/// The input of the users goes before the tiles and the previews, see
+/// MessageClass.
 class TileQueue : public MessageQueue
 {
     friend class TileQueueTests;
 
+public:
+    /// A callback of the document, for some of its views.
+    struct Callback
+    {
+        enum class Target
+        {
+            View,       ///< The view of _viewId.
+            All,        ///< All the views.
+            AllExcept   ///< All the views but the one of _viewId.
+        };
+
+        Callback()
+            : _target(Target::All)
+            , _viewId(-1)
+            , _type(-1)
+        {
+        }
+
+        Callback(Target target, int viewId, int type, const std::string& payload)
+            : _target(target)
+            , _viewId(viewId)
+            , _type(type)
+            , _payload(payload)
+        {
+        }
+
+        /// Whether it is a callback, as returned by get().
+        bool isValid() const { return _type >= 0; }
+
+        bool isForView(int viewId) const
+        {
+            return (_target == Target::View && _viewId == viewId) ||
+                   (_target == Target::AllExcept && _viewId != viewId) ||
+                   _target == Target::All;
+        }
+
+        /// Formats the callback as a "callback" message.
+        std::string serialize() const;
+
+        /// Reads a "callback" message, returns false when it is invalid.
+        static bool parse(const std::string& message, Callback& callback);
+
+        Target _target;
+        int _viewId;
+        int _type;
+        std::string _payload;
+    };
+
+    /// What a message is, for its priority.
+    enum class MessageClass
+    {
+        Input,      ///< Keyboard and mouse events, before the tiles and the previews.
+        Tile,       ///< Tiles, by their priority, see priority().
+        Preview,    ///< Tiles with an id, after the tiles.
+        Background  ///< The rest, eg. load or save, nothing of a session overtakes them.
+    };
+
+    /// The class of a message, by its first tokens.
+    static MessageClass getMessageClass(const Payload& value);
+
+    TileQueue()
+        : _prioritiesValid(false)
+        , _nextSeq(0)
+        , _cancelledVersionsTaken(0)
+        , _callbackRing(CallbackRingSize)
+        , _callbacksPut(0)
+        , _callbacksCoalesced(0)
+        , _callbackRingFull(0)
+        , _tilesCancelled(0)
+        , _tilesSuperseded(0)
+        , _tilesInvisible(0)
+        , _tilesOtherZoom(0)
+    {
+    }
+
+    using MessageQueue::get;
+
+    /// Thread safe obtaining of the next message, as get() does, but a
+    /// callback is returned in callback, as it is, with an empty payload.
+    Payload get(const unsigned timeoutMs, Callback& callback);
+
+    /// Queue a callback, from any thread, without the lock unless the
+    /// ring is full; it is merged with the queued ones when it's taken
+    /// out of the ring.
+    void putCallback(Callback&& callback)
+    {
+        ++_callbacksPut;
+        if (!_callbackRing.push(std::move(callback)))
+        {
+            ++_callbackRingFull;
+            for (;;)
+            {
+                // Make room, the callbacks in the ring go first.
+                std::unique_lock<std::mutex> lock = getLock();
+                drainCallbacks();
+                lock.unlock();
+
+                if (_callbackRing.push(std::move(callback)))
+                    break;
+
+                // Another thread is still writing the oldest one.
+                std::this_thread::yield();
+            }
+        }
+
+        notify();
+    }
+
+    /// Thread safe obtaining of the next input, when it may go before the
+    /// rest, without waiting; returns an empty payload otherwise.
+    Payload getInput()
+    {
+        std::unique_lock<std::mutex> lock = getLock();
+        drainCallbacks();
+
+        if (_inputs.empty() || !isInputNext(_inputs.begin()->first) ||
+            (!_callbacks.empty() && _callbacks.begin()->first < _inputs.begin()->first))
+        {
+            return Payload();
+        }
+
+        return takeInput();
+    }
+
+    /// When the last input returned was put, by the thread that gets them.
+    std::chrono::steady_clock::time_point getLastInputTime() const { return _lastInputTime; }
+
+    /// The versions of the tiles dropped by the queue itself since the
+    /// last call, to tell those who requested them.
+    std::vector<int> takeCancelledVersions()
+    {
+        std::vector<int> versions;
+        if (_tilesInvisible + _tilesOtherZoom == _cancelledVersionsTaken)
+            return versions;
+
+        std::unique_lock<std::mutex> lock = getLock();
+        versions.swap(_cancelledVersions);
+        _cancelledVersionsTaken = _tilesInvisible + _tilesOtherZoom;
+        return versions;
+    }
+
+    /// The tiles removed from the queue before they were rendered: by
+    /// canceltiles, by a newer request of the same tile, because no view
+    /// sees them anymore, or none has their zoom.
+    std::string getCancelStats() const
+    {
+        return "cancelledtiles=" + std::to_string(_tilesCancelled) +
+               " supersededtiles=" + std::to_string(_tilesSuperseded) +
+               " invisibletiles=" + std::to_string(_tilesInvisible) +
+               " otherzoomtiles=" + std::to_string(_tilesOtherZoom);
+    }
+
+    /// The callbacks put so far, the ones merged into others, and how
+    /// many times the ring was full.
+    std::string getCallbackStats() const
+    {
+        return "callbacks=" + std::to_string(_callbacksPut) +
+               " coalescedcallbacks=" + std::to_string(_callbacksCoalesced) +
+               " callbackringfull=" + std::to_string(_callbackRingFull);
+    }
+
 private:
     class CursorPosition
     {
@@ -188,6 +399,7 @@ public:
         }
 
         _viewOrder.push_back(viewId);
+        _prioritiesValid = false;
     }
 
     void removeCursorPosition(int viewId)
@@ -201,33 +413,210 @@ public:
         }
 
         _cursorPositions.erase(viewId);
+        _prioritiesValid = false;
     }
 
 protected:
     virtual void put_impl(const Payload& value) override;
 
+    virtual bool wait_impl() const override
+    {
+        return !_tiles.empty() || !_messages.empty() || !_callbacks.empty() ||
+               !_callbackRing.empty();
+    }
+
     virtual Payload get_impl() override;
 
+    virtual void clear_impl() override;
+
 private:
+    /// What identifies a requested tile, whatever its version.
+    struct TileKey
+    {
+        explicit TileKey(const TileDesc& tile)
+            : _part(tile.getPart())
+            , _width(tile.getWidth())
+            , _height(tile.getHeight())
+            , _tilePosX(tile.getTilePosX())
+            , _tilePosY(tile.getTilePosY())
+            , _tileWidth(tile.getTileWidth())
+            , _tileHeight(tile.getTileHeight())
+            , _id(tile.getId())
+            , _codec(tile.getCodec())
+        {
+        }
+
+        bool operator<(const TileKey& other) const
+        {
+            return std::tie(_part, _width, _height, _tilePosX, _tilePosY, _tileWidth, _tileHeight, _id, _codec) <
+                   std::tie(other._part, other._width, other._height, other._tilePosX, other._tilePosY,
+                            other._tileWidth, other._tileHeight, other._id, other._codec);
+        }
+
+        int _part;
+        int _width;
+        int _height;
+        int _tilePosX;
+        int _tilePosY;
+        int _tileWidth;
+        int _tileHeight;
+        int _id;
+        std::string _codec;
+    };
+
+    /// What the tiles that can be combined share, see TileDesc::onSameRow().
+    struct RowKey
+    {
+        explicit RowKey(const TileDesc& tile)
+            : _part(tile.getPart())
+            , _width(tile.getWidth())
+            , _height(tile.getHeight())
+            , _tileWidth(tile.getTileWidth())
+            , _tileHeight(tile.getTileHeight())
+            , _codec(tile.getCodec())
+        {
+        }
+
+        bool operator<(const RowKey& other) const
+        {
+            return std::tie(_part, _width, _height, _tileWidth, _tileHeight, _codec) <
+                   std::tie(other._part, other._width, other._height, other._tileWidth,
+                            other._tileHeight, other._codec);
+        }
+
+        int _part;
+        int _width;
+        int _height;
+        int _tileWidth;
+        int _tileHeight;
+        std::string _codec;
+    };
+
+    struct QueuedTile
+    {
+        TileDesc _tile;
+        /// See priority(), valid with _prioritiesValid only.
+        int _priority;
+    };
+
+    typedef std::map<uint64_t, QueuedTile> Tiles;
+
+    struct QueuedCallback
+    {
+        Callback _callback;
+        /// The invalidated rectangle, for invalidations.
+        bool _hasRectangle;
+        int _x;
+        int _y;
+        int _width;
+        int _height;
+        int _part;
+        /// The view in the payload, for view callbacks.
+        std::string _payloadViewId;
+    };
+
+    /// What the queue knows of a view, from the messages of its session.
+    struct View
+    {
+        View()
+            : _hasArea(false)
+            , _x(0)
+            , _y(0)
+            , _width(0)
+            , _height(0)
+            , _hasZoom(false)
+            , _tileTwipWidth(0)
+            , _tileTwipHeight(0)
+        {
+        }
+
+        /// The visible area, and around it.
+        bool _hasArea;
+        int _x;
+        int _y;
+        int _width;
+        int _height;
+        /// The zoom, as the size of the tiles in twips.
+        bool _hasZoom;
+        int _tileTwipWidth;
+        int _tileTwipHeight;
+    };
+
+    /// Follow the visible area and zoom of a view, from a message of its session.
+    void updateView(const std::string& sessionId, const std::string& command, const Payload& value);
+
+    /// Remove the tiles that no view sees, once all the views told their area.
+    void cancelInvisibleTiles();
+
+    /// Remove the tiles of no view's zoom, once all the views told theirs.
+    void cancelOtherZoomTiles();
+
+    /// The number of queued messages, tiles and callbacks included, but
+    /// not the callbacks still in the ring.
+    size_t getQueueSize() const { return _tiles.size() + _messages.size() + _callbacks.size(); }
+
+    /// Take the next message, or callback, when callback is given.
+    Payload getMessage(Callback* callback);
+
+    /// Take the oldest callback, as a message unless callback is given.
+    Payload takeCallback(Callback* callback);
+
+    /// Whether the input may go before the tiles and previews queued:
+    /// no other message was put before it; the callbacks put before it
+    /// go first still.
+    bool isInputNext(uint64_t seq) const;
+
+    /// Take the oldest input.
+    Payload takeInput();
+
+    /// Move the callbacks from the ring into the queue.
+    void drainCallbacks();
+
+    /// Queue a callback, merging it with the ones queued already.
+    void queueCallback(Callback&& callback);
+
+    /// What the callbacks that may be merged share: type, target and view.
+    typedef std::tuple<int, int, int> CallbackKey;
+
+    static CallbackKey getCallbackKey(const Callback& callback)
+    {
+        return CallbackKey(callback._type, static_cast<int>(callback._target), callback._viewId);
+    }
+
+    /// Remove a callback from the queue and its index.
+    void removeCallback(std::map<uint64_t, QueuedCallback>::iterator it);
+
+    /// Queue a tile, replacing an older request for it.
+    /// The payload of previews is kept, when given.
+    void putTile(const TileDesc& tile, const Payload& value);
+
     /// Search the queue for a duplicate tile and remove it (if present).
-    void removeTileDuplicate(const std::string& tileMsg);
+    void removeTileDuplicate(const TileKey& key);
+
+    /// Remove a tile, which is not a preview, from the queue and its indexes.
+    void removeTile(Tiles::iterator it);
+
+    /// Remove a preview from the queue.
+    void removePreview(uint64_t seq);
+
+    /// Compute again the priorities of the tiles, after the cursors changed.
+    void updatePriorities();
 
     /// Search the queue for a duplicate callback and remove it (if present).
     ///
     /// This removes also callbacks that are made invalid by the current
-    /// message, like the new cursor position invalidates the old one etc.
-    ///
-    /// @return New message to put into the queue.  If empty, use what was in callbackMsg.
-    std::string removeCallbackDuplicate(const std::string& callbackMsg);
+    /// one, like the new cursor position invalidates the old one etc. An
+    /// invalidation can grow by those it is merged with.
+    void removeCallbackDuplicate(QueuedCallback& callback);
 
     /// De-prioritize the previews (tiles with 'id') - move them to the end of
     /// the queue.
     void deprioritizePreviews();
 
-    /// Priority of the given tile message.
+    /// Priority of the given tile.
     /// -1 means the lowest prio (the tile does not intersect any of the cursors),
     /// the higher the number, the bigger is priority [up to _viewOrder.size()-1].
-    int priority(const std::string& tileMsg);
+    int priority(const TileDesc& tile);
 
 private:
     std::map<int, CursorPosition> _cursorPositions;
@@ -235,6 +624,59 @@ private:
     /// Check the views in the order of how the editing (cursor movement) has
     /// been happening (0 == oldest, size() - 1 == newest).
     std::vector<int> _viewOrder;
+
+    /// The tiles, but the previews, by the order they were put in.
+    Tiles _tiles;
+
+    /// The other messages, previews included, by the order they were put in.
+    std::map<uint64_t, Payload> _messages;
+
+    /// The previews among the _messages, and their keys.
+    std::map<uint64_t, TileKey> _previews;
+
+    /// The inputs among the _messages, and when they were put.
+    std::map<uint64_t, std::chrono::steady_clock::time_point> _inputs;
+    std::chrono::steady_clock::time_point _lastInputTime;
+
+    /// Where the tile, or the preview, of a key is in the queue.
+    std::map<TileKey, uint64_t> _tileIndex;
+
+    /// The tiles by what they can be combined on, and their vertical position.
+    std::map<RowKey, std::map<int, std::set<uint64_t>>> _rows;
+
+    /// The tiles by their priority, when _prioritiesValid.
+    std::map<int, std::set<uint64_t>> _priorities;
+    bool _prioritiesValid;
+
+    /// The callbacks, by the order they were put in.
+    std::map<uint64_t, QueuedCallback> _callbacks;
+
+    /// The callbacks by what they can be merged on.
+    std::map<CallbackKey, std::set<uint64_t>> _callbackIndex;
+
+    /// The order of the next message put in the queue.
+    uint64_t _nextSeq;
+
+    /// The views, by the id of their session.
+    std::map<std::string, View> _views;
+
+    /// The versions of the tiles dropped by the queue, not told yet, and
+    /// the count of those taken, by the thread that takes them.
+    std::vector<int> _cancelledVersions;
+    uint64_t _cancelledVersionsTaken;
+
+    /// The callbacks put without the lock.
+    static const size_t CallbackRingSize = 4096;
+    LockFreeRing<Callback> _callbackRing;
+
+    std::atomic<uint64_t> _callbacksPut;
+    std::atomic<uint64_t> _callbacksCoalesced;
+    std::atomic<uint64_t> _callbackRingFull;
+
+    std::atomic<uint64_t> _tilesCancelled;
+    std::atomic<uint64_t> _tilesSuperseded;
+    std::atomic<uint64_t> _tilesInvisible;
+    std::atomic<uint64_t> _tilesOtherZoom;
 };
 
 #endif
@@ -45,12 +45,26 @@
  *        Chris Wilson <chris@chris-wilson.co.uk>
  */
 
+#ifndef INCLUDED_PNG_HPP
+#define INCLUDED_PNG_HPP
+
 #define PNG_SKIP_SETJMP_CHECK
 #include <png.h>
 #include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #include "Log.hpp"
 #include "SpookyV2.h"
@@ -79,31 +93,238 @@ extern "C"
 }
 
 
-/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
-static void
-unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
+/// Reciprocals of the alpha values, rounded up by one ulp, so that
+/// truncating (c * 255 + a / 2) * recip[a] matches the integer division
+/// (c * 255 + a / 2) / a exactly over the whole 8-bit domain; see
+/// WhiteBoxTests::testUnpremultiply. recip[0] is zero, so fully
+/// transparent pixels come out as zero without a branch.
+inline const float* getUnpremultiplyTable()
 {
-    unsigned int i;
+    struct Table
+    {
+        float _recip[256];
+        Table()
+        {
+            _recip[0] = 0;
+            for (int a = 1; a < 256; ++a)
+                _recip[a] = std::nextafter(1.0f / a, 2.0f);
+        }
+    };
+    static const Table table;
+    return table._recip;
+}
 
-    for (i = 0; i < row_info->rowbytes; i += 4)
+/// Unpremultiplies a row of width pixels and converts native endian ARGB => RGBA bytes.
+inline void unpremultiplyRowScalar(const unsigned char* src, unsigned char* dst, int width)
+{
+    const float* recip = getUnpremultiplyTable();
+    for (int i = 0; i < width; ++i)
     {
-        uint8_t *b = &data[i];
         uint32_t pixel;
-        uint8_t  alpha;
+        std::memcpy(&pixel, src + i * 4, sizeof(uint32_t));
+        const uint32_t alpha = pixel >> 24;
+        const uint32_t half = alpha / 2;
+        const float r = recip[alpha];
+
+        unsigned char* d = dst + i * 4;
+        d[0] = static_cast<uint32_t>((((pixel >> 16) & 0xff) * 255 + half) * r);
+        d[1] = static_cast<uint32_t>((((pixel >>  8) & 0xff) * 255 + half) * r);
+        d[2] = static_cast<uint32_t>((((pixel >>  0) & 0xff) * 255 + half) * r);
+        d[3] = alpha;
+    }
+}
 
-        std::memcpy (&pixel, b, sizeof (uint32_t));
-        alpha = (pixel & 0xff000000) >> 24;
-        if (alpha == 0)
-        {
-            b[0] = b[1] = b[2] = b[3] = 0;
-        }
-        else
-        {
-            b[0] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
-            b[1] = (((pixel & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
-            b[2] = (((pixel & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
-            b[3] = alpha;
-        }
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_SIMD_UNPREMULTIPLY 1
+
+/// Four pixels at a time; the reciprocal is computed with a division per
+/// vector and rounded up by an ulp, identically to getUnpremultiplyTable().
+__attribute__((target("sse4.1")))
+inline void unpremultiplyRowSSE41(const unsigned char* src, unsigned char* dst, int width)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i c255 = _mm_set1_epi32(255);
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    int i = 0;
+    for (; i + 4 <= width; i += 4)
+    {
+        const __m128i pixel = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+        const __m128i alpha = _mm_srli_epi32(pixel, 24);
+        const __m128i half = _mm_srli_epi32(alpha, 1);
+
+        __m128 recip = _mm_div_ps(one, _mm_cvtepi32_ps(alpha));
+        recip = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(recip), _mm_set1_epi32(1)));
+        recip = _mm_and_ps(recip, _mm_castsi128_ps(_mm_cmpgt_epi32(alpha, _mm_setzero_si128())));
+
+        const __m128i r = _mm_and_si128(_mm_srli_epi32(pixel, 16), mask);
+        const __m128i g = _mm_and_si128(_mm_srli_epi32(pixel, 8), mask);
+        const __m128i b = _mm_and_si128(pixel, mask);
+
+        const __m128i outR = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_mullo_epi32(r, c255), half)), recip));
+        const __m128i outG = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_mullo_epi32(g, c255), half)), recip));
+        const __m128i outB = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_mullo_epi32(b, c255), half)), recip));
+
+        __m128i out = _mm_slli_epi32(alpha, 24);
+        out = _mm_or_si128(out, _mm_and_si128(outR, mask));
+        out = _mm_or_si128(out, _mm_slli_epi32(_mm_and_si128(outG, mask), 8));
+        out = _mm_or_si128(out, _mm_slli_epi32(_mm_and_si128(outB, mask), 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), out);
+    }
+
+    unpremultiplyRowScalar(src + i * 4, dst + i * 4, width - i);
+}
+
+/// Eight pixels at a time, gathering the reciprocals from the table.
+__attribute__((target("avx2")))
+inline void unpremultiplyRowAVX2(const unsigned char* src, unsigned char* dst, int width)
+{
+    const float* recipTable = getUnpremultiplyTable();
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i c255 = _mm256_set1_epi32(255);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8)
+    {
+        const __m256i pixel = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+        const __m256i alpha = _mm256_srli_epi32(pixel, 24);
+        const __m256i half = _mm256_srli_epi32(alpha, 1);
+        const __m256 recip = _mm256_i32gather_ps(recipTable, alpha, 4);
+
+        const __m256i r = _mm256_and_si256(_mm256_srli_epi32(pixel, 16), mask);
+        const __m256i g = _mm256_and_si256(_mm256_srli_epi32(pixel, 8), mask);
+        const __m256i b = _mm256_and_si256(pixel, mask);
+
+        const __m256i outR = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_mullo_epi32(r, c255), half)), recip));
+        const __m256i outG = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_mullo_epi32(g, c255), half)), recip));
+        const __m256i outB = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_mullo_epi32(b, c255), half)), recip));
+
+        __m256i out = _mm256_slli_epi32(alpha, 24);
+        out = _mm256_or_si256(out, _mm256_and_si256(outR, mask));
+        out = _mm256_or_si256(out, _mm256_slli_epi32(_mm256_and_si256(outG, mask), 8));
+        out = _mm256_or_si256(out, _mm256_slli_epi32(_mm256_and_si256(outB, mask), 16));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), out);
+    }
+
+    unpremultiplyRowScalar(src + i * 4, dst + i * 4, width - i);
+}
+#endif
+
+typedef void (*UnpremultiplyRowFn)(const unsigned char* src, unsigned char* dst, int width);
+
+/// Pick the fastest unpremultiply kernel the CPU supports.
+inline UnpremultiplyRowFn selectUnpremultiplyRow()
+{
+#ifdef HAVE_SIMD_UNPREMULTIPLY
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return unpremultiplyRowAVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return unpremultiplyRowSSE41;
+#endif
+    return unpremultiplyRowScalar;
+}
+
+/// Unpremultiplies a row of width pixels and converts native endian ARGB => RGBA bytes.
+inline void unpremultiplyRow(const unsigned char* src, unsigned char* dst, int width)
+{
+    static const UnpremultiplyRowFn unpremultiply = selectUnpremultiplyRow();
+    unpremultiply(src, dst, width);
+}
+
+/// Blends a row of width premultiplied pixels of @from over @to, in place:
+/// to = from + to * (255 - alpha(from)) / 255 for each of the 4 channels,
+/// alpha being the 4th byte, truncated like the floating point version was.
+inline void alphaBlendRow(const unsigned char* from, unsigned char* to, int width)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i one = _mm_set1_epi16(1);
+    for (; i + 4 <= width; i += 4)
+    {
+        const __m128i src = _mm_loadu_si128(reinterpret_cast<const __m128i*>(from + i * 4));
+
+        // Most of a watermark is fully transparent.
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(src, zero)) == 0xffff)
+            continue;
+
+        const __m128i dst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(to + i * 4));
+        __m128i lo = _mm_unpacklo_epi8(dst, zero);
+        __m128i hi = _mm_unpackhi_epi8(dst, zero);
+
+        // Broadcast the alpha of each source pixel to its 4 channels.
+        const __m128i srcLo = _mm_unpacklo_epi8(src, zero);
+        const __m128i srcHi = _mm_unpackhi_epi8(src, zero);
+        const __m128i invLo = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcLo, 0xff), 0xff));
+        const __m128i invHi = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcHi, 0xff), 0xff));
+
+        // x / 255 == (x + 1 + (x >> 8)) >> 8 for x <= 255 * 255.
+        lo = _mm_mullo_epi16(lo, invLo);
+        hi = _mm_mullo_epi16(hi, invHi);
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+
+        const __m128i out = _mm_adds_epu8(src, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(to + i * 4), out);
+    }
+#endif
+    for (; i < width; ++i)
+    {
+        const unsigned char* f = from + i * 4;
+        unsigned char* t = to + i * 4;
+        const unsigned inv = 255 - f[3];
+        for (int c = 0; c < 4; ++c)
+            t[c] = std::min(255u, f[c] + t[c] * inv / 255);
+    }
+}
+
+/// The tile encoders a client can choose from with the 'codec' token.
+/// All of them produce standard PNG streams, so they are interchangeable
+/// for caching; they only trade compression ratio for encoding speed.
+enum class Codec
+{
+    Png,    ///< libpng defaults: adaptive filtering, zlib level 6.
+    FastPng ///< Fixed 'Up' filter, zlib level 1 with run-length matching.
+};
+
+inline Codec codecFromString(const std::string& name)
+{
+    if (name == "fastpng")
+        return Codec::FastPng;
+
+    return Codec::Png;
+}
+
+inline const char* codecToString(Codec codec)
+{
+    switch (codec)
+    {
+    case Codec::FastPng:
+        return "fastpng";
+    case Codec::Png:
+        break;
+    }
+
+    return "png";
+}
+
+/// Set the compression parameters of the given codec.
+inline void setupCodec(png_structp png_ptr, Codec codec)
+{
+    switch (codec)
+    {
+    case Codec::FastPng:
+        png_set_compression_level(png_ptr, Z_BEST_SPEED);
+        png_set_compression_strategy(png_ptr, Z_RLE);
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_UP);
+        break;
+    case Codec::Png:
+#if MOBILEAPP
+        png_set_compression_level(png_ptr, Z_BEST_SPEED);
+#endif
+        break;
     }
 }
 
@@ -113,7 +334,8 @@ inline
 bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
                           int width, int height,
                           int bufferWidth, int bufferHeight,
-                          std::vector<char>& output, LibreOfficeKitTileMode mode)
+                          std::vector<char>& output, LibreOfficeKitTileMode mode,
+                          Codec codec = Codec::Png)
 {
     if (bufferWidth < width || bufferHeight < height)
     {
@@ -130,9 +352,7 @@ bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
         return false;
     }
 
-#if MOBILEAPP
-    png_set_compression_level(png_ptr, Z_BEST_SPEED);
-#endif
+    setupCodec(png_ptr, codec);
 
     png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
@@ -141,17 +361,26 @@ bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
 
     png_write_info(png_ptr, info_ptr);
 
+    auto a = std::chrono::steady_clock::now();
+
     if (mode == LOK_TILEMODE_BGRA)
     {
-        png_set_write_user_transform_fn (png_ptr, unpremultiply_data);
+        // Convert whole rows up-front rather than using a per-row libpng user transform.
+        std::vector<unsigned char> row(width * 4);
+        for (int y = 0; y < height; ++y)
+        {
+            size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+            unpremultiplyRow(pixmap + position, row.data(), width);
+            png_write_row(png_ptr, row.data());
+        }
     }
-
-    auto a = std::chrono::steady_clock::now();
-
-    for (int y = 0; y < height; ++y)
+    else
     {
-        size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
-        png_write_row(png_ptr, pixmap + position);
+        for (int y = 0; y < height; ++y)
+        {
+            size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+            png_write_row(png_ptr, pixmap + position);
+        }
     }
 
     png_write_end(png_ptr, info_ptr);
@@ -160,8 +389,9 @@ bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
 
     std::chrono::milliseconds::rep duration = std::chrono::duration_cast<std::chrono::milliseconds>(b-a).count();
 
-    static std::chrono::milliseconds::rep totalDuration = 0;
-    static int nCalls = 0;
+    // We may be called from several encoder threads at once.
+    static std::atomic<std::chrono::milliseconds::rep> totalDuration(0);
+    static std::atomic<int> nCalls(0);
 
     totalDuration += duration;
     nCalls += 1;
@@ -174,9 +404,10 @@ bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
 
 inline
 bool encodeBufferToPNG(unsigned char* pixmap, int width, int height,
-                       std::vector<char>& output, LibreOfficeKitTileMode mode)
+                       std::vector<char>& output, LibreOfficeKitTileMode mode,
+                       Codec codec = Codec::Png)
 {
-    return encodeSubBufferToPNG(pixmap, 0, 0, width, height, width, height, output, mode);
+    return encodeSubBufferToPNG(pixmap, 0, 0, width, height, width, height, output, mode, codec);
 }
 
 inline
@@ -207,6 +438,196 @@ uint64_t hashSubBuffer(unsigned char* pixmap, size_t startX, size_t startY,
     return hash1;
 }
 
+/// Hashes a row of pixels with SpookyHash, the portable fallback.
+inline uint64_t hashRowScalar(const unsigned char* data, size_t size)
+{
+    return SpookyHash::Hash64(data, size, 1073741789);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CRC32C_HASH 1
+
+/// Hashes a row of pixels with the SSE4.2 crc32 instruction. It has a
+/// latency of 3 cycles but a throughput of 1, so four independent CRC32C
+/// streams are interleaved, then folded into 64 bits.
+__attribute__((target("sse4.2")))
+inline uint64_t hashRowCRC32C(const unsigned char* data, size_t size)
+{
+    uint64_t crc0 = 0x9e3779b9;
+    uint64_t crc1 = 0x7f4a7c15;
+    uint64_t crc2 = 0x85ebca6b;
+    uint64_t crc3 = 0xc2b2ae35;
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        uint64_t words[4];
+        std::memcpy(words, data + i, sizeof(words));
+        crc0 = _mm_crc32_u64(crc0, words[0]);
+        crc1 = _mm_crc32_u64(crc1, words[1]);
+        crc2 = _mm_crc32_u64(crc2, words[2]);
+        crc3 = _mm_crc32_u64(crc3, words[3]);
+    }
+
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        crc0 = _mm_crc32_u64(crc0, word);
+    }
+
+    for (; i < size; ++i)
+        crc1 = _mm_crc32_u8(crc1, data[i]);
+
+    return ((crc0 << 32) | crc1) ^ (((crc2 << 32) | crc3) * 0x9e3779b97f4a7c15ULL) ^ size;
+}
+#endif
+
+typedef uint64_t (*HashRowFn)(const unsigned char* data, size_t size);
+
+/// Pick the fastest row hash the CPU supports. The row hashes only need to
+/// be stable within a process: they only index the rows of the delta history,
+/// where a match is always checked against the pixels.
+inline HashRowFn selectHashRow()
+{
+#ifdef HAVE_CRC32C_HASH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return hashRowCRC32C;
+#endif
+    return hashRowScalar;
+}
+
+/// Hashes a row of pixels, @size in bytes.
+inline uint64_t hashRow(const unsigned char* data, size_t size)
+{
+    static const HashRowFn hash = selectHashRow();
+    return hash(data, size);
+}
+
+/// Returns true if all the pixels of the row equal @pixel.
+inline bool isUniformRow(const uint32_t* row, int width, uint32_t pixel)
+{
+    int x = 0;
+#ifdef __SSE2__
+    // Compare 16 pixels at a time, bailing out on the first block that differs.
+    const __m128i ref = _mm_set1_epi32(pixel);
+    for (; x + 16 <= width; x += 16)
+    {
+        const __m128i* block = reinterpret_cast<const __m128i*>(row + x);
+        const __m128i eq = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128(block), ref),
+                          _mm_cmpeq_epi32(_mm_loadu_si128(block + 1), ref)),
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128(block + 2), ref),
+                          _mm_cmpeq_epi32(_mm_loadu_si128(block + 3), ref)));
+        if (_mm_movemask_epi8(eq) != 0xffff)
+            return false;
+    }
+#endif
+    for (; x < width; ++x)
+    {
+        if (row[x] != pixel)
+            return false;
+    }
+
+    return true;
+}
+
+/// The colour of @pixel as 'rrggbbaa' hex, un-premultiplied as it would be in the PNG.
+inline std::string pixelToColor(const unsigned char* pixel, LibreOfficeKitTileMode mode)
+{
+    unsigned char rgba[4];
+    if (mode == LOK_TILEMODE_BGRA)
+        unpremultiplyRowScalar(pixel, rgba, 1);
+    else
+        std::memcpy(rgba, pixel, sizeof(rgba));
+
+    char hex[9];
+    snprintf(hex, sizeof(hex), "%02x%02x%02x%02x", rgba[0], rgba[1], rgba[2], rgba[3]);
+    return hex;
+}
+
+/// Returns true if the sub-buffer is of a single colour, then set in @color
+/// as 'rrggbbaa' hex, un-premultiplied as it would be in the PNG.
+inline
+bool isSolidSubBuffer(const unsigned char* pixmap, size_t startX, size_t startY,
+                      int width, int height, int bufferWidth,
+                      LibreOfficeKitTileMode mode, std::string& color)
+{
+    if (width <= 0 || height <= 0)
+        return false;
+
+    uint32_t pixel;
+    const unsigned char* first = pixmap + (startY * bufferWidth + startX) * 4;
+    std::memcpy(&pixel, first, sizeof(pixel));
+    for (int y = 0; y < height; ++y)
+    {
+        const size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+        if (!isUniformRow(reinterpret_cast<const uint32_t*>(pixmap + position), width, pixel))
+            return false;
+    }
+
+    color = pixelToColor(first, mode);
+    return true;
+}
+
+/// What we need to know about a freshly painted tile, gathered in a single
+/// pass over its rows while they are hot in the cache.
+struct TileHashes
+{
+    /// Identifies the content of the whole tile, 0 if invalid. It becomes
+    /// its wireid, with no check of the pixels, so it is a full 64-bit hash
+    /// of them, as hashSubBuffer() computes.
+    uint64_t _hash;
+    /// One hash per row, to find moved rows when creating deltas. Weaker, a
+    /// match is checked against the pixels.
+    std::vector<uint64_t> _rowHashes;
+    /// All the pixels of the tile are the same.
+    bool _solid;
+
+    TileHashes()
+        : _hash(0)
+        , _solid(false)
+    {
+    }
+};
+
+/// Computes the tile hash, the row hashes and the uniform-colour check of
+/// the sub-buffer in one go, while each row is in the cache.
+inline
+void hashSubBufferRows(const unsigned char* pixmap, size_t startX, size_t startY,
+                       int width, int height, int bufferWidth, int bufferHeight,
+                       TileHashes& hashes)
+{
+    hashes._rowHashes.clear();
+    hashes._hash = 0; // magic invalid hash.
+    hashes._solid = false;
+    if (width <= 0 || height <= 0 || bufferWidth < width || bufferHeight < height)
+        return;
+
+    hashes._rowHashes.resize(height);
+    hashes._solid = true;
+
+    SpookyHash hash;
+    hash.Init(1073741789, 1073741789); // Seeds can be anything.
+
+    uint32_t pixel;
+    std::memcpy(&pixel, pixmap + (startY * bufferWidth + startX) * 4, sizeof(pixel));
+    for (int y = 0; y < height; ++y)
+    {
+        const size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+        hash.Update(pixmap + position, width * 4);
+        hashes._rowHashes[y] = hashRow(pixmap + position, width * 4);
+        if (hashes._solid)
+            hashes._solid = isUniformRow(reinterpret_cast<const uint32_t*>(pixmap + position), width, pixel);
+    }
+
+    uint64_t hash1;
+    uint64_t hash2;
+    hash.Final(&hash1, &hash2);
+    hashes._hash = hash1;
+}
+
 static
 void readTileData(png_structp png_ptr, png_bytep data, png_size_t length)
 {
@@ -280,4 +701,6 @@ std::vector<png_bytep> decodePNG(std::stringstream& stream, png_uint_32& height,
 
 }
 
+#endif
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,7 +10,9 @@
 #ifndef INCLUDED_RECTANGLE_HPP
 #define INCLUDED_RECTANGLE_HPP
 
+#include <algorithm>
 #include <limits>
+#include <vector>
 
 namespace Util
 {
@@ -39,7 +41,7 @@ public:
         , _y2(y + height)
     {}
 
-    void extend(Rectangle& rectangle)
+    void extend(const Rectangle& rectangle)
     {
         if (rectangle._x1 < _x1)
             _x1 = rectangle._x1;
@@ -91,27 +93,27 @@ public:
         return _y2;
     }
 
-    int getWidth()
+    int getWidth() const
     {
         return _x2 - _x1;
     }
 
-    int getHeight()
+    int getHeight() const
     {
         return _y2 - _y1;
     }
 
-    bool isValid()
+    bool isValid() const
     {
         return _x1 <= _x2 && _y1 <= _y2;
     }
 
-    bool hasSurface()
+    bool hasSurface() const
     {
         return _x1 < _x2 && _y1 < _y2;
     }
 
-    bool intersects(const Rectangle& rOther)
+    bool intersects(const Rectangle& rOther) const
     {
         Util::Rectangle intersection;
         intersection._x1 = std::max(_x1, rOther._x1);
@@ -120,6 +122,247 @@ public:
         intersection._y2 = std::min(_y2, rOther._y2);
         return intersection.isValid();
     }
+
+    /// Whether the other rectangle is inside this one.
+    bool contains(const Rectangle& rOther) const
+    {
+        return _x1 <= rOther._x1 && rOther._x2 <= _x2 && _y1 <= rOther._y1 && rOther._y2 <= _y2;
+    }
+
+    /// Whether the rectangles share some surface, not just an edge.
+    bool overlaps(const Rectangle& rOther) const
+    {
+        return std::max(_x1, rOther._x1) < std::min(_x2, rOther._x2) &&
+               std::max(_y1, rOther._y1) < std::min(_y2, rOther._y2);
+    }
+};
+
+/// The union of rectangles, eg. the invalidated area of a part.
+///
+/// The rectangles are kept apart from each other, those that share a
+/// whole edge are joined, and when there are too many, the two that are
+/// the closest to a rectangle are replaced by their bounds, so that the
+/// region is always described by a handful of rectangles.
+class Region
+{
+public:
+    /// The most rectangles kept, beyond that the region grows a little.
+    static const size_t MaxRectangles = 16;
+
+    bool empty() const { return _rectangles.empty(); }
+
+    void clear() { _rectangles.clear(); }
+
+    const std::vector<Rectangle>& getRectangles() const { return _rectangles; }
+
+    /// The smallest rectangle containing the region.
+    Rectangle getBounds() const
+    {
+        Rectangle bounds;
+        for (const Rectangle& rectangle : _rectangles)
+            bounds.extend(rectangle);
+
+        return bounds;
+    }
+
+    /// Whether all of the rectangle is in the region.
+    bool contains(const Rectangle& rectangle) const
+    {
+        std::vector<Rectangle> pieces;
+        if (rectangle.hasSurface())
+            pieces.push_back(rectangle);
+
+        for (const Rectangle& existing : _rectangles)
+        {
+            std::vector<Rectangle> remaining;
+            for (const Rectangle& piece : pieces)
+                subtract(piece, existing, remaining);
+            pieces.swap(remaining);
+        }
+
+        return pieces.empty();
+    }
+
+    /// Whether some of the rectangle is in the region.
+    bool intersects(const Rectangle& rectangle) const
+    {
+        for (const Rectangle& existing : _rectangles)
+        {
+            if (existing.overlaps(rectangle))
+                return true;
+        }
+
+        return false;
+    }
+
+    /// Adds the rectangle to the region (union).
+    void add(const Rectangle& rectangle)
+    {
+        if (!rectangle.hasSurface())
+            return;
+
+        insert(rectangle);
+        join();
+
+        while (_rectangles.size() > MaxRectangles)
+        {
+            const size_t count = _rectangles.size();
+            reduce();
+            if (_rectangles.size() >= count)
+            {
+                // The bounds cut others into pieces, give up on the details.
+                const Rectangle bounds = getBounds();
+                _rectangles.assign(1, bounds);
+            }
+        }
+    }
+
+    /// Keeps only what is inside the rectangle (intersection).
+    void intersect(const Rectangle& rectangle)
+    {
+        std::vector<Rectangle> clipped;
+        for (const Rectangle& existing : _rectangles)
+        {
+            const Rectangle clip = makeRectangle(std::max(existing.getLeft(), rectangle.getLeft()),
+                                                 std::max(existing.getTop(), rectangle.getTop()),
+                                                 std::min(existing.getRight(), rectangle.getRight()),
+                                                 std::min(existing.getBottom(), rectangle.getBottom()));
+            if (clip.hasSurface())
+                clipped.push_back(clip);
+        }
+
+        _rectangles.swap(clipped);
+        join();
+    }
+
+private:
+    static Rectangle makeRectangle(int x1, int y1, int x2, int y2)
+    {
+        Rectangle rectangle;
+        rectangle.setLeft(x1);
+        rectangle.setTop(y1);
+        rectangle.setRight(x2);
+        rectangle.setBottom(y2);
+        return rectangle;
+    }
+
+    /// Appends to pieces what of the rectangle is outside the hole, as up to
+    /// 4 rectangles: above, below, left and right of it.
+    static void subtract(const Rectangle& rectangle, const Rectangle& hole,
+                         std::vector<Rectangle>& pieces)
+    {
+        if (!rectangle.overlaps(hole))
+        {
+            pieces.push_back(rectangle);
+            return;
+        }
+
+        if (rectangle.getTop() < hole.getTop())
+            pieces.push_back(makeRectangle(rectangle.getLeft(), rectangle.getTop(),
+                                           rectangle.getRight(), hole.getTop()));
+        if (hole.getBottom() < rectangle.getBottom())
+            pieces.push_back(makeRectangle(rectangle.getLeft(), hole.getBottom(),
+                                           rectangle.getRight(), rectangle.getBottom()));
+
+        const int top = std::max(rectangle.getTop(), hole.getTop());
+        const int bottom = std::min(rectangle.getBottom(), hole.getBottom());
+        if (rectangle.getLeft() < hole.getLeft())
+            pieces.push_back(makeRectangle(rectangle.getLeft(), top, hole.getLeft(), bottom));
+        if (hole.getRight() < rectangle.getRight())
+            pieces.push_back(makeRectangle(hole.getRight(), top, rectangle.getRight(), bottom));
+    }
+
+    /// Adds what of the rectangle isn't in the region yet, and drops
+    /// the rectangles it covers.
+    void insert(const Rectangle& rectangle)
+    {
+        _rectangles.erase(std::remove_if(_rectangles.begin(), _rectangles.end(),
+                                         [&rectangle](const Rectangle& existing)
+                                         { return rectangle.contains(existing); }),
+                          _rectangles.end());
+
+        std::vector<Rectangle> pieces(1, rectangle);
+        for (const Rectangle& existing : _rectangles)
+        {
+            std::vector<Rectangle> remaining;
+            for (const Rectangle& piece : pieces)
+                subtract(piece, existing, remaining);
+            pieces.swap(remaining);
+            if (pieces.empty())
+                return;
+        }
+
+        _rectangles.insert(_rectangles.end(), pieces.begin(), pieces.end());
+    }
+
+    /// Joins the rectangles sharing a whole edge.
+    void join()
+    {
+        bool joined = true;
+        while (joined)
+        {
+            joined = false;
+            for (size_t i = 0; i < _rectangles.size() && !joined; ++i)
+            {
+                for (size_t j = i + 1; j < _rectangles.size(); ++j)
+                {
+                    const Rectangle& a = _rectangles[i];
+                    const Rectangle& b = _rectangles[j];
+                    const bool sameColumn = a.getLeft() == b.getLeft() && a.getRight() == b.getRight() &&
+                                            (a.getBottom() == b.getTop() || b.getBottom() == a.getTop());
+                    const bool sameRow = a.getTop() == b.getTop() && a.getBottom() == b.getBottom() &&
+                                         (a.getRight() == b.getLeft() || b.getRight() == a.getLeft());
+                    if (sameColumn || sameRow)
+                    {
+                        _rectangles[i].extend(b);
+                        _rectangles.erase(_rectangles.begin() + j);
+                        joined = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    /// Replaces the two rectangles whose bounds add the least surface by
+    /// those bounds.
+    void reduce()
+    {
+        size_t best1 = 0;
+        size_t best2 = 1;
+        double bestWaste = std::numeric_limits<double>::max();
+        for (size_t i = 0; i < _rectangles.size(); ++i)
+        {
+            for (size_t j = i + 1; j < _rectangles.size(); ++j)
+            {
+                Rectangle bounds = _rectangles[i];
+                bounds.extend(_rectangles[j]);
+                const double waste = area(bounds) - area(_rectangles[i]) - area(_rectangles[j]);
+                if (waste < bestWaste)
+                {
+                    bestWaste = waste;
+                    best1 = i;
+                    best2 = j;
+                }
+            }
+        }
+
+        Rectangle bounds = _rectangles[best1];
+        bounds.extend(_rectangles[best2]);
+        _rectangles.erase(_rectangles.begin() + best2);
+        _rectangles.erase(_rectangles.begin() + best1);
+        insert(bounds);
+        join();
+    }
+
+    /// In double, the rectangles can be as large as the coordinates go.
+    static double area(const Rectangle& rectangle)
+    {
+        return static_cast<double>(rectangle.getRight() - static_cast<double>(rectangle.getLeft())) *
+               (rectangle.getBottom() - static_cast<double>(rectangle.getTop()));
+    }
+
+    std::vector<Rectangle> _rectangles;
 };
 
 }
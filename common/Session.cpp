@@ -75,6 +75,13 @@ bool Session::sendBinaryFrame(const char *buffer, int length)
     return sendMessage(buffer, length, WSOpCode::Binary) >= length;
 }
 
+bool Session::sendBinaryFrame(const char* header, int headerLength, const char* payload, int payloadLength)
+{
+    LOG_TRC(getName() << ": Send: " << std::to_string(headerLength + payloadLength) << " binary bytes.");
+    return sendMessage(header, headerLength, payload, payloadLength, WSOpCode::Binary) >=
+           headerLength + payloadLength;
+}
+
 void Session::parseDocOptions(const std::vector<std::string>& tokens, int& part, std::string& timestamp)
 {
     // First token is the "load" command itself.
@@ -41,6 +41,9 @@ public:
     bool isReadOnly() const { return _isReadOnly; }
 
     virtual bool sendBinaryFrame(const char* buffer, int length);
+
+    /// Sends a header followed by a payload as one binary frame.
+    bool sendBinaryFrame(const char* header, int headerLength, const char* payload, int payloadLength);
     virtual bool sendTextFrame(const char* buffer, const int length);
     bool sendTextFrame(const std::string& text)
     {
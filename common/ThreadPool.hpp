@@ -0,0 +1,137 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_THREADPOOL_HPP
+#define INCLUDED_THREADPOOL_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/// A simple pool of worker threads used to process batches of
+/// independent work items, eg. the compression of sub-tiles.
+/// The caller pushes work under the pool lock and then calls run(),
+/// which participates in the work and returns once all of it is done.
+class ThreadPool
+{
+    typedef std::function<void()> ThreadFn;
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::condition_variable _complete;
+    std::queue<ThreadFn> _work;
+    std::vector<std::thread> _threads;
+    size_t _working;
+    bool _shutdown;
+
+public:
+    ThreadPool()
+        : _working(0)
+        , _shutdown(false)
+    {
+        int maxConcurrency = 2;
+#if !MOBILEAPP
+        const char* max = std::getenv("MAX_CONCURRENCY");
+        if (max)
+            maxConcurrency = std::atoi(max);
+        maxConcurrency = std::min<int>(maxConcurrency, std::thread::hardware_concurrency());
+#endif
+        // The calling thread always helps out, so spawn one less.
+        for (int i = 1; i < maxConcurrency; ++i)
+            _threads.push_back(std::thread(&ThreadPool::work, this));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            assert(_working == 0);
+            _shutdown = true;
+        }
+        _cond.notify_all();
+        for (auto& it : _threads)
+            it.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// Number of threads, including the caller of run().
+    size_t count() const
+    {
+        return _threads.size() + 1;
+    }
+
+    std::unique_lock<std::mutex> getLock()
+    {
+        return std::unique_lock<std::mutex>(_mutex);
+    }
+
+    /// Queue a work item; the lock from getLock() must be held.
+    void pushWorkUnlocked(const ThreadFn& fn)
+    {
+        _work.push(fn);
+    }
+
+    /// Execute all the queued work, and return once it is completed.
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        assert(_working == 0);
+
+        // Wake up the workers, and help out ourselves.
+        _cond.notify_all();
+        while (!_work.empty())
+            runOne(lock);
+
+        // Wait for the stragglers.
+        while (_working > 0)
+            _complete.wait(lock);
+    }
+
+private:
+    /// Pop and execute a single work item; called with the lock taken.
+    void runOne(std::unique_lock<std::mutex>& lock)
+    {
+        assert(!_work.empty());
+
+        ThreadFn fn = _work.front();
+        _work.pop();
+        _working++;
+        lock.unlock();
+
+        fn();
+
+        lock.lock();
+        _working--;
+        if (_work.empty() && _working == 0)
+            _complete.notify_all();
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_shutdown)
+        {
+            _cond.wait(lock);
+            while (!_shutdown && !_work.empty())
+                runOne(lock);
+        }
+    }
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -9,9 +9,23 @@
 #ifndef INCLUDED_DELTA_HPP
 #define INCLUDED_DELTA_HPP
 
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <mutex>
 #include <vector>
+#include <unordered_map>
 #include <assert.h>
+
+#define LOK_USE_UNSTABLE_API
+#include <LibreOfficeKit/LibreOfficeKitEnums.h>
+
 #include <Log.hpp>
+#include <Png.hpp>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
 
 #ifndef TILE_WIRE_ID
 #  define TILE_WIRE_ID
@@ -20,7 +34,47 @@
 
 /// A quick and dirty delta generator for last tile changes
 class DeltaGenerator {
+  public:
+    /// Identifies a tile position: the same area of the same part at the same
+    /// zoom, rendered to the same pixel size.
+    struct TileLocation {
+        int _left;
+        int _top;
+        int _size;
+        int _width;
+        int _height;
+        int _part;
+
+        TileLocation(int left, int top, int size, int width, int height, int part)
+            : _left(left), _top(top), _size(size), _width(width), _height(height), _part(part)
+        {
+        }
+
+        bool operator==(const TileLocation &other) const
+        {
+            return _left == other._left && _top == other._top &&
+                   _size == other._size && _width == other._width &&
+                   _height == other._height && _part == other._part;
+        }
+    };
 
+    struct TileLocationHash {
+        size_t operator()(const TileLocation &loc) const
+        {
+            size_t hash = loc._left;
+            hash = hash * 31 + loc._top;
+            hash = hash * 31 + loc._size;
+            hash = hash * 31 + loc._width;
+            hash = hash * 31 + loc._height;
+            hash = hash * 31 + loc._part;
+            return hash;
+        }
+    };
+
+    /// The default memory budget of the stored tiles.
+    static const size_t DefaultMaxBytes = 32 * 1024 * 1024;
+
+  private:
     struct DeltaBitmapRow {
     private:
         uint64_t _crc;
@@ -34,6 +88,16 @@ class DeltaGenerator {
             return _pixels == other._pixels;
         }
 
+        void setCrc(uint64_t crc)
+        {
+            _crc = crc;
+        }
+
+        uint64_t getCrc() const
+        {
+            return _crc;
+        }
+
         const std::vector<uint32_t>& getPixels() const
         {
             return _pixels;
@@ -76,6 +140,13 @@ class DeltaGenerator {
             return _height;
         }
 
+        /// Approximate memory used by this entry.
+        size_t getBytes() const
+        {
+            return sizeof(DeltaData) + _height * (sizeof(DeltaBitmapRow) + _width * 4) +
+                   _rowIndex.size() * 2 * sizeof(uint64_t);
+        }
+
         const std::vector<DeltaBitmapRow>& getRows() const
         {
             return _rows;
@@ -86,13 +157,79 @@ class DeltaGenerator {
             return _rows;
         }
 
+        /// Index the rows by their crc, to find moved rows quickly.
+        /// Only the first of several rows with the same crc is kept.
+        void indexRows()
+        {
+            _rowIndex.clear();
+            _rowIndex.reserve(_rows.size());
+            for (size_t y = 0; y < _rows.size(); ++y)
+                _rowIndex.emplace(_rows[y].getCrc(), y);
+        }
+
+        /// Returns the index of a row identical to @row, or -1 if none.
+        int findRow(const DeltaBitmapRow &row) const
+        {
+            const auto it = _rowIndex.find(row.getCrc());
+            if (it == _rowIndex.end() || !_rows[it->second].identical(row))
+                return -1;
+            return it->second;
+        }
+
     private:
         TileWireId _wid;
         int _width;
         int _height;
         std::vector<DeltaBitmapRow> _rows;
+        std::unordered_map<uint64_t, int> _rowIndex;
     };
-    std::vector<std::shared_ptr<DeltaData>> _deltaEntries;
+    typedef std::list<std::pair<TileLocation, std::shared_ptr<DeltaData>>> DeltaList;
+
+    /// The last version of each tile, most recently used first.
+    DeltaList _deltaEntries;
+    std::unordered_map<TileLocation, DeltaList::iterator, TileLocationHash> _deltaIndex;
+    size_t _bytes;
+    size_t _maxBytes;
+    size_t _hits;
+    size_t _misses;
+
+    /// Deltas of sub-tiles are created concurrently; guards all the above.
+    std::mutex _mutex;
+
+    /// Returns the number of leading pixels that are the same in both
+    /// rows if @same is true, or that differ if it is false.
+    static int countRun(const uint32_t *a, const uint32_t *b, int len, bool same)
+    {
+        int i = 0;
+#ifdef __SSE2__
+        for (; i + 4 <= len; i += 4)
+        {
+            const __m128i eq = _mm_cmpeq_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+            int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+            if (!same)
+                mask = ~mask & 0xf;
+            if (mask != 0xf)
+                return i + __builtin_ctz(~mask);
+        }
+#endif
+        for (; i < len && (a[i] == b[i]) == same; ++i)
+            ;
+        return i;
+    }
+
+    /// Drop the least recently used tiles until we fit the budget.
+    void evictUnlocked()
+    {
+        while (_bytes > _maxBytes && !_deltaEntries.empty())
+        {
+            LOG_TRC("Evicting delta data for tile " << _deltaEntries.back().second->getWid());
+            _bytes -= _deltaEntries.back().second->getBytes();
+            _deltaIndex.erase(_deltaEntries.back().first);
+            _deltaEntries.pop_back();
+        }
+    }
 
     bool makeDelta(
         const DeltaData &prev,
@@ -120,61 +257,52 @@ class DeltaGenerator {
         size_t lastCopy = 0;
         for (int y = 0; y < prev.getHeight(); ++y)
         {
+            const DeltaBitmapRow &curRow = cur.getRows()[y];
+
             // Life is good where rows match:
-            if (prev.getRows()[y].identical(cur.getRows()[y]))
+            if (prev.getRows()[y].identical(curRow))
                 continue;
 
-            // Hunt for other rows
-            bool matched = false;
-            for (int yn = 0; yn < prev.getHeight() && !matched; ++yn)
+            // Hunt for other rows: try the same offset as last time
+            // first, eg. when scrolling, then the whole of the index.
+            int match = (y + lastMatchOffset) % prev.getHeight();
+            if (!prev.getRows()[match].identical(curRow))
+                match = prev.findRow(curRow);
+
+            if (match >= 0)
             {
-                size_t match = (y + lastMatchOffset + yn) % prev.getHeight();
-                if (prev.getRows()[match].identical(cur.getRows()[y]))
+                // TODO: if offsets are >256 - use 16bits?
+                if (lastCopy > 0)
                 {
-                    // TODO: if offsets are >256 - use 16bits?
-                    if (lastCopy > 0)
+                    const unsigned char cnt = output[lastCopy];
+                    if (cnt < 255 &&
+                        (unsigned char)(output[lastCopy + 1] + cnt) == (unsigned char)(match) &&
+                        (unsigned char)(output[lastCopy + 2] + cnt) == (unsigned char)(y))
                     {
-                        char cnt = output[lastCopy];
-                        if (output[lastCopy + 1] + cnt == (char)(match) &&
-                            output[lastCopy + 2] + cnt == (char)(y))
-                        {
-                            output[lastCopy]++;
-                            matched = true;
-                            continue;
-                        }
+                        output[lastCopy]++;
+                        continue;
                     }
-
-                    lastMatchOffset = match - y;
-                    output.push_back('c');   // copy-row
-                    lastCopy = output.size();
-                    output.push_back(1);     // count
-                    output.push_back(match); // src
-                    output.push_back(y);     // dest
-
-                    matched = true;
-                    continue;
                 }
-            }
-            if (matched)
+
+                lastMatchOffset = match - y;
+                output.push_back('c');   // copy-row
+                lastCopy = output.size();
+                output.push_back(1);     // count
+                output.push_back(match); // src
+                output.push_back(y);     // dest
                 continue;
+            }
 
             // Our row is just that different:
-            const DeltaBitmapRow &curRow = cur.getRows()[y];
             const DeltaBitmapRow &prevRow = prev.getRows()[y];
+            const uint32_t *prevPixels = prevRow.getPixels().data();
+            const uint32_t *curPixels = curRow.getPixels().data();
             for (int x = 0; x < prev.getWidth();)
             {
-                int same;
-                for (same = 0; same + x < prev.getWidth() &&
-                         prevRow.getPixels()[x+same] == curRow.getPixels()[x+same];)
-                    ++same;
-
-                x += same;
-
-                int diff;
-                for (diff = 0; diff + x < prev.getWidth() &&
-                         (prevRow.getPixels()[x+diff] == curRow.getPixels()[x+diff] || diff < 2) &&
-                         diff < 254;)
-                    ++diff;
+                x += countRun(prevPixels + x, curPixels + x, prev.getWidth() - x, true);
+
+                const int diff = countRun(prevPixels + x, curPixels + x,
+                                          std::min(prev.getWidth() - x, 254), false);
                 if (diff > 0)
                 {
                     output.push_back('d');
@@ -184,7 +312,7 @@ class DeltaGenerator {
 
                     size_t dest = output.size();
                     output.resize(dest + diff * 4);
-                    memcpy(&output[dest], &curRow.getPixels()[x], diff * 4);
+                    memcpy(&output[dest], curPixels + x, diff * 4);
 
                     LOG_TRC("different " << diff << "pixels");
                     x += diff;
@@ -199,7 +327,8 @@ class DeltaGenerator {
         TileWireId wid,
         unsigned char* pixmap, size_t startX, size_t startY,
         int width, int height,
-        int bufferWidth, int bufferHeight)
+        int bufferWidth, int bufferHeight,
+        const uint64_t* rowHashes, LibreOfficeKitTileMode mode)
     {
         auto data = std::make_shared<DeltaData>();
         data->setWid(wid);
@@ -220,52 +349,131 @@ class DeltaGenerator {
         {
             DeltaBitmapRow &row = data->getRows()[y];
             size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
-            int32_t *src = reinterpret_cast<int32_t *>(pixmap + position);
+            const unsigned char *src = pixmap + position;
 
-            // We get the hash ~for free as we copy - with a cheap hash.
-            uint64_t crc = 0x7fffffff - 1;
+            // Keep the pixels as the client decodes them from the PNG.
             row.getPixels().resize(width);
-            for (int x = 0; x < width; ++x)
+            unsigned char *dst = reinterpret_cast<unsigned char *>(row.getPixels().data());
+            if (mode == LOK_TILEMODE_BGRA)
+                Png::unpremultiplyRow(src, dst, width);
+            else
+                std::memcpy(dst, src, width * 4);
+
+            if (rowHashes)
             {
-                crc = (crc << 7) + crc + src[x];
-                row.getPixels()[x] = src[x];
+                // Already hashed when the tile was painted.
+                row.setCrc(rowHashes[y]);
+                continue;
             }
+
+            // We get the hash ~for free - with a cheap hash.
+            uint64_t crc = 0x7fffffff - 1;
+            for (int x = 0; x < width; ++x)
+                crc = (crc << 7) + crc + row.getPixels()[x];
+            row.setCrc(crc);
         }
+        data->indexRows();
 
         return data;
     }
 
   public:
-    DeltaGenerator() {}
+    DeltaGenerator(size_t maxBytes = DefaultMaxBytes)
+        : _bytes(0)
+        , _maxBytes(maxBytes)
+        , _hits(0)
+        , _misses(0)
+    {
+    }
+
+    /// Sets the memory budget of the stored tiles, evicting as needed.
+    void setMaxBytes(size_t maxBytes)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _maxBytes = maxBytes;
+        evictUnlocked();
+    }
 
     /**
      * Creates a delta between @oldWid and pixmap if possible:
      *   if so - returns @true and appends the delta to @output
      * stores @pixmap, and other data to accelerate delta
-     * creation in a limited size cache.
+     * creation in a memory bounded LRU cache keyed on @location,
+     * replacing the previous version of the tile there.
+     * @rowHashes, if given, has the hash of each of the @height rows,
+     * as computed by Png::hashSubBufferRows().
+     * The pixels of the delta are RGBA, un-premultiplied from @mode as
+     * in the PNG, so that the client applies them to the decoded tile.
      */
     bool createDelta(
         unsigned char* pixmap, size_t startX, size_t startY,
         int width, int height,
         int bufferWidth, int bufferHeight,
+        const TileLocation& location,
         std::vector<char>& output,
-        TileWireId wid, TileWireId oldWid)
+        TileWireId wid, TileWireId oldWid,
+        const uint64_t* rowHashes = nullptr,
+        LibreOfficeKitTileMode mode = LOK_TILEMODE_RGBA)
     {
-        // First store a copy for later:
-        if (_deltaEntries.size() > 6) // FIXME: hard-coded ...
-            _deltaEntries.erase(_deltaEntries.begin());
-
         std::shared_ptr<DeltaData> update =
             dataToDeltaData(wid, pixmap, startX, startY, width, height,
-                            bufferWidth, bufferHeight);
-        _deltaEntries.push_back(update);
+                            bufferWidth, bufferHeight, rowHashes, mode);
 
-        for (auto &old : _deltaEntries)
+        std::shared_ptr<DeltaData> old;
         {
-            if (oldWid == old->getWid())
-                return makeDelta(*old, *update, output);
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            auto it = _deltaIndex.find(location);
+            if (it != _deltaIndex.end())
+            {
+                old = it->second->second;
+                _bytes -= old->getBytes();
+                _deltaEntries.erase(it->second);
+                _deltaIndex.erase(it);
+            }
+
+            // Store a copy for later:
+            _deltaEntries.emplace_front(location, update);
+            _deltaIndex.emplace(location, _deltaEntries.begin());
+            _bytes += update->getBytes();
+            evictUnlocked();
+
+            if (oldWid)
+            {
+                if (old && old->getWid() == oldWid)
+                    ++_hits;
+                else
+                {
+                    ++_misses;
+                    old.reset();
+                }
+            }
+            else
+                old.reset();
         }
-        return false;
+
+        // The entries are never modified once stored.
+        return old && makeDelta(*old, *update, output);
+    }
+
+    /// Number of times the client's version of a tile was still stored.
+    size_t getHits()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _hits;
+    }
+
+    /// Number of times the client's version of a tile was evicted or replaced.
+    size_t getMisses()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _misses;
+    }
+
+    size_t getBytes()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _bytes;
     }
 };
 
@@ -24,15 +24,22 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <climits>
 #include <condition_variable>
 #include <cstdlib>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <sstream>
 #include <thread>
+#include <tuple>
+#include <unordered_map>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKitInit.h>
@@ -62,6 +69,7 @@
 #include <Log.hpp>
 #include <Png.hpp>
 #include <Rectangle.hpp>
+#include <ThreadPool.hpp>
 #include <TileDesc.hpp>
 #include <Unit.hpp>
 #include <UserMessages.hpp>
@@ -118,6 +126,19 @@ static bool AnonymizeUsernames = false;
 static std::string ObfuscatedFileId;
 #endif
 
+/// The time a chunk of a large tilecombine may take to render, the input
+/// that comes meanwhile is handled between the chunks.
+static const int TileRenderBudgetMs = 20;
+
+/// The upper bounds of the buckets of the key event latencies, in ms;
+/// the last bucket is for the longer ones.
+static const int KeyLatencyBoundsMs[] = { 5, 10, 20, 50, 100, 200, 500, 1000 };
+static const size_t KeyLatencyBuckets = sizeof(KeyLatencyBoundsMs) / sizeof(KeyLatencyBoundsMs[0]) + 1;
+
+/// How long the queue is waited on, while there are tiles to prerender
+/// next to the views, before the next chunk of them is.
+static const int PrerenderIdleMs = 50;
+
 #if ENABLE_DEBUG
 #  define ADD_DEBUG_RENDERID(s) ((s)+ " renderid=" + Util::UniqueId())
 #else
@@ -389,35 +410,19 @@ namespace
 /// wherever possible.
 class PngCache
 {
+public:
     typedef std::shared_ptr< std::vector< char > > CacheData;
 
+private:
     struct CacheEntry {
     private:
-        size_t    _hitCount;
         TileWireId _wireId;
         CacheData _data;
     public:
-        CacheEntry(size_t defaultSize, TileWireId id) :
-            _hitCount(1),   // Every entry is used at least once; prevent removal at birth.
+        CacheEntry(const CacheData& data, TileWireId id) :
             _wireId(id),
-            _data( new std::vector< char >() )
-        {
-            _data->reserve( defaultSize );
-        }
-
-        size_t getHitCount() const
-        {
-            return _hitCount;
-        }
-
-        void incrementHitCount()
+            _data(data)
         {
-            ++_hitCount;
-        }
-
-        void decrementHitCount()
-        {
-            --_hitCount;
         }
 
         const CacheData& getData() const
@@ -429,17 +434,39 @@ class PngCache
         {
             return _wireId;
         }
+
+        /// The bytes charged to the budget; the solid tiles, recorded with
+        /// no data, still cost their bookkeeping.
+        size_t getSize() const
+        {
+            return std::max(_data->size(), sizeof(CacheEntry));
+        }
     } ;
+    typedef std::list< std::pair< TileBinaryHash, CacheEntry > > CacheList;
+
     size_t _cacheSize;
-    static const size_t CacheSizeSoftLimit = (1024 * 4 * 32); // 128k of cache
-    static const size_t CacheSizeHardLimit = CacheSizeSoftLimit * 2;
+    /// The default of the size budget, enough for ~64 text tiles.
+    static const size_t DefaultCacheSizeLimit = (1024 * 4 * 64); // 256k of cache
+    size_t _cacheSizeLimit;
     size_t _cacheHits;
     size_t _cacheTests;
     TileWireId _nextId;
     DeltaGenerator _deltaGen;
-
-    std::map< TileBinaryHash, CacheEntry > _cache;
-    std::map< TileWireId, TileBinaryHash > _wireToHash;
+    /// Whether we may send deltas, rather than PNGs, to update tiles.
+    bool _deltasEnabled;
+    /// How often the delta or the full PNG was the smaller.
+    size_t _deltaWins;
+    size_t _pngWins;
+    /// Bytes of encoded tiles copied around, to keep the copies in check.
+    std::atomic<size_t> _copiedBytes;
+
+    /// The entries, most recently used first, and their index by hash.
+    CacheList _lru;
+    std::unordered_map< TileBinaryHash, CacheList::iterator > _cache;
+    std::unordered_map< TileWireId, TileBinaryHash > _wireToHash;
+
+    /// Sub-tiles are encoded concurrently, this guards all the above.
+    std::mutex _mutex;
 
     void clearCache(bool logStats = false)
     {
@@ -447,6 +474,8 @@ class PngCache
             LOG_DBG("cache clear " << _cache.size() << " items total size " <<
                     _cacheSize << " current hits " << _cacheHits);
         _cache.clear();
+        _lru.clear();
+        _wireToHash.clear();
         _cacheSize = 0;
         _cacheHits = 0;
         _cacheTests = 0;
@@ -463,46 +492,27 @@ class PngCache
         return id;
     }
 
+    void addEntry(TileBinaryHash hash, const CacheEntry& entry)
+    {
+        _lru.emplace_front(hash, entry);
+        _cache.emplace(hash, _lru.begin());
+        _wireToHash.emplace(entry.getWireId(), hash);
+        _cacheSize += entry.getSize();
+        balanceCache();
+    }
+
+    /// Drop the least recently used entries until we fit in the budget.
     void balanceCache()
     {
         // A normalish PNG image size for text in a writer document is
         // around 4k for a content tile, and sub 1k for a background one.
-        if (_cacheSize > CacheSizeHardLimit)
+        while (_cacheSize > _cacheSizeLimit && !_lru.empty())
         {
-            size_t avgHits = 0;
-            for (auto it = _cache.begin(); it != _cache.end(); ++it)
-                avgHits += it->second.getHitCount();
-
-            LOG_DBG("cache " << _cache.size() << " items total size " <<
-                    _cacheSize << " current hits " << avgHits << ", total hit rate " <<
-                    (_cacheHits * 100. / _cacheTests) << "% at balance start");
-            avgHits /= _cache.size();
-
-            for (auto it = _cache.begin(); it != _cache.end();)
-            {
-                if ((_cacheSize > CacheSizeSoftLimit && it->second.getHitCount() == 0) ||
-                    (_cacheSize > CacheSizeHardLimit && it->second.getHitCount() > 0 && it->second.getHitCount() <= avgHits))
-                {
-                    // Shrink cache when we exceed the size to maximize
-                    // the chance of hitting these entries in the future.
-                    _cacheSize -= it->second.getData()->size();
-
-                    auto wIt = _wireToHash.find(it->second.getWireId());
-                    assert(wIt != _wireToHash.end());
-                    _wireToHash.erase(wIt);
-
-                    it = _cache.erase(it);
-                }
-                else
-                {
-                    if (it->second.getHitCount() > 0)
-                        it->second.decrementHitCount();
-                    ++it;
-                }
-            }
-
-            LOG_DBG("cache " << _cache.size() << " items total size " <<
-                    _cacheSize << " after balance");
+            const CacheEntry& entry = _lru.back().second;
+            _cacheSize -= entry.getSize();
+            _wireToHash.erase(entry.getWireId());
+            _cache.erase(_lru.back().first);
+            _lru.pop_back();
         }
     }
 
@@ -510,68 +520,170 @@ class PngCache
     /// Returns true on success, otherwise false.
     bool cacheTest(const uint64_t hash, std::vector<char>& output)
     {
-        if (hash)
-        {
-            ++_cacheTests;
-            auto it = _cache.find(hash);
-            if (it != _cache.end())
-            {
-                ++_cacheHits;
-                LOG_DBG("PNG cache with hash " << hash << " hit.");
-                output.insert(output.end(),
-                              it->second.getData()->begin(),
-                              it->second.getData()->end());
-                it->second.incrementHitCount();
-                return true;
-            }
-        }
+        const CacheData data = cacheLookup(hash);
+        if (!data)
+            return false;
 
-        return false;
+        output.insert(output.end(), data->begin(), data->end());
+        countCopiedBytes(data->size());
+        return true;
     }
 
+public:
+    /// Encodes the tile, without looking it up in the cache first, eg. after a
+    /// cacheLookup(), appending the image or delta to @output, and caches it.
     bool cacheEncodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
                                    int width, int height,
                                    int bufferWidth, int bufferHeight,
                                    std::vector<char>& output, LibreOfficeKitTileMode mode,
-                                   TileBinaryHash hash, TileWireId wid, TileWireId /*oldWid*/)
+                                   Png::Codec codec, const DeltaGenerator::TileLocation& location,
+                                   TileBinaryHash hash, TileWireId wid, TileWireId oldWid,
+                                   const uint64_t* rowHashes)
     {
         LOG_DBG("PNG cache with hash " << hash << " missed.");
-/*
- *Disable for now - pushed in error.
- *
-        if (_deltaGen.createDelta(pixmap, startX, startY, width, height,
-                                  bufferWidth, bufferHeight,
-                                  output, wid, oldWid))
-            return true;
-*/
 
+        // Remember the tile for later deltas, and try one against the client's version.
+        std::vector<char> delta;
+        if (_deltasEnabled &&
+            !_deltaGen.createDelta(pixmap, startX, startY, width, height,
+                                   bufferWidth, bufferHeight, location,
+                                   delta, wid, oldWid, rowHashes, mode))
+        {
+            delta.clear();
+        }
+
+        // Encode straight into the output, which is the final message when we can.
         LOG_DBG("Encode a new png for this tile.");
-        CacheEntry newEntry(bufferWidth * bufferHeight * 1, wid);
-        if (Png::encodeSubBufferToPNG(pixmap, startX, startY, width, height,
-                                      bufferWidth, bufferHeight,
-                                      *newEntry.getData(), mode))
+        const size_t start = output.size();
+        if (!Png::encodeSubBufferToPNG(pixmap, startX, startY, width, height,
+                                       bufferWidth, bufferHeight,
+                                       output, mode, codec))
         {
-            if (hash)
+            output.resize(start);
+            return false;
+        }
+
+        const size_t pngSize = output.size() - start;
+        if (hash)
+        {
+            CacheEntry newEntry(std::make_shared<std::vector<char>>(output.begin() + start, output.end()), wid);
+            countCopiedBytes(pngSize);
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            // Another thread may have encoded the same content meanwhile.
+            auto it = _cache.find(hash);
+            if (it == _cache.end())
+                addEntry(hash, newEntry);
+            else if (it->second->second.getData()->empty())
             {
-                newEntry.getData()->shrink_to_fit();
-                _cache.emplace(hash, newEntry);
-                _cacheSize += newEntry.getData()->size();
+                // Recorded as a solid tile, keep its wireid.
+                _cacheSize -= it->second->second.getSize();
+                it->second->second = CacheEntry(newEntry.getData(), it->second->second.getWireId());
+                _cacheSize += it->second->second.getSize();
+                balanceCache();
             }
+        }
 
-            output.insert(output.end(),
-                          newEntry.getData()->begin(),
-                          newEntry.getData()->end());
-            balanceCache();
-            return true;
+        // Send whichever of the delta or the PNG is smaller.
+        if (!delta.empty() && delta.size() < pngSize)
+        {
+            LOG_TRC("Sending delta of " << delta.size() << " bytes instead of PNG of " <<
+                    pngSize << " bytes.");
+            output.resize(start);
+            output.insert(output.end(), delta.begin(), delta.end());
+            countCopiedBytes(delta.size());
+            countDeltaWin(true);
         }
+        else if (!delta.empty())
+            countDeltaWin(false);
+
+        return true;
+    }
+
+private:
+    void countDeltaWin(bool deltaWon)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (deltaWon)
+            ++_deltaWins;
         else
-            return false;
+            ++_pngWins;
+
+        if ((_deltaWins + _pngWins) % 100 == 0)
+            LOG_DBG("Tile deltas were smaller than the PNG " << _deltaWins << " times, larger " <<
+                    _pngWins << " times.");
     }
 
 public:
     PngCache()
+        : _cacheSizeLimit(DefaultCacheSizeLimit)
+        , _deltasEnabled(std::getenv("LOOL_TILE_DELTAS") != nullptr)
+        , _deltaWins(0)
+        , _pngWins(0)
+        , _copiedBytes(0)
     {
         clearCache();
+
+        const char* cacheKb = std::getenv("LOOL_PNG_CACHE_KB");
+        if (cacheKb)
+            _cacheSizeLimit = std::atoi(cacheKb) * 1024UL;
+
+        const char* historyKb = std::getenv("LOOL_TILE_DELTAS_HISTORY_KB");
+        if (historyKb)
+            _deltaGen.setMaxBytes(std::atoi(historyKb) * 1024UL);
+    }
+
+    /// The delta history keeps the last version of each tile position.
+    static DeltaGenerator::TileLocation getTileLocation(const TileDesc& tile)
+    {
+        return DeltaGenerator::TileLocation(tile.getTilePosX(), tile.getTilePosY(),
+                                            tile.getTileWidth(), tile.getWidth(),
+                                            tile.getHeight(), tile.getPart());
+    }
+
+    /// Statistics of the cache, the delta history and arbitration, as tokens.
+    std::string getStats()
+    {
+        std::ostringstream oss;
+        oss << "deltahits=" << _deltaGen.getHits()
+            << " deltamisses=" << _deltaGen.getMisses()
+            << " deltakb=" << _deltaGen.getBytes() / 1024;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        oss << " deltawins=" << _deltaWins
+            << " pngwins=" << _pngWins
+            << " pngcachehits=" << _cacheHits
+            << " pngcachetests=" << _cacheTests
+            << " pngcachekb=" << _cacheSize / 1024
+            << " tilecopykb=" << _copiedBytes / 1024;
+        return oss.str();
+    }
+
+    /// Returns the cached encoding of the tile with this @hash, shared
+    /// rather than copied, or null if it is not cached.
+    CacheData cacheLookup(const uint64_t hash)
+    {
+        if (!hash)
+            return CacheData();
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        ++_cacheTests;
+        auto it = _cache.find(hash);
+        if (it == _cache.end() || it->second->second.getData()->empty())
+            return CacheData();
+
+        ++_cacheHits;
+        LOG_DBG("PNG cache with hash " << hash << " hit.");
+
+        // Make it the most recently used.
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return it->second->second.getData();
+    }
+
+    /// Account for a copy of @size bytes of encoded tile.
+    void countCopiedBytes(size_t size)
+    {
+        _copiedBytes += size;
     }
 
     TileWireId hashToWireId(TileBinaryHash id)
@@ -579,41 +691,60 @@ public:
         TileWireId wid;
         if (id == 0)
             return 0;
+        std::unique_lock<std::mutex> lock(_mutex);
         auto it = _cache.find(id);
         if (it != _cache.end())
-            wid = it->second.getWireId();
+            wid = it->second->second.getWireId();
         else
-        {
             wid = createNewWireId();
-            _wireToHash.emplace(wid, id);
-        }
         return wid;
     }
 
+    /// Records the solid tile with this @hash, which is never encoded,
+    /// for its content to keep the wireid @wid.
+    void cacheSolid(TileBinaryHash hash, TileWireId wid)
+    {
+        if (!hash)
+            return;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _cache.find(hash);
+        if (it == _cache.end())
+            addEntry(hash, CacheEntry(std::make_shared<std::vector<char>>(), wid));
+        else
+            _lru.splice(_lru.begin(), _lru, it->second);
+    }
+
+    /// Note that the cache is keyed on the tile content only, so a hit may
+    /// be served in the encoding of another codec; they are all valid PNGs.
     bool encodeBufferToPNG(unsigned char* pixmap, int width, int height,
                            std::vector<char>& output, LibreOfficeKitTileMode mode,
-                           TileBinaryHash hash, TileWireId wid, TileWireId oldWid)
+                           Png::Codec codec, const DeltaGenerator::TileLocation& location,
+                           TileBinaryHash hash, TileWireId wid, TileWireId oldWid,
+                           const uint64_t* rowHashes)
     {
         if (cacheTest(hash, output))
             return true;
 
         return cacheEncodeSubBufferToPNG(pixmap, 0, 0, width, height,
-                                         width, height, output, mode,
-                                         hash, wid, oldWid);
+                                         width, height, output, mode, codec, location,
+                                         hash, wid, oldWid, rowHashes);
     }
 
     bool encodeSubBufferToPNG(unsigned char* pixmap, size_t startX, size_t startY,
                               int width, int height,
                               int bufferWidth, int bufferHeight,
                               std::vector<char>& output, LibreOfficeKitTileMode mode,
-                              TileBinaryHash hash, TileWireId wid, TileWireId oldWid)
+                              Png::Codec codec, const DeltaGenerator::TileLocation& location,
+                              TileBinaryHash hash, TileWireId wid, TileWireId oldWid,
+                              const uint64_t* rowHashes)
     {
         if (cacheTest(hash, output))
             return true;
 
         return cacheEncodeSubBufferToPNG(pixmap, startX, startY, width, height,
-                                         bufferWidth, bufferHeight, output, mode,
-                                         hash, wid, oldWid);
+                                         bufferWidth, bufferHeight, output, mode, codec, location,
+                                         hash, wid, oldWid, rowHashes);
     }
 };
 
@@ -663,31 +794,15 @@ private:
     void alphaBlend(const std::vector<unsigned char>& from, int from_width, int from_height, int from_offset_x, int from_offset_y,
             unsigned char* to, int to_width, int to_height)
     {
-        for (int to_y = from_offset_y, from_y = 0; (to_y < to_height) && (from_y < from_height) ; ++to_y, ++from_y)
-            for (int to_x = from_offset_x, from_x = 0; (to_x < to_width) && (from_x < from_width); ++to_x, ++from_x)
-            {
-                const unsigned char* f = from.data() + 4 * (from_y * from_width + from_x);
-                double src_r = f[0];
-                double src_g = f[1];
-                double src_b = f[2];
-                double src_a = f[3] / 255.0;
-
-                unsigned char* t = to + 4 * (to_y * to_width + to_x);
-                double dst_r = t[0];
-                double dst_g = t[1];
-                double dst_b = t[2];
-                double dst_a = t[3] / 255.0;
-
-                double out_a = src_a + dst_a * (1.0 - src_a);
-                unsigned char out_r = src_r + dst_r * (1.0 - src_a);
-                unsigned char out_g = src_g + dst_g * (1.0 - src_a);
-                unsigned char out_b = src_b + dst_b * (1.0 - src_a);
+        const int width = std::min(from_width, to_width - from_offset_x);
+        if (width <= 0)
+            return;
 
-                t[0] = out_r;
-                t[1] = out_g;
-                t[2] = out_b;
-                t[3] = static_cast<unsigned char>(out_a * 255.0);
-            }
+        for (int to_y = from_offset_y, from_y = 0; (to_y < to_height) && (from_y < from_height) ; ++to_y, ++from_y)
+        {
+            Png::alphaBlendRow(from.data() + 4 * (from_y * from_width),
+                               to + 4 * (to_y * to_width + from_offset_x), width);
+        }
     }
 
     /// Create bitmap that we later use as the watermark for every tile.
@@ -716,6 +831,7 @@ private:
         if (!textPixels)
         {
             LOG_ERR("Watermark: rendering failed.");
+            return nullptr;
         }
 
         const unsigned int pixel_count = width * height * 4;
@@ -724,7 +840,8 @@ private:
         // No longer needed.
         std::free(textPixels);
 
-        _pixmap.reserve(pixel_count);
+        // Sized, not just reserved, so that we can reuse it for the next tiles.
+        _pixmap.resize(pixel_count);
 
         // Create the white blurred background
         // Use box blur, it's enough for our purposes
@@ -781,6 +898,295 @@ private:
     std::vector<unsigned char> _pixmap;
 };
 
+/// A pool of pixmap buffers reused across paints, so that we don't
+/// allocate, and fault in, megabytes of memory for each render. The
+/// buffers are page-aligned, and are not zeroed as the paint overwrites
+/// them anyway. Pixmaps are acquired by the document thread, and
+/// released by the tile encoder.
+class PixmapPool
+{
+    struct Buffer
+    {
+        unsigned char* _data;
+        size_t _size;
+    };
+
+    /// Buffers not in use.
+    std::vector<Buffer> _free;
+    static const size_t MaxFreeBuffers = 4;
+    /// Idle buffers are freed after this long without a paint.
+    static const int IdleShrinkMs = 10000;
+    std::chrono::steady_clock::time_point _lastAcquire;
+    size_t _poolBytes;
+    size_t _savedBytes;
+    /// Guards all the above.
+    mutable std::mutex _mutex;
+
+    static size_t getPageSize()
+    {
+        static const size_t pageSize = sysconf(_SC_PAGESIZE);
+        return pageSize;
+    }
+
+    void release(unsigned char* data, size_t size)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_free.size() >= MaxFreeBuffers)
+        {
+            // Keep the largest ones, they are the most expensive to allocate.
+            auto smallest = std::min_element(_free.begin(), _free.end(),
+                                             [](const Buffer& a, const Buffer& b) { return a._size < b._size; });
+            if (smallest->_size >= size)
+            {
+                freeBuffer(data, size);
+                return;
+            }
+
+            freeBuffer(smallest->_data, smallest->_size);
+            _free.erase(smallest);
+        }
+
+        _free.push_back(Buffer{ data, size });
+    }
+
+    void freeBuffer(unsigned char* data, size_t size)
+    {
+        _poolBytes -= size;
+        free(data);
+    }
+
+    void shrinkUnlocked()
+    {
+        for (const Buffer& buffer : _free)
+            freeBuffer(buffer._data, buffer._size);
+        _free.clear();
+    }
+
+public:
+    /// A pixmap acquired from the pool, returned to it on destruction.
+    class Pixmap
+    {
+        PixmapPool& _pool;
+        unsigned char* _data;
+        size_t _size;
+
+    public:
+        Pixmap(PixmapPool& pool, unsigned char* data, size_t size)
+            : _pool(pool)
+            , _data(data)
+            , _size(size)
+        {
+        }
+
+        Pixmap(Pixmap&& other)
+            : _pool(other._pool)
+            , _data(other._data)
+            , _size(other._size)
+        {
+            other._data = nullptr;
+        }
+
+        ~Pixmap()
+        {
+            if (_data)
+                _pool.release(_data, _size);
+        }
+
+        Pixmap(const Pixmap&) = delete;
+        Pixmap& operator=(const Pixmap&) = delete;
+
+        unsigned char* data() const { return _data; }
+    };
+
+    PixmapPool()
+        : _lastAcquire(std::chrono::steady_clock::now())
+        , _poolBytes(0)
+        , _savedBytes(0)
+    {
+    }
+
+    ~PixmapPool()
+    {
+        shrink();
+    }
+
+    PixmapPool(const PixmapPool&) = delete;
+    PixmapPool& operator=(const PixmapPool&) = delete;
+
+    /// Returns a pixmap of at least @size bytes, the first @size of them
+    /// cleared, as LOK isn't bound to paint every pixel of the tiles; or
+    /// one with a null data() when out of memory.
+    Pixmap acquire(size_t size)
+    {
+        Buffer buffer{ nullptr, 0 };
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _lastAcquire = std::chrono::steady_clock::now();
+
+            // Best fit, so that a small tile doesn't take a large buffer.
+            auto best = _free.end();
+            for (auto it = _free.begin(); it != _free.end(); ++it)
+            {
+                if (it->_size >= size && (best == _free.end() || it->_size < best->_size))
+                    best = it;
+            }
+
+            if (best != _free.end())
+            {
+                buffer = *best;
+                _free.erase(best);
+                _savedBytes += size;
+            }
+        }
+
+        if (!buffer._data)
+        {
+            const size_t pageSize = getPageSize();
+            buffer._size = (size + pageSize - 1) / pageSize * pageSize;
+            void* data = nullptr;
+            if (posix_memalign(&data, pageSize, buffer._size) != 0)
+            {
+                LOG_ERR("Failed to allocate a pixmap of " << buffer._size << " bytes.");
+                return Pixmap(*this, nullptr, buffer._size);
+            }
+
+            buffer._data = static_cast<unsigned char*>(data);
+            std::unique_lock<std::mutex> lock(_mutex);
+            _poolBytes += buffer._size;
+        }
+
+        std::memset(buffer._data, 0, size);
+        return Pixmap(*this, buffer._data, buffer._size);
+    }
+
+    /// Free all the buffers not in use.
+    void shrink()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        shrinkUnlocked();
+    }
+
+    /// Free the buffers not in use if we haven't painted for a while.
+    void shrinkIfIdle()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (!_free.empty() &&
+            std::chrono::steady_clock::now() - _lastAcquire > std::chrono::milliseconds(IdleShrinkMs))
+        {
+            LOG_DBG("Freeing " << _free.size() << " idle pixmaps, reuse saved " <<
+                    _savedBytes / 1024 << " KB of allocations so far.");
+            shrinkUnlocked();
+        }
+    }
+
+    /// Statistics of the pool, as tokens.
+    std::string getStats() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::ostringstream oss;
+        oss << "pixmappoolkb=" << _poolBytes / 1024
+            << " pixmapsavedkb=" << _savedBytes / 1024;
+        return oss.str();
+    }
+};
+
+/// The encoding stage of the tile rendering pipeline. The document thread
+/// paints the tiles, and hands the pixmaps over to be compressed and sent,
+/// so that it can paint the next ones meanwhile. The jobs are run in order,
+/// so the responses go out in the order of the requests, and only a few of
+/// them may be in flight, as each holds on to its pixmap.
+class TileEncoder
+{
+public:
+    typedef std::function<void()> Job;
+
+    /// Jobs queued or running before push() blocks.
+    static const size_t MaxInFlight = 2;
+
+    TileEncoder()
+        : _inFlight(0)
+        , _stop(false)
+        , _thread(&TileEncoder::run, this)
+    {
+    }
+
+    ~TileEncoder()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cond.notify_all();
+        _thread.join();
+    }
+
+    TileEncoder(const TileEncoder&) = delete;
+    TileEncoder& operator=(const TileEncoder&) = delete;
+
+    /// Queue a job, waiting first while too many are in flight.
+    void push(const Job& job)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_inFlight >= MaxInFlight)
+            _done.wait(lock);
+
+        ++_inFlight;
+        _jobs.push_back(job);
+        _cond.notify_all();
+    }
+
+    /// Wait until all the queued jobs are done, eg. before sending
+    /// anything that must not overtake the tiles.
+    void drain()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_inFlight > 0)
+            _done.wait(lock);
+    }
+
+private:
+    void run()
+    {
+        Util::setThreadName("tile_encoder");
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;)
+        {
+            while (_jobs.empty() && !_stop)
+                _cond.wait(lock);
+
+            // Finish the pending jobs even when stopping.
+            if (_jobs.empty())
+                break;
+
+            const Job job = _jobs.front();
+            _jobs.pop_front();
+            lock.unlock();
+
+            try
+            {
+                job();
+            }
+            catch (const std::exception& exc)
+            {
+                LOG_ERR("Failed to encode tiles: " << exc.what());
+            }
+
+            lock.lock();
+            --_inFlight;
+            _done.notify_all();
+        }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::condition_variable _done;
+    std::deque<Job> _jobs;
+    size_t _inFlight;
+    bool _stop;
+    std::thread _thread;
+};
+
 #if !MOBILEAPP
 static FILE* ProcSMapsFile = nullptr;
 #endif
@@ -818,6 +1224,20 @@ public:
         _tileQueue(std::move(tileQueue)),
         _socketPoll(socketPoll),
         _websocketHandler(websocketHandler),
+        _renderedTiles(0),
+        _renderTime(0),
+        _invalidationDelayMs(0),
+        _invalidationsReceived(0),
+        _invalidationsSent(0),
+        _invalidatedTiles(0),
+        _invalidatedTilesSent(0),
+        _keyEventPending(false),
+        _keyLatencies(),
+        _renderChunks(0),
+        _inputsBetweenChunks(0),
+        _prerenderBudgetMs(0),
+        _prerenderedTiles(0),
+        _prerenderTime(0),
         _docPassword(""),
         _haveDocPassword(false),
         _isDocPasswordProtected(false),
@@ -832,6 +1252,16 @@ public:
                 "] and id [" << _docId << "].");
         assert(_loKit);
 
+#if !MOBILEAPP
+        const char* invalidationDelayMs = std::getenv("LOOL_INVALIDATION_DELAY_MS");
+        if (invalidationDelayMs)
+            _invalidationDelayMs = std::max(std::atoi(invalidationDelayMs), 0);
+
+        const char* prerenderBudgetMs = std::getenv("LOOL_PRERENDER_BUDGET_MS");
+        if (prerenderBudgetMs)
+            _prerenderBudgetMs = std::max(std::atoi(prerenderBudgetMs), 0);
+#endif
+
         _callbackThread.start(*this);
     }
 
@@ -847,6 +1277,10 @@ public:
 
         _tileQueue->put("eof");
         _callbackThread.join();
+
+        // The pending tiles use the caches and the socket, which go
+        // before the encoder.
+        _tileEncoder.drain();
     }
 
     const std::string& getUrl() const { return _url; }
@@ -984,13 +1418,36 @@ public:
         LOG_INF("setDocumentPassword returned");
     }
 
+    /// A combined render handed over from the painting to the encoding.
+    struct CombinedRender
+    {
+        CombinedRender(PixmapPool::Pixmap&& pixmap, TileCombined&& tileCombined)
+            : _pixmap(std::move(pixmap))
+            , _pixmapWidth(0)
+            , _pixmapHeight(0)
+            , _mode(LOK_TILEMODE_RGBA)
+            , _tileCombined(std::move(tileCombined))
+        {
+        }
+
+        PixmapPool::Pixmap _pixmap;
+        size_t _pixmapWidth;
+        size_t _pixmapHeight;
+        LibreOfficeKitTileMode _mode;
+        TileCombined _tileCombined;
+        std::vector<std::pair<int, int>> _offsets;
+        std::vector<Png::TileHashes> _hashes;
+        std::vector<PngCache::CacheData> _encoded;
+    };
+
     void renderTile(const std::vector<std::string>& tokens)
     {
         TileDesc tile = TileDesc::parse(tokens);
 
         size_t pixmapDataSize = 4 * tile.getWidth() * tile.getHeight();
-        std::vector<unsigned char> pixmap;
-        pixmap.resize(pixmapDataSize);
+        PixmapPool::Pixmap pixmap = _pixmapPool.acquire(pixmapDataSize);
+        if (!pixmap.data())
+            return;
 
         std::unique_lock<std::mutex> lock(_documentMutex);
         if (!_loKitDocument)
@@ -1017,7 +1474,10 @@ public:
                 " ms (" << area / elapsed << " MP/s).");
         const auto mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
 
-        const TileBinaryHash hash = Png::hashBuffer(pixmap.data(), tile.getWidth(), tile.getHeight());
+        Png::TileHashes hashes;
+        Png::hashSubBufferRows(pixmap.data(), 0, 0, tile.getWidth(), tile.getHeight(),
+                               tile.getWidth(), tile.getHeight(), hashes);
+        const TileBinaryHash hash = hashes._hash;
         TileWireId wid = _pngCache.hashToWireId(hash);
         TileWireId oldWireId = tile.getOldWireId();
 
@@ -1030,36 +1490,203 @@ public:
             return;
         }
 
-        // Send back the request with all optional parameters given in the request.
-        std::string response = ADD_DEBUG_RENDERID(tile.serialize("tile:")) + "\n";
-
         int pixelWidth = tile.getWidth();
         int pixelHeight = tile.getHeight();
 
-        if (_docWatermark)
-            _docWatermark->blending(pixmap.data(), 0, 0, pixelWidth, pixelHeight, pixelWidth, pixelHeight, mode);
+        // A uniform tile is described by its colour alone, no need to encode.
+        if (!_docWatermark && hashes._solid)
+        {
+            _pngCache.cacheSolid(hash, wid);
+            tile.setSolid(Png::pixelToColor(pixmap.data(), mode));
+            const std::string header = ADD_DEBUG_RENDERID(tile.serialize("tile:")) + "\n";
+            LOG_TRC("Sending solid render-tile response for: " << header);
+            postTiles(std::make_shared<std::vector<char>>(header.begin(), header.end()));
+            ++_renderedTiles;
+            return;
+        }
+
+        // Send back the request with all optional parameters given in the request.
+        const std::string response = ADD_DEBUG_RENDERID(tile.serialize("tile:")) + "\n";
 
         std::shared_ptr<std::vector<char>> output = std::make_shared<std::vector<char>>();
         output->reserve(response.size() + pixmapDataSize);
         output->resize(response.size());
         std::memcpy(output->data(), response.data(), response.size());
 
-        if (!_pngCache.encodeBufferToPNG(pixmap.data(), tile.getWidth(), tile.getHeight(), *output, mode, hash, wid, oldWireId))
+        // Reuse an identical tile already encoded. The watermark is centred on every
+        // tile, so the blended tile only depends on the content hashed before blending.
+        if (_pngCache.cacheTest(hash, *output))
         {
-            //FIXME: Return error.
-            //sendTextFrame("error: cmd=tile kind=failure");
-
-            LOG_ERR("Failed to encode tile into PNG.");
+            LOG_TRC("Sending cached render-tile response (" << output->size() << " bytes) for: " << response);
+            postTiles(output);
+            ++_renderedTiles;
             return;
         }
 
-        LOG_TRC("Sending render-tile response (" << output->size() << " bytes) for: " << response);
-        postMessage(output, WSOpCode::Binary);
+        if (_docWatermark)
+        {
+            _docWatermark->blending(pixmap.data(), 0, 0, pixelWidth, pixelHeight, pixelWidth, pixelHeight, mode);
+
+            // The row hashes no longer match the pixels.
+            hashes._rowHashes.clear();
+        }
+
+        // Encode while the next request is painted.
+        lock.unlock();
+        const std::shared_ptr<PixmapPool::Pixmap> painted = std::make_shared<PixmapPool::Pixmap>(std::move(pixmap));
+        const std::shared_ptr<std::vector<uint64_t>> rowHashes =
+            std::make_shared<std::vector<uint64_t>>(std::move(hashes._rowHashes));
+        const Png::Codec codec = Png::codecFromString(tile.getCodec());
+        _tileEncoder.push([this, painted, rowHashes, tile, output, response, mode, codec, hash, wid, oldWireId]()
+            {
+                // Looked up in the cache already.
+                if (!_pngCache.cacheEncodeSubBufferToPNG(painted->data(), 0, 0, tile.getWidth(), tile.getHeight(),
+                                                         tile.getWidth(), tile.getHeight(), *output, mode,
+                                                         codec, PngCache::getTileLocation(tile), hash, wid, oldWireId,
+                                                         rowHashes->empty() ? nullptr : rowHashes->data()))
+                {
+                    //FIXME: Return error.
+                    //sendTextFrame("error: cmd=tile kind=failure");
+
+                    LOG_ERR("Failed to encode tile into PNG.");
+                    return;
+                }
+
+                LOG_TRC("Sending render-tile response (" << output->size() << " bytes) for: " << response);
+                postMessage(output, WSOpCode::Binary);
+            });
+        ++_renderedTiles;
+    }
+
+    /// Post already encoded tiles, behind the ones still being encoded.
+    void postTiles(const std::shared_ptr<std::vector<char>>& message)
+    {
+        _tileEncoder.push([this, message]() { postMessage(message, WSOpCode::Binary); });
     }
 
+    /// Renders a tilecombine, in chunks of about TileRenderBudgetMs, as the
+    /// tiles took so far, when it's larger; the input that comes meanwhile
+    /// is handled between them.
     void renderCombinedTiles(const std::vector<std::string>& tokens)
     {
-        TileCombined tileCombined = TileCombined::parse(tokens);
+        TileCombined tileCombined = TileCombined::parse(tokens);
+        std::vector<TileDesc> tiles = tileCombined.getTiles();
+        _prerenderCodec = tileCombined.getCodec();
+
+        size_t chunkSize = tiles.size();
+        if (_renderedTiles > 0 && _renderTime > 0)
+        {
+            const double tileUs = static_cast<double>(_renderTime) / _renderedTiles;
+            chunkSize = std::max<size_t>(static_cast<size_t>(TileRenderBudgetMs * 1000 / tileUs), 1);
+        }
+
+        if (tiles.size() <= chunkSize)
+        {
+            renderCombinedTiles(std::move(tileCombined));
+            return;
+        }
+
+        // By rows, so that each chunk paints as little as possible.
+        std::stable_sort(tiles.begin(), tiles.end(), [](const TileDesc& a, const TileDesc& b)
+                         {
+                             return std::make_pair(a.getTilePosY(), a.getTilePosX()) <
+                                    std::make_pair(b.getTilePosY(), b.getTilePosX());
+                         });
+
+        LOG_TRC("Rendering " << tiles.size() << " tiles in chunks of " << chunkSize << ".");
+        for (size_t start = 0; start < tiles.size(); start += chunkSize)
+        {
+            if (start > 0)
+                handleInputBetweenChunks();
+
+            const std::vector<TileDesc> chunk(tiles.begin() + start,
+                                              tiles.begin() + std::min(start + chunkSize, tiles.size()));
+            renderCombinedTiles(TileCombined::create(chunk));
+            ++_renderChunks;
+        }
+    }
+
+    /// Handles the input queued while a chunk of tiles was rendered.
+    void handleInputBetweenChunks()
+    {
+        for (;;)
+        {
+            const TileQueue::Payload input = _tileQueue->getInput();
+            if (input.empty() || _stop || TerminationFlag)
+                return;
+
+            LOG_TRC("Kit Recv between chunks " << LOOLProtocol::getAbbreviatedMessage(input));
+            const Timestamp timestamp;
+            const std::vector<std::string> tokens = LOOLProtocol::tokenize(input.data(), input.size());
+            if (needsEncodedTiles(tokens))
+                _tileEncoder.drain();
+
+            handleChildMessage(tokens, input);
+            ++_inputsBetweenChunks;
+
+            // Not part of the rendering time.
+            _renderTime -= timestamp.elapsed();
+        }
+    }
+
+    /// Whether the session replies to the message right away with what makes
+    /// the client drop or re-request its tiles: the status of the document,
+    /// its current part, or the invalidations replayed on getting active.
+    static bool needsEncodedTiles(const std::vector<std::string>& tokens)
+    {
+        if (tokens.size() < 2)
+            return false;
+
+        const std::string& command = tokens[1];
+        return command == "load" || command == "status" || command == "setclientpart" ||
+               command == "setpage" || command == "useractive";
+    }
+
+    /// Forwards a message to its session, and notes when a key event came.
+    void handleChildMessage(const std::vector<std::string>& tokens, const TileQueue::Payload& input)
+    {
+        if (tokens.size() > 1 && (tokens[1] == "key" || tokens[1] == "textinput"))
+        {
+            // The previous one didn't invalidate anything, unless it's held back.
+            if (!_keyEventPending || _heldInvalidations.empty())
+            {
+                _keyEventPending = true;
+                _keyEventTime = _tileQueue->getLastInputTime();
+            }
+        }
+
+        updatePrerenderView(tokens);
+        forwardToChild(tokens[0], input);
+    }
+
+    /// Counts the time from the key event pending to its first invalidation.
+    void keyEventInvalidated()
+    {
+        if (!_keyEventPending)
+            return;
+
+        _keyEventPending = false;
+        const auto latencyMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - _keyEventTime).count();
+        size_t bucket = 0;
+        while (bucket < KeyLatencyBuckets - 1 && latencyMs >= KeyLatencyBoundsMs[bucket])
+            ++bucket;
+
+        ++_keyLatencies[bucket];
+    }
+
+    /// The key latency histogram, as comma separated counts.
+    std::string getKeyLatencies() const
+    {
+        std::string result;
+        for (const uint64_t count : _keyLatencies)
+            result += (result.empty() ? "" : ",") + std::to_string(count);
+
+        return result;
+    }
+
+    void renderCombinedTiles(TileCombined tileCombined)
+    {
         auto& tiles = tileCombined.getTiles();
 
         Util::Rectangle renderArea;
@@ -1088,7 +1715,9 @@ public:
         const size_t pixmapWidth = tilesByX * tileCombined.getWidth();
         const size_t pixmapHeight = tilesByY * tileCombined.getHeight();
         const size_t pixmapSize = 4 * pixmapWidth * pixmapHeight;
-        std::vector<unsigned char> pixmap(pixmapSize, 0);
+        PixmapPool::Pixmap pixmap = _pixmapPool.acquire(pixmapSize);
+        if (!pixmap.data())
+            return;
 
         std::unique_lock<std::mutex> lock(_documentMutex);
         if (!_loKitDocument)
@@ -1117,8 +1746,18 @@ public:
                 " rendered in " << (elapsed/1000.) << " ms (" << area / elapsed << " MP/s).");
         const auto mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
 
-        std::vector<char> output;
-        output.reserve(pixmapSize);
+        const int pixelWidth = tileCombined.getWidth();
+        const int pixelHeight = tileCombined.getHeight();
+
+        // Hash, de-duplicate and watermark serially, the wire-ids must
+        // be allocated in order, and the watermark is not thread-safe.
+        std::vector<std::pair<int, int>> offsets;
+        std::vector<Png::TileHashes> hashes;
+        std::vector<PngCache::CacheData> encoded;
+        offsets.reserve(tileRecs.size());
+        hashes.reserve(tileRecs.size());
+        encoded.reserve(tileRecs.size());
+        Png::TileHashes tileHashes;
 
         size_t tileIndex = 0;
         for (Util::Rectangle& tileRect : tileRecs)
@@ -1126,15 +1765,12 @@ public:
             const size_t positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
             const size_t positionY = (tileRect.getTop() - renderArea.getTop()) / tileCombined.getTileHeight();
 
-            const size_t oldSize = output.size();
-            const int pixelWidth = tileCombined.getWidth();
-            const int pixelHeight = tileCombined.getHeight();
-
             const int offsetX = positionX * pixelWidth;
             const int offsetY = positionY * pixelHeight;
 
-            const uint64_t hash = Png::hashSubBuffer(pixmap.data(), offsetX, offsetY,
-                                                     pixelWidth, pixelHeight, pixmapWidth, pixmapHeight);
+            Png::hashSubBufferRows(pixmap.data(), offsetX, offsetY,
+                                   pixelWidth, pixelHeight, pixmapWidth, pixmapHeight, tileHashes);
+            const uint64_t hash = tileHashes._hash;
 
             TileWireId wireId = _pngCache.hashToWireId(hash);
             TileWireId oldWireId = tiles[tileIndex].getOldWireId();
@@ -1147,48 +1783,137 @@ public:
                 continue;
             }
 
+            // Tiles encoded before are shared from the cache, not copied.
+            PngCache::CacheData cached;
             if (_docWatermark)
-                _docWatermark->blending(pixmap.data(), offsetX, offsetY,
-                                        pixmapWidth, pixmapHeight,
-                                        pixelWidth, pixelHeight,
-                                        mode);
-
-            if (!_pngCache.encodeSubBufferToPNG(pixmap.data(), offsetX, offsetY,
-                                                pixelWidth, pixelHeight, pixmapWidth, pixmapHeight, output, mode,
-                                                hash, wireId, oldWireId))
-            {
-                //FIXME: Return error.
-                //sendTextFrame("error: cmd=tile kind=failure");
-                LOG_ERR("Failed to encode tile into PNG.");
-                return;
+            {
+                // Identical tiles get identical watermarks: don't blend and encode them again.
+                cached = _pngCache.cacheLookup(hash);
+                if (!cached)
+                    _docWatermark->blending(pixmap.data(), offsetX, offsetY,
+                                            pixmapWidth, pixmapHeight,
+                                            pixelWidth, pixelHeight,
+                                            mode);
+                // The row hashes no longer match the pixels.
+                tileHashes._rowHashes.clear();
+            }
+            else if (tileHashes._solid)
+            {
+                _pngCache.cacheSolid(hash, wireId);
+                const size_t position = (offsetY * pixmapWidth + offsetX) * 4;
+                tiles[tileIndex].setSolid(Png::pixelToColor(pixmap.data() + position, mode));
             }
+            else
+                cached = _pngCache.cacheLookup(hash);
 
-            const size_t imgSize = output.size() - oldSize;
-            LOG_TRC("Encoded tile #" << tileIndex << " at (" << positionX << "," << positionY << ") with oldWireId=" <<
-                    tiles[tileIndex].getOldWireId() << ", hash=" << hash << " wireId: " << wireId << " in " << imgSize << " bytes.");
             tiles[tileIndex].setWireId(wireId);
-            tiles[tileIndex].setImgSize(imgSize);
+            offsets.emplace_back(offsetX, offsetY);
+            hashes.push_back(std::move(tileHashes));
+            encoded.push_back(std::move(cached));
             tileIndex++;
         }
 
+        if (tileIndex == 0)
+        {
+            LOG_DBG("All tiles skipped, not producing empty tilecombine: message");
+            return;
+        }
+
         elapsed = timestamp.elapsed();
         LOG_DBG("renderCombinedTiles at (" << renderArea.getLeft() << ", " << renderArea.getTop() << "), (" <<
                 renderArea.getWidth() << ", " << renderArea.getHeight() << ") " <<
-                " took " << (elapsed/1000.) << " ms (including the paintTile).");
+                " painted in " << (elapsed/1000.) << " ms (including the hashing).");
 
-        if (tileIndex == 0)
+        // Encode and send while the next request is painted.
+        lock.unlock();
+        std::shared_ptr<CombinedRender> render = std::make_shared<CombinedRender>(std::move(pixmap), std::move(tileCombined));
+        render->_pixmapWidth = pixmapWidth;
+        render->_pixmapHeight = pixmapHeight;
+        render->_mode = mode;
+        render->_offsets = std::move(offsets);
+        render->_hashes = std::move(hashes);
+        render->_encoded = std::move(encoded);
+        _tileEncoder.push([this, render]() { encodeCombinedTiles(*render); });
+        _renderedTiles += tileIndex;
+    }
+
+    /// Encodes the tiles painted by renderCombinedTiles(), and sends them.
+    void encodeCombinedTiles(CombinedRender& render)
+    {
+        Timestamp timestamp;
+        std::vector<TileDesc>& tiles = render._tileCombined.getTiles();
+        std::vector<PngCache::CacheData>& encoded = render._encoded;
+        const int pixelWidth = render._tileCombined.getWidth();
+        const int pixelHeight = render._tileCombined.getHeight();
+
+        // Compress the missing sub-tiles in parallel, each into its own buffer.
+        const Png::Codec codec = Png::codecFromString(render._tileCombined.getCodec());
+        std::atomic<bool> failed(false);
         {
-            LOG_DBG("All tiles skipped, not producing empty tilecombine: message");
+            std::unique_lock<std::mutex> lock = _pngPool.getLock();
+            for (size_t i = 0; i < tiles.size(); ++i)
+            {
+                // Solid tiles are sent as their colour only.
+                if (!tiles[i].getSolid().empty() || encoded[i])
+                    continue;
+
+                encoded[i] = std::make_shared<std::vector<char>>();
+                encoded[i]->reserve(pixelWidth * pixelHeight);
+                _pngPool.pushWorkUnlocked([&, i]() {
+                        const std::vector<uint64_t>& rowHashes = render._hashes[i]._rowHashes;
+                        if (!_pngCache.cacheEncodeSubBufferToPNG(render._pixmap.data(),
+                                                                 render._offsets[i].first, render._offsets[i].second,
+                                                                 pixelWidth, pixelHeight,
+                                                                 render._pixmapWidth, render._pixmapHeight,
+                                                                 *encoded[i], render._mode, codec,
+                                                                 PngCache::getTileLocation(tiles[i]), render._hashes[i]._hash,
+                                                                 tiles[i].getWireId(), tiles[i].getOldWireId(),
+                                                                 rowHashes.empty() ? nullptr : rowHashes.data()))
+                        {
+                            failed = true;
+                        }
+                    });
+            }
+        }
+        _pngPool.run();
+
+        if (failed)
+        {
+            //FIXME: Return error.
+            //sendTextFrame("error: cmd=tile kind=failure");
+            LOG_ERR("Failed to encode tile into PNG.");
             return;
         }
 
-        const auto tileMsg = ADD_DEBUG_RENDERID(tileCombined.serialize("tilecombine:")) + "\n";
+        // The header lists the image sizes, so it goes in once they are known.
+        size_t outputSize = 0;
+        for (size_t i = 0; i < tiles.size(); ++i)
+        {
+            const size_t imgSize = encoded[i] ? encoded[i]->size() : 0;
+            LOG_TRC("Encoded tile #" << i << " at (" << render._offsets[i].first << "," << render._offsets[i].second <<
+                    ") with oldWireId=" << tiles[i].getOldWireId() << ", hash=" << render._hashes[i]._hash <<
+                    " wireId: " << tiles[i].getWireId() << " in " << imgSize << " bytes.");
+            tiles[i].setImgSize(imgSize);
+            outputSize += imgSize;
+        }
+
+        LOG_DBG("encodeCombinedTiles of " << tiles.size() << " tiles took " << (timestamp.elapsed()/1000.) << " ms.");
+
+        const auto tileMsg = ADD_DEBUG_RENDERID(render._tileCombined.serialize("tilecombine:")) + "\n";
         LOG_TRC("Sending back painted tiles for " << tileMsg);
 
+        _pngCache.countCopiedBytes(outputSize);
+
+        // Assemble in the order of the tilecombine, copying each tile once,
+        // into a buffer that is then handed over to the socket as-is.
         std::shared_ptr<std::vector<char>> response = std::make_shared<std::vector<char>>();
-        response->resize(tileMsg.size() + output.size());
-        std::copy(tileMsg.begin(), tileMsg.end(), response->begin());
-        std::copy(output.begin(), output.end(), response->begin() + tileMsg.size());
+        response->reserve(tileMsg.size() + outputSize);
+        response->insert(response->end(), tileMsg.begin(), tileMsg.end());
+        for (size_t i = 0; i < tiles.size(); ++i)
+        {
+            if (encoded[i])
+                response->insert(response->end(), encoded[i]->begin(), encoded[i]->end());
+        }
 
         postMessage(response, WSOpCode::Binary);
     }
@@ -1334,16 +2059,18 @@ public:
         {
             // no point in handling invalidations or page resizes per-view,
             // all views have to be in sync
-            tileQueue->put("callback all " + std::to_string(type) + ' ' + payload);
+            tileQueue->putCallback(TileQueue::Callback(TileQueue::Callback::Target::All, -1, type, payload));
         }
         else if (type == LOK_CALLBACK_INVALIDATE_VIEW_CURSOR ||
                  type == LOK_CALLBACK_CELL_VIEW_CURSOR)
         {
             // these should go to all views but the one that that triggered it
-            tileQueue->put("callback except-" + targetViewId + ' ' + std::to_string(type) + ' ' + payload);
+            tileQueue->putCallback(TileQueue::Callback(TileQueue::Callback::Target::AllExcept,
+                                                       std::stoi(targetViewId), type, payload));
         }
         else
-            tileQueue->put("callback " + std::to_string(descriptor->getViewId()) + ' ' + std::to_string(type) + ' ' + payload);
+            tileQueue->putCallback(TileQueue::Callback(TileQueue::Callback::Target::View,
+                                                       descriptor->getViewId(), type, payload));
     }
 
 private:
@@ -1351,7 +2078,7 @@ private:
     /// Helper method to broadcast callback and its payload to all clients
     void broadcastCallbackToClients(const int type, const std::string& payload)
     {
-        _tileQueue->put("callback all " + std::to_string(type) + ' ' + payload);
+        _tileQueue->putCallback(TileQueue::Callback(TileQueue::Callback::Target::All, -1, type, payload));
     }
 
     /// Load a document (or view) and register callbacks.
@@ -1880,6 +2607,451 @@ private:
         return std::string();
     }
 
+    /// Forward a callback to the views it is for, demultiplexing is done by the LibreOffice core.
+    void forwardCallback(const TileQueue::Callback& callback)
+    {
+        const bool broadcast = (callback._target != TileQueue::Callback::Target::View);
+        if (callback._type == LOK_CALLBACK_INVALIDATE_TILES)
+            keyEventInvalidated();
+
+        // TODO: replace with a map to be faster.
+        bool isFound = false;
+        for (auto& it : _sessions)
+        {
+            std::shared_ptr<ChildSession> session = it.second;
+            if (session && callback.isForView(session->getViewId()))
+            {
+                if (!it.second->isCloseFrame())
+                {
+                    isFound = true;
+                    session->loKitCallback(callback._type, callback._payload);
+                }
+                else
+                {
+                    LOG_ERR("Session-thread of session [" << session->getId() << "] for view [" <<
+                            callback._viewId << "] is not running. Dropping [" <<
+                            LOKitHelper::kitCallbackTypeToString(callback._type) <<
+                            "] payload [" << callback._payload << "].");
+                }
+
+                if (!broadcast)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (!isFound)
+        {
+            LOG_WRN("Document::ViewCallback. Session [" << callback._viewId <<
+                    "] is no longer active to process [" << LOKitHelper::kitCallbackTypeToString(callback._type) <<
+                    "] [" << callback._payload << "] message to Master Session.");
+        }
+    }
+
+    /// Reads an invalidation, "x, y, width, height, part", or "EMPTY, part"
+    /// when all of the part is invalid; returns false when it's neither.
+    static bool parseInvalidation(const std::string& payload, Util::Rectangle& rectangle,
+                                  bool& whole, int& part)
+    {
+        const std::vector<std::string> tokens = LOOLProtocol::tokenize(payload);
+        whole = (tokens.size() == 2 && tokens[0] == "EMPTY,");
+        if (whole)
+        {
+            part = std::atoi(tokens[1].c_str());
+            return true;
+        }
+
+        if (tokens.size() != 5)
+            return false;
+
+        // The core may send up to INT_MAX as the size, past the end of the coordinates.
+        const long long x = std::strtoll(tokens[0].c_str(), nullptr, 10);
+        const long long y = std::strtoll(tokens[1].c_str(), nullptr, 10);
+        const long long width = std::strtoll(tokens[2].c_str(), nullptr, 10);
+        const long long height = std::strtoll(tokens[3].c_str(), nullptr, 10);
+        if (x < 0 || y < 0 || x > INT_MAX || y > INT_MAX || width <= 0 || height <= 0)
+            return false;
+
+        part = std::atoi(tokens[4].c_str());
+        rectangle = Util::Rectangle(x, y, std::min<long long>(width, INT_MAX - x),
+                                    std::min<long long>(height, INT_MAX - y));
+        return rectangle.hasSurface();
+    }
+
+    /// The tiles at 100% zoom a rectangle covers, to tell how many fewer
+    /// were invalidated; 0 when it's too large to count.
+    static uint64_t countTiles(const Util::Rectangle& rectangle)
+    {
+        const int tileTwips = 3840;
+        const int maxTwips = 1000 * tileTwips;
+        if (rectangle.getWidth() > maxTwips || rectangle.getHeight() > maxTwips)
+            return 0;
+
+        const uint64_t columns = (rectangle.getRight() - 1) / tileTwips - rectangle.getLeft() / tileTwips + 1;
+        const uint64_t rows = (rectangle.getBottom() - 1) / tileTwips - rectangle.getTop() / tileTwips + 1;
+        return columns * rows;
+    }
+
+    /// Holds an invalidation back, to send it with the others that come in
+    /// the next _invalidationDelayMs, or before the next tile is rendered or
+    /// callback forwarded, as a few rectangles for their union; returns false
+    /// when it is to be forwarded as it is.
+    bool holdInvalidation(const TileQueue::Callback& callback)
+    {
+        if (_invalidationDelayMs <= 0 || callback._type != LOK_CALLBACK_INVALIDATE_TILES)
+            return false;
+
+        Util::Rectangle rectangle;
+        bool whole = false;
+        int part = 0;
+        if (!parseInvalidation(callback._payload, rectangle, whole, part))
+            return false;
+
+        if (_heldInvalidations.empty())
+            _heldInvalidationsSince = std::chrono::steady_clock::now();
+
+        ++_invalidationsReceived;
+        HeldInvalidation& held = _heldInvalidations[HeldInvalidationKey(
+            static_cast<int>(callback._target), callback._viewId, part)];
+        if (whole)
+        {
+            held._whole = true;
+            held._region.clear();
+            return true;
+        }
+
+        const uint64_t tiles = countTiles(rectangle);
+        held._tiles += tiles;
+        held._unbounded = held._unbounded || tiles == 0;
+        if (!held._whole)
+            held._region.add(rectangle);
+
+        return true;
+    }
+
+    /// How long until the held invalidations are to be sent, or the
+    /// timeout otherwise, shorter while there are tiles to prerender.
+    unsigned getQueueTimeoutMs() const
+    {
+        const unsigned timeoutMs = hasTilesToPrerender() ? PrerenderIdleMs : POLL_TIMEOUT_MS * 2;
+        if (_heldInvalidations.empty())
+            return timeoutMs;
+
+        const auto heldMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - _heldInvalidationsSince).count();
+        if (heldMs >= _invalidationDelayMs)
+            return 1;
+
+        return std::min<unsigned>(timeoutMs, _invalidationDelayMs - heldMs);
+    }
+
+    /// Sends the held invalidations, once they were held long enough, or
+    /// at once when force is set.
+    void sendHeldInvalidations(bool force)
+    {
+        if (_heldInvalidations.empty())
+            return;
+
+        if (!force && std::chrono::steady_clock::now() - _heldInvalidationsSince <
+                          std::chrono::milliseconds(_invalidationDelayMs))
+        {
+            return;
+        }
+
+        // Nothing may overtake the tiles still being encoded.
+        _tileEncoder.drain();
+
+        for (const auto& it : _heldInvalidations)
+        {
+            const auto target = static_cast<TileQueue::Callback::Target>(std::get<0>(it.first));
+            const int viewId = std::get<1>(it.first);
+            const std::string part = std::to_string(std::get<2>(it.first));
+            const HeldInvalidation& held = it.second;
+            if (held._whole || held._unbounded)
+            {
+                // Don't count savings we can't tell.
+                _invalidatedTiles += held._tiles;
+                _invalidatedTilesSent += held._tiles;
+            }
+
+            if (held._whole)
+            {
+                forwardCallback(TileQueue::Callback(target, viewId, LOK_CALLBACK_INVALIDATE_TILES,
+                                                    "EMPTY, " + part));
+                ++_invalidationsSent;
+                continue;
+            }
+
+            if (!held._unbounded)
+                _invalidatedTiles += held._tiles;
+
+            for (const Util::Rectangle& rectangle : held._region.getRectangles())
+            {
+                forwardCallback(TileQueue::Callback(target, viewId, LOK_CALLBACK_INVALIDATE_TILES,
+                                                    std::to_string(rectangle.getLeft()) + ", " +
+                                                    std::to_string(rectangle.getTop()) + ", " +
+                                                    std::to_string(rectangle.getWidth()) + ", " +
+                                                    std::to_string(rectangle.getHeight()) + ", " + part));
+                ++_invalidationsSent;
+                if (!held._unbounded)
+                    _invalidatedTilesSent += countTiles(rectangle);
+            }
+        }
+
+        LOG_TRC("Sent held invalidations, " << _invalidationsSent << " for " <<
+                _invalidationsReceived << " so far.");
+        _heldInvalidations.clear();
+    }
+
+    /// Follows the area, zoom and part each view sees, from the messages
+    /// of its session, to prerender the tiles next to it.
+    void updatePrerenderView(const std::vector<std::string>& tokens)
+    {
+        if (_prerenderBudgetMs <= 0 || tokens.size() < 2)
+            return;
+
+        const std::string sessionId = tokens[0].substr(std::string("child-").size());
+        if (tokens[1] == "disconnect")
+        {
+            _prerenderViews.erase(sessionId);
+            return;
+        }
+
+        int values[4];
+        if (tokens[1] == "clientvisiblearea" && tokens.size() == 6 &&
+            LOOLProtocol::getTokenInteger(tokens[2], "x", values[0]) &&
+            LOOLProtocol::getTokenInteger(tokens[3], "y", values[1]) &&
+            LOOLProtocol::getTokenInteger(tokens[4], "width", values[2]) &&
+            LOOLProtocol::getTokenInteger(tokens[5], "height", values[3]))
+        {
+            PrerenderView& view = _prerenderViews[sessionId];
+            const Util::Rectangle area(values[0], values[1], values[2], values[3]);
+            if (view._hasArea && (area.getLeft() != view._area.getLeft() || area.getTop() != view._area.getTop()))
+            {
+                view._scrollX = (area.getLeft() > view._area.getLeft()) - (area.getLeft() < view._area.getLeft());
+                view._scrollY = (area.getTop() > view._area.getTop()) - (area.getTop() < view._area.getTop());
+            }
+
+            view._hasArea = true;
+            view._area = area;
+        }
+        else if (tokens[1] == "clientzoom" && tokens.size() == 6 &&
+                 LOOLProtocol::getTokenInteger(tokens[2], "tilepixelwidth", values[0]) &&
+                 LOOLProtocol::getTokenInteger(tokens[3], "tilepixelheight", values[1]) &&
+                 LOOLProtocol::getTokenInteger(tokens[4], "tiletwipwidth", values[2]) &&
+                 LOOLProtocol::getTokenInteger(tokens[5], "tiletwipheight", values[3]))
+        {
+            PrerenderView& view = _prerenderViews[sessionId];
+            view._hasZoom = values[0] > 0 && values[1] > 0 && values[2] > 0 && values[3] > 0;
+            view._tilePixelWidth = values[0];
+            view._tilePixelHeight = values[1];
+            view._tileTwipWidth = values[2];
+            view._tileTwipHeight = values[3];
+        }
+        else if (tokens[1] == "setclientpart" && tokens.size() == 3 &&
+                 LOOLProtocol::getTokenInteger(tokens[2], "part", values[0]) && values[0] >= 0)
+        {
+            _prerenderViews[sessionId]._part = values[0];
+        }
+        else
+            return;
+
+        // It moved: prerender next to where it is now.
+        PrerenderView& view = _prerenderViews[sessionId];
+        view._planned = false;
+        view._tiles.clear();
+        view._renderTime = 0;
+    }
+
+    /// Whether a view has tiles left to prerender, within its budget.
+    bool hasTilesToPrerender() const
+    {
+        for (const auto& it : _prerenderViews)
+        {
+            const PrerenderView& view = it.second;
+            if (!view._hasArea || !view._hasZoom)
+                continue;
+
+            if (!view._planned ||
+                (!view._tiles.empty() && view._renderTime < _prerenderBudgetMs * 1000))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// The tiles next to what a view sees, the nearest first: the next
+    /// screen in the direction it last moved, down by default, or the
+    /// same area of the next slide. Called with the document lock taken.
+    std::deque<TileDesc> getTilesToPrerender(const PrerenderView& view)
+    {
+        std::deque<TileDesc> tiles;
+        const Util::Rectangle& area = view._area;
+        if (area.getWidth() <= 0 || area.getHeight() <= 0)
+            return tiles;
+
+        const int type = _loKitDocument->getDocumentType();
+        int part = view._part;
+        int64_t left = area.getLeft();
+        int64_t top = area.getTop();
+        bool upwards = false;
+        if (type == LOK_DOCTYPE_PRESENTATION || type == LOK_DOCTYPE_DRAWING)
+        {
+            if (part + 1 >= _loKitDocument->getParts())
+                return tiles;
+
+            ++part;
+        }
+        else if (view._scrollX != 0 && view._scrollY == 0)
+            left += static_cast<int64_t>(view._scrollX) * area.getWidth();
+        else
+        {
+            upwards = view._scrollY < 0;
+            top += static_cast<int64_t>(upwards ? -1 : 1) * area.getHeight();
+        }
+
+        int64_t right = left + area.getWidth();
+        int64_t bottom = top + area.getHeight();
+        if (type != LOK_DOCTYPE_SPREADSHEET)
+        {
+            // The spreadsheets have no end.
+            long docWidth = 0;
+            long docHeight = 0;
+            _loKitDocument->getDocumentSize(&docWidth, &docHeight);
+            right = std::min<int64_t>(right, docWidth);
+            bottom = std::min<int64_t>(bottom, docHeight);
+        }
+
+        // On the grid of the tiles, which start at 0.
+        const int tileWidth = view._tileTwipWidth;
+        const int tileHeight = view._tileTwipHeight;
+        left = std::max<int64_t>(left, 0) / tileWidth * tileWidth;
+        top = std::max<int64_t>(top, 0) / tileHeight * tileHeight;
+        right = std::min<int64_t>(right, INT_MAX);
+        bottom = std::min<int64_t>(bottom, INT_MAX);
+        for (int64_t y = top; y < bottom; y += tileHeight)
+        {
+            for (int64_t x = left; x < right; x += tileWidth)
+            {
+                // The view requests the ones it sees itself.
+                if (part == view._part && x < area.getRight() && x + tileWidth > area.getLeft() &&
+                    y < area.getBottom() && y + tileHeight > area.getTop())
+                {
+                    continue;
+                }
+
+                tiles.emplace_back(part, view._tilePixelWidth, view._tilePixelHeight,
+                                   static_cast<int>(x), static_cast<int>(y),
+                                   tileWidth, tileHeight, -1, 0, -1, false);
+                tiles.back().setCodec(_prerenderCodec);
+            }
+        }
+
+        // The rows nearest to the view first.
+        if (upwards)
+            std::reverse(tiles.begin(), tiles.end());
+
+        return tiles;
+    }
+
+    /// Renders the next chunk of the tiles next to a view, while the queue
+    /// is idle, up to _prerenderBudgetMs each time it moves. They are sent
+    /// with no version, as no one requested them, for wsd to cache them.
+    /// Returns false when there were none to.
+    bool prerenderTiles()
+    {
+        if (!hasTilesToPrerender())
+            return false;
+
+        for (auto& it : _prerenderViews)
+        {
+            PrerenderView& view = it.second;
+            if (!view._hasArea || !view._hasZoom)
+                continue;
+
+            if (!view._planned)
+            {
+                // Not to be tried again before the view moves, lest we spin.
+                view._planned = true;
+
+                std::unique_lock<std::mutex> lock(_documentMutex);
+                if (!_loKitDocument || _loKitDocument->getViewsCount() <= 0)
+                    continue;
+
+                view._tiles = getTilesToPrerender(view);
+                LOG_TRC("Prerendering up to " << view._tiles.size() << " tiles next to view of session " <<
+                        it.first << ".");
+            }
+
+            if (view._tiles.empty() || view._renderTime >= _prerenderBudgetMs * 1000)
+                continue;
+
+            size_t chunkSize = view._tiles.size();
+            if (_renderedTiles > 0 && _renderTime > 0)
+            {
+                const double tileUs = static_cast<double>(_renderTime) / _renderedTiles;
+                chunkSize = std::max<size_t>(static_cast<size_t>(TileRenderBudgetMs * 1000 / tileUs), 1);
+            }
+
+            const size_t count = std::min(chunkSize, view._tiles.size());
+            const std::vector<TileDesc> chunk(view._tiles.begin(), view._tiles.begin() + count);
+            view._tiles.erase(view._tiles.begin(), view._tiles.begin() + count);
+
+            // The tiles are rendered after what invalidated them was sent.
+            sendHeldInvalidations(true);
+
+            const Timestamp timestamp;
+            renderCombinedTiles(TileCombined::create(chunk));
+            const Poco::Timestamp::TimeDiff elapsed = timestamp.elapsed();
+            view._renderTime += elapsed;
+            _renderTime += elapsed;
+            _prerenderTime += elapsed;
+            _prerenderedTiles += count;
+            return true;
+        }
+
+        return false;
+    }
+
+    /// Tells wsd about the tiles the queue dropped, no view needing them,
+    /// so that it requests them again when they are.
+    void sendCancelledTiles()
+    {
+        const std::vector<int> versions = _tileQueue->takeCancelledVersions();
+        if (versions.empty())
+            return;
+
+        std::string message = "tilescancelled:";
+        for (size_t i = 0; i < versions.size(); ++i)
+            message += (i == 0 ? ' ' : ',') + std::to_string(versions[i]);
+
+        sendTextFrame(message);
+    }
+
+#if !MOBILEAPP
+    /// Send the memory and tile cache statistics to WSD.
+    void sendMemoryStats()
+    {
+        sendTextFrame(Util::getMemoryStats(ProcSMapsFile) + ' ' + _pngCache.getStats() + ' ' +
+                      _pixmapPool.getStats() + " renderedtiles=" + std::to_string(_renderedTiles) +
+                      " rendermsec=" + std::to_string(_renderTime / 1000) + ' ' +
+                      _tileQueue->getCallbackStats() +
+                      " invalidations=" + std::to_string(_invalidationsReceived) +
+                      " invalidationssent=" + std::to_string(_invalidationsSent) +
+                      " invalidatedtiles=" + std::to_string(_invalidatedTiles) +
+                      " invalidatedtilessent=" + std::to_string(_invalidatedTilesSent) +
+                      " renderchunks=" + std::to_string(_renderChunks) +
+                      " chunkinputs=" + std::to_string(_inputsBetweenChunks) +
+                      " keylatencyms=" + getKeyLatencies() + ' ' +
+                      _tileQueue->getCancelStats() +
+                      " prerenderedtiles=" + std::to_string(_prerenderedTiles) +
+                      " prerendermsec=" + std::to_string(_prerenderTime / 1000));
+    }
+#endif
+
     void run() override
     {
         Util::setThreadName("lokit_" + _docId);
@@ -1889,21 +3061,50 @@ private:
         // Update memory stats and editor every 5 seconds.
         const int memStatsPeriodMs = 5000;
         auto lastMemStatsTime = std::chrono::steady_clock::now();
-        sendTextFrame(Util::getMemoryStats(ProcSMapsFile));
+        sendMemoryStats();
 #endif
         try
         {
             while (!_stop && !TerminationFlag)
             {
-                const TileQueue::Payload input = _tileQueue->get(POLL_TIMEOUT_MS * 2);
+                TileQueue::Callback callback;
+                const TileQueue::Payload input = _tileQueue->get(getQueueTimeoutMs(), callback);
+                sendHeldInvalidations(false);
+                sendCancelledTiles();
+                if (callback.isValid())
+                {
+                    if (_stop || TerminationFlag)
+                    {
+                        LOG_INF("_stop or TerminationFlag is set, breaking out of loop");
+                        break;
+                    }
+
+                    if (holdInvalidation(callback))
+                        continue;
+
+                    // A callback may not overtake the held invalidations, eg. a
+                    // cursor moved into text not invalidated yet, nor the tiles
+                    // still being encoded, as an invalidation would leave stale
+                    // tiles behind.
+                    sendHeldInvalidations(true);
+                    _tileEncoder.drain();
+
+                    forwardCallback(callback);
+                    continue;
+                }
+
                 if (input.empty())
                 {
+                    if (prerenderTiles())
+                        continue;
+
+                    _pixmapPool.shrinkIfIdle();
 #if !MOBILEAPP
                     auto duration = (std::chrono::steady_clock::now() - lastMemStatsTime);
                     std::chrono::milliseconds::rep durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
                     if (durationMs > memStatsPeriodMs)
                     {
-                        sendTextFrame(Util::getMemoryStats(ProcSMapsFile));
+                        sendMemoryStats();
                         lastMemStatsTime = std::chrono::steady_clock::now();
                     }
 #endif
@@ -1920,91 +3121,35 @@ private:
 
                 const std::vector<std::string> tokens = LOOLProtocol::tokenize(input.data(), input.size());
 
+                if (tokens[0] == "tile" || tokens[0] == "tilecombine")
+                {
+                    // The tiles are rendered after what invalidated them was sent.
+                    sendHeldInvalidations(true);
+
+                    const Timestamp timestamp;
+                    if (tokens[0] == "tile")
+                        renderTile(tokens);
+                    else
+                        renderCombinedTiles(tokens);
+                    _renderTime += timestamp.elapsed();
+                    continue;
+                }
+
+                // The tiles still being encoded may not be overtaken by a
+                // reply that replaces them, the other input only queues
+                // callbacks, which drain them anyway.
+                if (needsEncodedTiles(tokens))
+                    _tileEncoder.drain();
+
                 if (tokens[0] == "eof")
                 {
                     LOG_INF("Received EOF. Finishing.");
                     break;
                 }
 
-                if (tokens[0] == "tile")
-                {
-                    renderTile(tokens);
-                }
-                else if (tokens[0] == "tilecombine")
+                if (LOOLProtocol::getFirstToken(tokens[0], '-') == "child")
                 {
-                    renderCombinedTiles(tokens);
-                }
-                else if (LOOLProtocol::getFirstToken(tokens[0], '-') == "child")
-                {
-                    forwardToChild(tokens[0], input);
-                }
-                else if (tokens[0] == "callback")
-                {
-                    if (tokens.size() >= 3)
-                    {
-                        bool broadcast = false;
-                        int viewId = -1;
-                        int exceptViewId = -1;
-
-                        const std::string& target = tokens[1];
-                        if (target == "all")
-                        {
-                            broadcast = true;
-                        }
-                        else if (LOOLProtocol::matchPrefix("except-", target))
-                        {
-                            exceptViewId = std::stoi(target.substr(7));
-                            broadcast = true;
-                        }
-                        else
-                        {
-                            viewId = std::stoi(target);
-                        }
-
-                        const int type = std::stoi(tokens[2]);
-
-                        // payload is the rest of the message
-                        const size_t offset = tokens[0].length() + tokens[1].length() + tokens[2].length() + 3; // + delims
-                        const std::string payload(input.data() + offset, input.size() - offset);
-
-                        // Forward the callback to the same view, demultiplexing is done by the LibreOffice core.
-                        // TODO: replace with a map to be faster.
-                        bool isFound = false;
-                        for (auto& it : _sessions)
-                        {
-                            std::shared_ptr<ChildSession> session = it.second;
-                            if (session && ((broadcast && (session->getViewId() != exceptViewId)) || (!broadcast && (session->getViewId() == viewId))))
-                            {
-                                if (!it.second->isCloseFrame())
-                                {
-                                    isFound = true;
-                                    session->loKitCallback(type, payload);
-                                }
-                                else
-                                {
-                                    LOG_ERR("Session-thread of session [" << session->getId() << "] for view [" <<
-                                            viewId << "] is not running. Dropping [" << LOKitHelper::kitCallbackTypeToString(type) <<
-                                            "] payload [" << payload << "].");
-                                }
-
-                                if (!broadcast)
-                                {
-                                    break;
-                                }
-                            }
-                        }
-
-                        if (!isFound)
-                        {
-                            LOG_WRN("Document::ViewCallback. Session [" << viewId <<
-                                    "] is no longer active to process [" << LOKitHelper::kitCallbackTypeToString(type) <<
-                                    "] [" << payload << "] message to Master Session.");
-                        }
-                    }
-                    else
-                    {
-                        LOG_ERR("Invalid callback message: [" << LOOLProtocol::getAbbreviatedMessage(input) << "].");
-                    }
+                    handleChildMessage(tokens, input);
                 }
                 else
                 {
@@ -2070,6 +3215,107 @@ private:
     SocketPoll& _socketPoll;
     std::shared_ptr<WebSocketHandler> _websocketHandler;
     PngCache _pngCache;
+    /// Encodes the sub-tiles of a combined render.
+    ThreadPool _pngPool;
+    PixmapPool _pixmapPool;
+    /// Encodes and sends the tiles while the next ones are painted.
+    TileEncoder _tileEncoder;
+    /// Tiles rendered, and the time the document thread spent on them.
+    size_t _renderedTiles;
+    Poco::Timestamp::TimeDiff _renderTime;
+
+    /// The invalidations of a part held back, see holdInvalidation().
+    struct HeldInvalidation
+    {
+        HeldInvalidation()
+            : _whole(false)
+            , _unbounded(false)
+            , _tiles(0)
+        {
+        }
+
+        /// All of the part is invalid, the region is unused.
+        bool _whole;
+        /// Some rectangles were too large to count their tiles.
+        bool _unbounded;
+        Util::Region _region;
+        /// The tiles the rectangles held back cover, see countTiles().
+        uint64_t _tiles;
+    };
+
+    /// The target, view and part of held invalidations.
+    typedef std::tuple<int, int, int> HeldInvalidationKey;
+
+    std::map<HeldInvalidationKey, HeldInvalidation> _heldInvalidations;
+    /// When the oldest of the held invalidations came.
+    std::chrono::steady_clock::time_point _heldInvalidationsSince;
+    /// How long the invalidations are held back, 0 to forward them at once.
+    int _invalidationDelayMs;
+    /// The invalidations from the core, the ones sent in their stead, and
+    /// the tiles each cover.
+    uint64_t _invalidationsReceived;
+    uint64_t _invalidationsSent;
+    uint64_t _invalidatedTiles;
+    uint64_t _invalidatedTilesSent;
+
+    /// When the oldest key event not followed by an invalidation yet was
+    /// put in the queue, if _keyEventPending.
+    bool _keyEventPending;
+    std::chrono::steady_clock::time_point _keyEventTime;
+    /// The key events, by the time until their first invalidation was
+    /// sent, see KeyLatencyBoundsMs.
+    std::array<uint64_t, KeyLatencyBuckets> _keyLatencies;
+    /// The chunks large tilecombines were split into, and the inputs
+    /// handled between them.
+    uint64_t _renderChunks;
+    uint64_t _inputsBetweenChunks;
+
+    /// What a view sees, to prerender the tiles next to it.
+    struct PrerenderView
+    {
+        PrerenderView()
+            : _hasArea(false)
+            , _scrollX(0)
+            , _scrollY(0)
+            , _hasZoom(false)
+            , _tilePixelWidth(0)
+            , _tilePixelHeight(0)
+            , _tileTwipWidth(0)
+            , _tileTwipHeight(0)
+            , _part(0)
+            , _planned(false)
+            , _renderTime(0)
+        {
+        }
+
+        bool _hasArea;
+        Util::Rectangle _area;
+        /// The direction it last moved in, -1, 0 or 1.
+        int _scrollX;
+        int _scrollY;
+        bool _hasZoom;
+        int _tilePixelWidth;
+        int _tilePixelHeight;
+        int _tileTwipWidth;
+        int _tileTwipHeight;
+        int _part;
+        /// Whether the tiles to prerender were listed since it last moved,
+        /// the ones left, the nearest first, and the time spent on the others.
+        bool _planned;
+        std::deque<TileDesc> _tiles;
+        Poco::Timestamp::TimeDiff _renderTime;
+    };
+
+    /// The views, by the id of their session.
+    std::map<std::string, PrerenderView> _prerenderViews;
+    /// The time the tiles next to a view may take to prerender, each time
+    /// it moves, 0 to prerender none.
+    int _prerenderBudgetMs;
+    /// The codec the tiles were last requested in.
+    std::string _prerenderCodec;
+    /// The tiles prerendered, and the time spent on them.
+    uint64_t _prerenderedTiles;
+    Poco::Timestamp::TimeDiff _prerenderTime;
 
     // Document password provided
     std::string _docPassword;
@@ -15,8 +15,10 @@ l10nstrings.strUserName = _('User Name');
 l10nstrings.strDocumentsOpened = _('Documents opened');
 l10nstrings.strDocumentNumber = _('Number of Documents');
 l10nstrings.strMemoryConsumed = _('Memory consumed');
+l10nstrings.strTileCache = _('Tile cache (hit rate)');
 l10nstrings.strSentBytes = _('Bytes sent');
 l10nstrings.strRecvBytes = _('Bytes received');
+l10nstrings.strTileCacheStored = _('Tiles stored (shared)');
 l10nstrings.strPid = _('PID');
 l10nstrings.strDocument = _('Document');
 l10nstrings.strNumberOfViews = _('Number of views');
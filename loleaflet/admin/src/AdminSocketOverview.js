@@ -4,7 +4,7 @@
 */
 /* global _ vex $ Util AdminSocketBase Admin */
 
-function appendDocRow(document, $rowContainer, $userContainer, sPid, sName, sViews, sMem, sDocTime, sDocIdle, modified) {
+function appendDocRow(document, $rowContainer, $userContainer, sPid, sName, sViews, sMem, sTileCache, sTileCacheHitRate, sDocTime, sDocIdle, modified) {
 
 	var $pid = $(document.createElement('td')).text(sPid);
 	$pid.append($userContainer);
@@ -21,6 +21,10 @@ function appendDocRow(document, $rowContainer, $userContainer, sPid, sName, sVie
 	.text(Util.humanizeMem(parseInt(sMem)));
 	$rowContainer.append($mem);
 
+	var $tileCache = $(document.createElement('td')).attr('id', 'doctilecache' + sPid)
+	.text(Util.humanizeMem(parseInt(sTileCache)) + ' (' + parseInt(sTileCacheHitRate) + '%)');
+	$rowContainer.append($tileCache);
+
 	var $docTime = $(document.createElement('td')).addClass('elapsed_time')
 	.val(parseInt(sDocTime))
 	.text(Util.humanizeSecs(sDocTime));
@@ -51,6 +55,7 @@ var AdminSocketOverview = AdminSocketBase.extend({
 		this.socket.send('active_users_count');
 		this.socket.send('sent_bytes');
 		this.socket.send('recv_bytes');
+		this.socket.send('tile_cache_stats');
 	},
 
 	onSocketOpen: function() {
@@ -128,7 +133,7 @@ var AdminSocketOverview = AdminSocketBase.extend({
 
 		var $doc, $a, $rowContainer;
 		var nViews, nTotalViews;
-		var docProps, sPid, sName, sViews, sMem, sDocTime, sDocIdle, modified, userListJson;
+		var docProps, sPid, sName, sViews, sMem, sTileCache, sTileCacheHitRate, sDocTime, sDocIdle, modified, userListJson;
 		if (textMsg.startsWith('documents')) {
 			var jsonStart = textMsg.indexOf('{');
 			var jsonMsg = JSON.parse(textMsg.substr(jsonStart).trim());
@@ -140,6 +145,8 @@ var AdminSocketOverview = AdminSocketBase.extend({
 				sName = decodeURI(docProps['fileName']);
 				sViews = docProps['activeViews'];
 				sMem = docProps['memory'];
+				sTileCache = docProps['tileCacheKb'];
+				sTileCacheHitRate = docProps['tileCacheHitRate'];
 				sDocTime = docProps['elapsedTime'];
 				sDocIdle = docProps['idleTime'];
 				modified = docProps['modified'];
@@ -207,7 +214,7 @@ var AdminSocketOverview = AdminSocketBase.extend({
 				}
 				$userContainer.append($listContainer);
 
-				appendDocRow(document, $rowContainer, $userContainer, sPid, sName, sViews, sMem, sDocTime, sDocIdle, modified);
+				appendDocRow(document, $rowContainer, $userContainer, sPid, sName, sViews, sMem, sTileCache, sTileCacheHitRate, sDocTime, sDocIdle, modified);
 
 				$('#doclist').append($rowContainer);
 			}
@@ -241,7 +248,7 @@ var AdminSocketOverview = AdminSocketBase.extend({
 				$listContainer.append($listLabel);
 				$userContainer.append($listContainer);
 
-				appendDocRow(document, $rowContainer, $userContainer, sPid, sName, '0', sMem, '0', '0', '');
+				appendDocRow(document, $rowContainer, $userContainer, sPid, sName, '0', sMem, '0', '0', '0', '0', '');
 
 				$('#doclist').append($rowContainer);
 
@@ -324,6 +331,16 @@ var AdminSocketOverview = AdminSocketBase.extend({
 			}
 			$(document.getElementById(sCommand)).text(nData);
 		}
+		else if (textMsg.startsWith('tile_cache_stats')) {
+			// The memory the tiles use, and how many times more they would without sharing.
+			var stats = {};
+			textMsg.split(' ').slice(1).forEach(function(token) {
+				var pair = token.split('=');
+				stats[pair[0]] = pair[1];
+			});
+			$(document.getElementById('tile_cache_stats'))
+				.text(Util.humanizeMem(parseInt(stats['storedkb'])) + ' (x' + stats['dedup'] + ')');
+		}
 		else if (textMsg.startsWith('rmdoc')) {
 			textMsg = textMsg.substring('rmdoc'.length);
 			docProps = textMsg.trim().split(' ');
@@ -370,6 +387,10 @@ var AdminSocketOverview = AdminSocketBase.extend({
 					var $mem = $('#docmem' + sPid);
 					$mem.text(Util.humanizeMem(parseInt(sValue)));
 				}
+				else if (sProp == 'tilecache') {
+					var $tileCache = $('#doctilecache' + sPid);
+					$tileCache.text(Util.humanizeMem(parseInt(sValue)) + ' (' + parseInt(docProps[3]) + '%)');
+				}
 			}
 		}
 		else if (textMsg.startsWith('modifications')) {
@@ -750,9 +750,14 @@ L.Socket = L.Class.extend({
 		else {
 			var data = imgBytes.subarray(index + 1);
 
-			if (data.length > 0 && data[0] == 68 /* D */)
+			if (command.solid)
 			{
-				console.log('Socket: got a delta !');
+				// uniform tile, only its colour is sent
+				img = this._solidTileImage(command);
+			}
+			else if (data.length > 0 && data[0] == 68 /* D */)
+			{
+				// delta against the tile we have, applied in TileLayer._onTileMsg
 				var img = data;
 			}
 			else
@@ -881,6 +886,28 @@ L.Socket = L.Class.extend({
 		}
 	},
 
+	// Image data URL of a tile filled with the 'rrggbbaa' colour of the command.
+	_solidTileImage: function (command) {
+		var key = command.solid + ':' + command.width + 'x' + command.height;
+		if (!this._solidTiles) {
+			this._solidTiles = {};
+		}
+		if (!this._solidTiles[key]) {
+			var canvas = document.createElement('canvas');
+			canvas.width = command.width;
+			canvas.height = command.height;
+			var ctx = canvas.getContext('2d');
+			var rgba = command.solid;
+			ctx.fillStyle = 'rgba(' + parseInt(rgba.substring(0, 2), 16) + ',' +
+				parseInt(rgba.substring(2, 4), 16) + ',' +
+				parseInt(rgba.substring(4, 6), 16) + ',' +
+				parseInt(rgba.substring(6, 8), 16) / 255 + ')';
+			ctx.fillRect(0, 0, canvas.width, canvas.height);
+			this._solidTiles[key] = canvas.toDataURL('image/png');
+		}
+		return this._solidTiles[key];
+	},
+
 	parseServerCmd: function (msg) {
 		var tokens = msg.split(/[ \n]+/);
 		var command = {};
@@ -971,6 +998,9 @@ L.Socket = L.Class.extend({
 			else if (tokens[i].startsWith('wid=')) {
 				command.wireId = this.getParameterValue(tokens[i]);
 			}
+			else if (tokens[i].substring(0, 6) === 'solid=') {
+				command.solid = tokens[i].substring(6);
+			}
 			else if (tokens[i].substring(0, 6) === 'title=') {
 				command.title = tokens[i].substring(6);
 			}
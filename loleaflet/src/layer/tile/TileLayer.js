@@ -2,7 +2,7 @@
 /*
  * L.TileLayer is used for standard xyz-numbered tile layers.
  */
-/* global $ _ Uint8ClampedArray Uint8Array */
+/* global $ _ Uint8ClampedArray */
 // Implement String::startsWith which is non-portable (Firefox only, it seems)
 // See http://stackoverflow.com/questions/646628/how-to-check-if-a-string-startswith-another-string#4579228
 
@@ -13,18 +13,6 @@ if (typeof String.prototype.startsWith !== 'function') {
 	};
 }
 
-function hex2string(inData)
-{
-	var hexified = [];
-	var data = new Uint8Array(inData);
-	for (var i = 0; i < data.length; i++) {
-		var hex = data[i].toString(16);
-		var paddedHex = ('00' + hex).slice(-2);
-		hexified.push(paddedHex);
-	}
-	return hexified.join('');
-}
-
 L.Compatibility = {
 	clipboardSet: function (event, text) {
 		if (event.clipboardData) { // Standard
@@ -1376,38 +1364,20 @@ L.TileLayer = L.GridLayer.extend({
 			});
 		}
 		else if (tile && typeof(img) == 'object') {
-			// 'Uint8Array' delta
+			// 'Uint8Array' delta against the tile we have, in RGBA pixels
 			var canvas = document.createElement('canvas');
 			canvas.width = window.tileSize;
 			canvas.height = window.tileSize;
 			var ctx = canvas.getContext('2d');
-
-			var oldImg = new Image();
-			oldImg.src = tile.el.src;
-			ctx.drawImage(oldImg, 0, 0);
+			ctx.drawImage(tile.el, 0, 0);
 
 			// FIXME; can we operate directly on the image ?
 			var imgData = ctx.getImageData(0, 0, canvas.width, canvas.height);
 			var oldData = new Uint8ClampedArray(imgData.data);
 
 			var delta = img;
-			var pixSize = canvas.width * canvas.height * 4;
 			var offset = 0;
 
-			console.log('Applying a delta of length ' + delta.length + ' pix size: ' + pixSize + '\nhex: ' + hex2string(delta));
-
-			// Green-tinge the old-Data ...
-//			for (var i = 0; i < pixSize; ++i)
-//			{
-//				oldData[i*4 + 1] = 128;
-//			}
-
-			// wipe to grey.
-//			for (var i = 0; i < pixSize * 4; ++i)
-//			{
-//				imgData.data[i] = 128;
-//			}
-
 			// Apply delta.
 			for (var i = 1; i < delta.length;)
 			{
@@ -1418,7 +1388,6 @@ L.TileLayer = L.GridLayer.extend({
 					var srcRow = delta[i+2];
 					var destRow = delta[i+3];
 					i+= 4;
-					console.log('copy ' + count + ' row(s) ' + srcRow + ' to ' + destRow);
 					for (var cnt = 0; cnt < count; ++cnt)
 					{
 						var src = (srcRow + cnt) * canvas.width * 4;
@@ -1435,13 +1404,10 @@ L.TileLayer = L.GridLayer.extend({
 					var span = delta[i+3];
 					offset = destRow * canvas.width * 4 + destCol * 4;
 					i += 4;
-					console.log('apply new span of size ' + span + ' at pos ' + destCol + ', ' + destRow + ' into delta at byte: ' + offset);
 					span *= 4;
-					imgData.data[offset + 1] = 256; // debug - greener start
 					while (span-- > 0) {
 						imgData.data[offset++] = delta[i++];
 					}
-					imgData.data[offset - 2] = 256; // debug - blue terminator
 					break;
 				default:
 					console.log('ERROR: Unknown code ' + delta[i] +
@@ -1453,8 +1419,6 @@ L.TileLayer = L.GridLayer.extend({
 
 			ctx.putImageData(imgData, 0, 0);
 			tile.el.src = canvas.toDataURL('image/png');
-
-			console.log('set new image');
 		}
 		else if (tile) {
 			if (this._tiles[key]._invalidCount > 0) {
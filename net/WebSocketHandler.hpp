@@ -427,6 +427,28 @@ public:
         return sendFrame(socket, data, len, WSFrameMask::Fin | static_cast<unsigned char>(code), flush);
     }
 
+    /// Sends a WebSocket message of a header followed by a payload, eg. a
+    /// tile shared by the messages to several clients, without joining them first.
+    int sendMessage(const char* header, const size_t headerLen,
+                    const char* payload, const size_t payloadLen,
+                    const WSOpCode code, const bool flush = true) const
+    {
+        if (payloadLen == 0)
+            return sendMessage(header, headerLen, code, flush);
+
+        if (UnitBase::isUnitTesting())
+        {
+            // The tests filter whole messages.
+            std::vector<char> message(header, header + headerLen);
+            message.insert(message.end(), payload, payload + payloadLen);
+            return sendMessage(message.data(), message.size(), code, flush);
+        }
+
+        std::shared_ptr<StreamSocket> socket = _socket.lock();
+        return sendFrame(socket, header, headerLen, payload, payloadLen,
+                         WSFrameMask::Fin | static_cast<unsigned char>(code), flush);
+    }
+
 private:
 
     /// Sends a WebSocket frame given the data, length, and flags.
@@ -436,7 +458,17 @@ private:
                   const char* data, const size_t len,
                   unsigned char flags, const bool flush = true) const
     {
-        if (!socket || data == nullptr || len == 0)
+        return sendFrame(socket, data, len, nullptr, 0, flags, flush);
+    }
+
+    /// Sends a WebSocket frame of data followed by more data.
+    int sendFrame(const std::shared_ptr<StreamSocket>& socket,
+                  const char* data, const size_t dataLen,
+                  const char* more, const size_t moreLen,
+                  unsigned char flags, const bool flush) const
+    {
+        const size_t len = dataLen + moreLen;
+        if (!socket || data == nullptr || dataLen == 0)
             return -1;
 
         if (socket->isClosed())
@@ -484,7 +516,8 @@ private:
             out.push_back(static_cast<char>(0x76));
 
             // Copy the data.
-            out.insert(out.end(), data, data + len);
+            out.insert(out.end(), data, data + dataLen);
+            out.insert(out.end(), more, more + moreLen);
 
             // Mask it.
             for (size_t i = 4; i < out.size() - mask; ++i)
@@ -493,7 +526,8 @@ private:
         else
         {
             // Copy the data.
-            out.insert(out.end(), data, data + len);
+            out.insert(out.end(), data, data + dataLen);
+            out.insert(out.end(), more, more + moreLen);
         }
         const size_t size = out.size() - oldSize;
 #else
@@ -501,7 +535,8 @@ private:
         assert(flush);
         assert(out.size() == 0);
 
-        out.insert(out.end(), data, data + len);
+        out.insert(out.end(), data, data + dataLen);
+        out.insert(out.end(), more, more + moreLen);
         const size_t size = out.size();
 #endif
         if (flush)
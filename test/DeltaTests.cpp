@@ -9,12 +9,16 @@
 
 #include <config.h>
 
+#include <chrono>
+#include <cstring>
+
 #include <cppunit/extensions/HelperMacros.h>
 
 #include <Delta.hpp>
 #include <Util.hpp>
 #include <Png.hpp>
 #include <helpers.hpp>
+#include <test.hpp>
 
 /// Delta unit-tests.
 class DeltaTests : public CPPUNIT_NS::TestFixture
@@ -23,11 +27,21 @@ class DeltaTests : public CPPUNIT_NS::TestFixture
 
     CPPUNIT_TEST(testDeltaSequence);
     CPPUNIT_TEST(testRandomDeltas);
+    CPPUNIT_TEST(testDeltaScroll);
+    CPPUNIT_TEST(testDeltaVsPng);
+    CPPUNIT_TEST(testDeltaPixelFormat);
+    CPPUNIT_TEST(testDeltaHistory);
+    CPPUNIT_TEST(testTileHashes);
 
     CPPUNIT_TEST_SUITE_END();
 
     void testDeltaSequence();
     void testRandomDeltas();
+    void testDeltaScroll();
+    void testDeltaVsPng();
+    void testDeltaPixelFormat();
+    void testDeltaHistory();
+    void testTileHashes();
 
     std::vector<char> loadPng(const char *relpath,
                               png_uint_32& height,
@@ -150,6 +164,7 @@ void DeltaTests::assertEqual(const std::vector<char> &a,
 void DeltaTests::testDeltaSequence()
 {
     DeltaGenerator gen;
+    const DeltaGenerator::TileLocation location(0, 0, 3840, 256, 256, 0);
 
     png_uint_32 height, width, rowBytes;
     const TileWireId textWid = 1;
@@ -170,14 +185,14 @@ void DeltaTests::testDeltaSequence()
     // Stash it in the cache
     CPPUNIT_ASSERT(gen.createDelta(
                        reinterpret_cast<unsigned char *>(&text[0]),
-                       0, 0, width, height, width, height,
+                       0, 0, width, height, width, height, location,
                        delta, textWid, 0) == false);
     CPPUNIT_ASSERT(delta.size() == 0);
 
     // Build a delta between text2 & textWid
     CPPUNIT_ASSERT(gen.createDelta(
                        reinterpret_cast<unsigned char *>(&text2[0]),
-                       0, 0, width, height, width, height,
+                       0, 0, width, height, width, height, location,
                        delta, text2Wid, textWid) == true);
     CPPUNIT_ASSERT(delta.size() > 0);
 
@@ -189,7 +204,7 @@ void DeltaTests::testDeltaSequence()
     std::vector<char> two2one;
     CPPUNIT_ASSERT(gen.createDelta(
                        reinterpret_cast<unsigned char *>(&text[0]),
-                       0, 0, width, height, width, height,
+                       0, 0, width, height, width, height, location,
                        two2one, textWid, text2Wid) == true);
     CPPUNIT_ASSERT(two2one.size() > 0);
 
@@ -202,6 +217,336 @@ void DeltaTests::testRandomDeltas()
 {
 }
 
+void DeltaTests::testDeltaScroll()
+{
+    DeltaGenerator gen;
+    const DeltaGenerator::TileLocation location(0, 0, 3840, 256, 256, 0);
+
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text =
+        DeltaTests::loadPng(TDOC "/delta-text.png",
+                            height, width, rowBytes);
+    std::vector<char> text2 =
+        DeltaTests::loadPng(TDOC "/delta-text2.png",
+                            height, width, rowBytes);
+    CPPUNIT_ASSERT(height == 256 && width == 256 && rowBytes == 256*4);
+
+    // Scroll the text up by a few rows, revealing new content at the bottom.
+    TileWireId wid = 1;
+    std::chrono::steady_clock::duration elapsed(0);
+    int deltas = 0;
+    for (png_uint_32 shift = 1; shift <= 64; shift += 3)
+    {
+        std::vector<char> scrolled(text.begin() + shift * rowBytes, text.end());
+        scrolled.insert(scrolled.end(), text2.begin(), text2.begin() + shift * rowBytes);
+        CPPUNIT_ASSERT_EQUAL(text.size(), scrolled.size());
+
+        const TileWireId textWid = wid++;
+        const TileWireId scrolledWid = wid++;
+
+        std::vector<char> delta;
+        CPPUNIT_ASSERT(gen.createDelta(
+                           reinterpret_cast<unsigned char *>(&text[0]),
+                           0, 0, width, height, width, height, location,
+                           delta, textWid, 0) == false);
+
+        const auto start = std::chrono::steady_clock::now();
+        CPPUNIT_ASSERT(gen.createDelta(
+                           reinterpret_cast<unsigned char *>(&scrolled[0]),
+                           0, 0, width, height, width, height, location,
+                           delta, scrolledWid, textWid) == true);
+        elapsed += std::chrono::steady_clock::now() - start;
+        ++deltas;
+
+        std::vector<char> reScrolled = applyDelta(text, width, height, delta);
+        assertEqual(reScrolled, scrolled, width, height);
+
+        // The moved rows are copied, only the revealed ones cost pixels.
+        CPPUNIT_ASSERT(delta.size() < 1 + 4 * 8 + shift * rowBytes * 2);
+    }
+
+    // Scroll sideways by a pixel: no row matches any other now,
+    // so only the spans that changed within each row should be sent.
+    std::vector<char> shifted(text.size());
+    for (png_uint_32 y = 0; y < height; ++y)
+    {
+        memcpy(&shifted[y * rowBytes], &text[y * rowBytes], 4);
+        memcpy(&shifted[y * rowBytes + 4], &text[y * rowBytes], rowBytes - 4);
+    }
+
+    for (int i = 0; i < 8; ++i)
+    {
+        const TileWireId textWid = wid++;
+        const TileWireId shiftedWid = wid++;
+
+        std::vector<char> delta;
+        CPPUNIT_ASSERT(gen.createDelta(
+                           reinterpret_cast<unsigned char *>(&text[0]),
+                           0, 0, width, height, width, height, location,
+                           delta, textWid, 0) == false);
+
+        const auto start = std::chrono::steady_clock::now();
+        CPPUNIT_ASSERT(gen.createDelta(
+                           reinterpret_cast<unsigned char *>(&shifted[0]),
+                           0, 0, width, height, width, height, location,
+                           delta, shiftedWid, textWid) == true);
+        elapsed += std::chrono::steady_clock::now() - start;
+        ++deltas;
+
+        std::vector<char> reShifted = applyDelta(text, width, height, delta);
+        assertEqual(reShifted, shifted, width, height);
+        CPPUNIT_ASSERT(delta.size() < text.size() / 4);
+    }
+
+    const auto average = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / deltas;
+    if (isBenchmark())
+        std::cerr << "Average scroll delta time: " << average << " us" << std::endl;
+
+    // Generous, but an order of magnitude below the quadratic row search.
+    CPPUNIT_ASSERT(average < 10000);
+}
+
+void DeltaTests::testDeltaVsPng()
+{
+    DeltaGenerator gen;
+    const DeltaGenerator::TileLocation location(0, 0, 3840, 256, 256, 0);
+
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text =
+        DeltaTests::loadPng(TDOC "/delta-text.png",
+                            height, width, rowBytes);
+    std::vector<char> text2 =
+        DeltaTests::loadPng(TDOC "/delta-text2.png",
+                            height, width, rowBytes);
+
+    std::vector<char> delta;
+    CPPUNIT_ASSERT(gen.createDelta(
+                       reinterpret_cast<unsigned char *>(&text[0]),
+                       0, 0, width, height, width, height, location,
+                       delta, 1, 0) == false);
+    CPPUNIT_ASSERT(gen.createDelta(
+                       reinterpret_cast<unsigned char *>(&text2[0]),
+                       0, 0, width, height, width, height, location,
+                       delta, 2, 1) == true);
+
+    std::vector<char> reText2 = applyDelta(text, width, height, delta);
+    assertEqual(reText2, text2, width, height);
+
+    // This small edit is cheaper to send as a delta than as a PNG.
+    std::vector<char> png;
+    CPPUNIT_ASSERT(Png::encodeBufferToPNG(reinterpret_cast<unsigned char *>(&text2[0]),
+                                          width, height, png, LOK_TILEMODE_RGBA));
+    CPPUNIT_ASSERT(delta.size() < png.size());
+}
+
+void DeltaTests::testDeltaPixelFormat()
+{
+    DeltaGenerator gen;
+    const DeltaGenerator::TileLocation location(0, 0, 3840, 256, 256, 0);
+
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text =
+        DeltaTests::loadPng(TDOC "/delta-text.png",
+                            height, width, rowBytes);
+    std::vector<char> text2 =
+        DeltaTests::loadPng(TDOC "/delta-text2.png",
+                            height, width, rowBytes);
+
+    // Render them as the core does: premultiplied native endian ARGB,
+    // with some translucency to tell premultiplied from plain pixels.
+    const auto toBgra = [](const std::vector<char>& rgba)
+    {
+        std::vector<char> bgra(rgba.size());
+        for (size_t i = 0; i < rgba.size(); i += 4)
+        {
+            const uint32_t alpha = (i / 4) % 3 ? 255 : 128;
+            const uint32_t pixel = alpha << 24 |
+                                   ((uint8_t)rgba[i] * alpha / 255) << 16 |
+                                   ((uint8_t)rgba[i + 1] * alpha / 255) << 8 |
+                                   ((uint8_t)rgba[i + 2] * alpha / 255);
+            std::memcpy(&bgra[i], &pixel, sizeof(pixel));
+        }
+        return bgra;
+    };
+    std::vector<char> bgra = toBgra(text);
+    std::vector<char> bgra2 = toBgra(text2);
+
+    // What the client decodes from the PNG of each.
+    const auto toClient = [width](const std::vector<char>& pixels)
+    {
+        std::vector<char> rgba(pixels.size());
+        Png::unpremultiplyRow(reinterpret_cast<const unsigned char *>(pixels.data()),
+                              reinterpret_cast<unsigned char *>(&rgba[0]),
+                              pixels.size() / 4);
+        return rgba;
+    };
+
+    std::vector<char> delta;
+    CPPUNIT_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char *>(&bgra[0]),
+                                    0, 0, width, height, width, height, location,
+                                    delta, 1, 0, nullptr, LOK_TILEMODE_BGRA));
+    CPPUNIT_ASSERT(gen.createDelta(reinterpret_cast<unsigned char *>(&bgra2[0]),
+                                   0, 0, width, height, width, height, location,
+                                   delta, 2, 1, nullptr, LOK_TILEMODE_BGRA));
+
+    // The delta applies to the decoded tile as it is.
+    std::vector<char> reText2 = applyDelta(toClient(bgra), width, height, delta);
+    assertEqual(reText2, toClient(bgra2), width, height);
+}
+
+void DeltaTests::testDeltaHistory()
+{
+    DeltaGenerator gen;
+
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text =
+        DeltaTests::loadPng(TDOC "/delta-text.png",
+                            height, width, rowBytes);
+    std::vector<char> text2 =
+        DeltaTests::loadPng(TDOC "/delta-text2.png",
+                            height, width, rowBytes);
+    unsigned char* pixmap = reinterpret_cast<unsigned char *>(&text[0]);
+    unsigned char* pixmap2 = reinterpret_cast<unsigned char *>(&text2[0]);
+
+    const DeltaGenerator::TileLocation a(0, 0, 3840, 256, 256, 0);
+    const DeltaGenerator::TileLocation b(3840, 0, 3840, 256, 256, 0);
+    const DeltaGenerator::TileLocation c(0, 3840, 3840, 256, 256, 0);
+    const DeltaGenerator::TileLocation d(0, 3840, 3840, 256, 256, 1);
+
+    // Make room for three tiles only; their sizes vary a little.
+    std::vector<char> delta;
+    CPPUNIT_ASSERT(!gen.createDelta(pixmap, 0, 0, width, height, width, height, a, delta, 1, 0));
+    const size_t tileBytes = gen.getBytes();
+    CPPUNIT_ASSERT(tileBytes >= width * height * 4);
+    gen.setMaxBytes(tileBytes * 3 + tileBytes / 2);
+
+    CPPUNIT_ASSERT(!gen.createDelta(pixmap, 0, 0, width, height, width, height, b, delta, 2, 0));
+    CPPUNIT_ASSERT(!gen.createDelta(pixmap, 0, 0, width, height, width, height, c, delta, 3, 0));
+    CPPUNIT_ASSERT(!gen.createDelta(pixmap, 0, 0, width, height, width, height, d, delta, 4, 0));
+    CPPUNIT_ASSERT_EQUAL(tileBytes * 3, gen.getBytes());
+    CPPUNIT_ASSERT_EQUAL(size_t(0), gen.getHits() + gen.getMisses());
+
+    // The least recently used tile got evicted.
+    CPPUNIT_ASSERT(!gen.createDelta(pixmap2, 0, 0, width, height, width, height, a, delta, 5, 1));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), gen.getMisses());
+    CPPUNIT_ASSERT(delta.empty());
+
+    // The others are found by position, whatever else was rendered meanwhile.
+    CPPUNIT_ASSERT(gen.createDelta(pixmap2, 0, 0, width, height, width, height, c, delta, 6, 3));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), gen.getHits());
+    std::vector<char> reText2 = applyDelta(text, width, height, delta);
+    assertEqual(reText2, text2, width, height);
+
+    // Only against the version of the tile at the same position.
+    delta.clear();
+    CPPUNIT_ASSERT(!gen.createDelta(pixmap2, 0, 0, width, height, width, height, d, delta, 7, 6));
+    CPPUNIT_ASSERT_EQUAL(size_t(2), gen.getMisses());
+    CPPUNIT_ASSERT(delta.empty());
+
+    // Nor at another pixel size, eg. for a hi-dpi view.
+    const DeltaGenerator::TileLocation e(0, 3840, 3840, 128, 128, 0);
+    CPPUNIT_ASSERT(!gen.createDelta(pixmap2, 0, 0, 128, 128, width, height, e, delta, 8, 6));
+    CPPUNIT_ASSERT_EQUAL(size_t(3), gen.getMisses());
+    CPPUNIT_ASSERT(delta.empty());
+
+    CPPUNIT_ASSERT(gen.getBytes() <= tileBytes * 3 + tileBytes / 2);
+}
+
+void DeltaTests::testTileHashes()
+{
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text =
+        DeltaTests::loadPng(TDOC "/delta-text.png",
+                            height, width, rowBytes);
+    CPPUNIT_ASSERT(height == 256 && width == 256 && rowBytes == 256*4);
+
+    // The same tile, on the right of a buffer of two, hashes the same.
+    std::vector<char> buffer(text.size() * 2);
+    for (png_uint_32 y = 0; y < height; ++y)
+        memcpy(&buffer[(y * 2 + 1) * rowBytes], &text[y * rowBytes], rowBytes);
+
+    unsigned char *pixmap = reinterpret_cast<unsigned char *>(&text[0]);
+    Png::TileHashes hashes;
+    Png::hashSubBufferRows(pixmap, 0, 0, width, height, width, height, hashes);
+    CPPUNIT_ASSERT(hashes._hash != 0);
+    CPPUNIT_ASSERT(!hashes._solid);
+    CPPUNIT_ASSERT_EQUAL(size_t(height), hashes._rowHashes.size());
+
+    // The tile hash becomes the wireid: it is that of all the pixels,
+    // not of the weaker row hashes.
+    CPPUNIT_ASSERT_EQUAL(Png::hashSubBuffer(pixmap, 0, 0, width, height, width, height),
+                         hashes._hash);
+
+    Png::TileHashes subHashes;
+    Png::hashSubBufferRows(reinterpret_cast<unsigned char *>(&buffer[0]), width, 0,
+                           width, height, width * 2, height, subHashes);
+    CPPUNIT_ASSERT_EQUAL(hashes._hash, subHashes._hash);
+    CPPUNIT_ASSERT(hashes._rowHashes == subHashes._rowHashes);
+
+    // Both row hash implementations tell the rows apart like a byte compare.
+    for (png_uint_32 y = 1; y < height; ++y)
+    {
+        const bool same = !memcmp(&text[y * rowBytes], &text[(y - 1) * rowBytes], rowBytes);
+        CPPUNIT_ASSERT_EQUAL(same, hashes._rowHashes[y] == hashes._rowHashes[y - 1]);
+        CPPUNIT_ASSERT_EQUAL(same, Png::hashRowScalar(pixmap + y * rowBytes, rowBytes) ==
+                                   Png::hashRowScalar(pixmap + (y - 1) * rowBytes, rowBytes));
+    }
+
+    // A single pixel changes the tile hash and only its row hash.
+    std::vector<char> changed = text;
+    changed[100 * rowBytes + 37 * 4] ^= 0x01;
+    Png::hashSubBufferRows(reinterpret_cast<unsigned char *>(&changed[0]), 0, 0,
+                           width, height, width, height, subHashes);
+    CPPUNIT_ASSERT(hashes._hash != subHashes._hash);
+    for (png_uint_32 y = 0; y < height; ++y)
+        CPPUNIT_ASSERT_EQUAL(y != 100, hashes._rowHashes[y] == subHashes._rowHashes[y]);
+
+    // Solid tiles are spotted in the same pass.
+    std::vector<char> solid(text.size(), '\xff');
+    Png::hashSubBufferRows(reinterpret_cast<unsigned char *>(&solid[0]), 0, 0,
+                           width, height, width, height, subHashes);
+    CPPUNIT_ASSERT(subHashes._solid);
+
+    // Deltas are the same whether the rows come hashed or not.
+    DeltaGenerator gen;
+    const DeltaGenerator::TileLocation location(0, 0, 3840, 256, 256, 0);
+    std::vector<char> delta;
+    std::vector<char> hashedDelta;
+    Png::hashSubBufferRows(reinterpret_cast<unsigned char *>(&changed[0]), 0, 0,
+                           width, height, width, height, subHashes);
+    gen.createDelta(pixmap, 0, 0, width, height, width, height, location, delta, 1, 0);
+    CPPUNIT_ASSERT(gen.createDelta(reinterpret_cast<unsigned char *>(&changed[0]), 0, 0,
+                                   width, height, width, height, location, delta, 2, 1));
+    gen.createDelta(pixmap, 0, 0, width, height, width, height, location, hashedDelta, 3, 0,
+                    hashes._rowHashes.data());
+    CPPUNIT_ASSERT(gen.createDelta(reinterpret_cast<unsigned char *>(&changed[0]), 0, 0,
+                                   width, height, width, height, location, hashedDelta, 4, 3,
+                                   subHashes._rowHashes.data()));
+    CPPUNIT_ASSERT(delta == hashedDelta);
+
+    if (!isBenchmark())
+        return;
+
+    // Compare with hashing the whole tile with SpookyV2 alone, as before.
+    const int iterations = 1000;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t spooky = 0;
+    for (int i = 0; i < iterations; ++i)
+        spooky += Png::hashSubBuffer(pixmap, 0, 0, width, height, width, height);
+    const auto spookyTime = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        Png::hashSubBufferRows(pixmap, 0, 0, width, height, width, height, hashes);
+    const auto fusedTime = std::chrono::steady_clock::now() - start;
+
+    std::cerr << "Tile hash: SpookyV2 "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(spookyTime).count() / iterations
+              << " ns, fused rows + solid "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(fusedTime).count() / iterations
+              << " ns per tile (" << spooky % 2 << ")" << std::endl;
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(DeltaTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
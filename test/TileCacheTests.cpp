@@ -21,12 +21,16 @@
 #include <MessageQueue.hpp>
 #include <Png.hpp>
 #include <TileCache.hpp>
+#include <TilePack.hpp>
 #include <Unit.hpp>
 #include <Util.hpp>
+#include <common/FileUtil.hpp>
 
 #include <countloolkits.hpp>
 #include <helpers.hpp>
 #include <test.hpp>
+#include <algorithm>
+#include <chrono>
 #include <sstream>
 
 using namespace helpers;
@@ -87,6 +91,13 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testTileBeingRenderedHandling);
     CPPUNIT_TEST(testWireIDFilteringOnWSDSide);
     CPPUNIT_TEST(testLimitTileVersionsOnFly);
+    CPPUNIT_TEST(testTileThroughput);
+    CPPUNIT_TEST(testTileCacheInvalidation);
+    CPPUNIT_TEST(testTileCacheBudget);
+    CPPUNIT_TEST(testTileCacheSharing);
+    CPPUNIT_TEST(testTilePrerenderHits);
+    CPPUNIT_TEST(testTilePackEdited);
+    CPPUNIT_TEST(testTileCacheSolid);
 
 
     CPPUNIT_TEST_SUITE_END();
@@ -118,6 +129,13 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     void testTileBeingRenderedHandling();
     void testWireIDFilteringOnWSDSide();
     void testLimitTileVersionsOnFly();
+    void testTileThroughput();
+    void testTileCacheInvalidation();
+    void testTileCacheBudget();
+    void testTileCacheSharing();
+    void testTilePrerenderHits();
+    void testTilePackEdited();
+    void testTileCacheSolid();
 
     void checkTiles(std::shared_ptr<LOOLWebSocket>& socket,
                     const std::string& type,
@@ -1535,6 +1553,295 @@ void TileCacheTests::testLimitTileVersionsOnFly()
     CPPUNIT_ASSERT_EQUAL(1, arrivedTiles);
 }
 
+void TileCacheTests::testTileThroughput()
+{
+    // Scroll through the document at a few zoom levels, so that none of the
+    // tiles are cached, and check that the kit keeps them all coming.
+    const char* testname = "testTileThroughput ";
+
+    std::string documentPath, documentURL;
+    getDocumentPathAndURL("Example.odt", documentPath, documentURL, testname);
+    std::shared_ptr<LOOLWebSocket> socket = loadDocAndGetSocket(_uri, documentURL, testname);
+
+    const int tilesPerRow = 4;
+    const int rows = 5;
+    const std::vector<int> tileTwips = { 3840, 3200, 2560, 1920 };
+
+    const auto start = std::chrono::steady_clock::now();
+    int requestedTiles = 0;
+    int arrivedTiles = 0;
+    for (const int twips : tileTwips)
+    {
+        for (int y = 0; y < rows; ++y)
+        {
+            std::string positionsX;
+            std::string positionsY;
+            for (int x = 0; x < tilesPerRow; ++x)
+            {
+                positionsX += (x ? "," : "") + std::to_string(x * twips);
+                positionsY += (x ? "," : "") + std::to_string(y * twips);
+            }
+
+            sendTextFrame(socket, "tilecombine part=0 width=256 height=256 tileposx=" + positionsX +
+                          " tileposy=" + positionsY + " tilewidth=" + std::to_string(twips) +
+                          " tileheight=" + std::to_string(twips), testname);
+            requestedTiles += tilesPerRow;
+        }
+
+        while (arrivedTiles < requestedTiles)
+        {
+            std::vector<char> tile = getResponseMessage(socket, "tile:", testname);
+            CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile.empty());
+            ++arrivedTiles;
+        }
+    }
+
+    const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    if (isBenchmark())
+        std::cerr << testname << arrivedTiles << " tiles in " << elapsedMs << " ms (" <<
+            (arrivedTiles * 1000. / std::max<int64_t>(elapsedMs, 1)) << " tiles/sec)." << std::endl;
+
+    CPPUNIT_ASSERT_EQUAL(requestedTiles, arrivedTiles);
+}
+
+void TileCacheTests::testTileCacheInvalidation()
+{
+    // A large document at one zoom: 100 columns and 1000 rows of tiles.
+    const char* testname = "testTileCacheInvalidation ";
+    TileCache tileCache("file:///tmp/large.odt", Poco::Timestamp());
+    const int tileSize = 3840;
+    const int columns = 100;
+    const int rows = 1000;
+    const std::string data = "tile";
+
+    auto start = std::chrono::steady_clock::now();
+    for (int row = 0; row < rows; ++row)
+    {
+        for (int column = 0; column < columns; ++column)
+        {
+            const TileDesc tile(0, 256, 256, column * tileSize, row * tileSize, tileSize, tileSize, -1, 0, -1, false);
+            tileCache.saveTileAndNotify(tile, data.data(), data.size());
+        }
+    }
+    const auto saveUs = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(columns * rows), tileCache.getTileCount());
+
+    // Typing: small invalidations, each inside a single tile.
+    const int invalidations = 1000;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < invalidations; ++i)
+    {
+        const int column = (i * 7) % columns;
+        const int row = i;
+        tileCache.invalidateTiles("invalidatetiles: part=0 x=" + std::to_string(column * tileSize + 100) +
+                                  " y=" + std::to_string(row * tileSize + 100) + " width=100 height=100");
+    }
+    const auto invalidateUs = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(columns * rows - invalidations), tileCache.getTileCount());
+
+    // Nothing in the other parts.
+    tileCache.invalidateTiles("invalidatetiles: EMPTY, 1");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(columns * rows - invalidations), tileCache.getTileCount());
+
+    // A whole row of tiles, and the ones touching it.
+    tileCache.invalidateTiles("invalidatetiles: part=0 x=0 y=" + std::to_string(rows / 2 * tileSize + 100) +
+                              " width=" + std::to_string(columns * tileSize) + " height=100");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(columns * rows - invalidations - columns + 1), tileCache.getTileCount());
+
+    tileCache.invalidateTiles("invalidatetiles: EMPTY, 0");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), tileCache.getTileCount());
+
+    if (isBenchmark())
+        std::cerr << testname << "saved " << columns * rows << " tiles in " << saveUs / 1000 << " ms, " <<
+            invalidations << " invalidations in " << invalidateUs / 1000 << " ms (" <<
+            static_cast<double>(invalidateUs) / invalidations << " us each)." << std::endl;
+}
+
+void TileCacheTests::testTileCacheBudget()
+{
+    // Two documents sharing a budget of 10 tiles.
+    TileCache first("file:///tmp/first.odt", Poco::Timestamp());
+    TileCache second("file:///tmp/second.odt", Poco::Timestamp());
+    std::string data(100, 't');
+    TileCache::setMaxMemorySize(10 * data.size());
+
+    // Different tiles, not to share them.
+    const auto saveTile = [&data, &first](TileCache& tileCache, int index)
+    {
+        const TileDesc tile(0, 256, 256, index * 3840, 0, 3840, 3840, -1, 0, -1, false);
+        data[0] = &tileCache == &first ? 'f' : 's';
+        data[1] = '0' + index;
+        tileCache.saveTileAndNotify(tile, data.data(), data.size());
+    };
+
+    for (int i = 0; i < 6; ++i)
+        saveTile(first, i);
+    for (int i = 0; i < 4; ++i)
+        saveTile(second, i);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(6), first.getTileCount());
+    CPPUNIT_ASSERT_EQUAL(10 * data.size(), TileCache::getTotalMemorySize());
+
+    // Over budget: the least recently used tiles go, of the first document,
+    // down to 90% of the budget.
+    saveTile(second, 4);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), first.getTileCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(5), second.getTileCount());
+    CPPUNIT_ASSERT_EQUAL(4 * data.size(), first.getMemorySize());
+
+    // Saving a tile again uses it.
+    saveTile(first, 2);
+    saveTile(second, 5);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), first.getTileCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(6), second.getTileCount());
+
+    // Shrinking goes across the documents, from the least recently used.
+    CPPUNIT_ASSERT_EQUAL(5 * data.size(), TileCache::shrinkAll(5 * data.size()));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), first.getTileCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), second.getTileCount());
+
+    first.invalidateTiles("invalidatetiles: EMPTY, 0");
+    CPPUNIT_ASSERT_EQUAL(4 * data.size(), TileCache::getTotalMemorySize());
+
+    TileCache::setMaxMemorySize(0);
+}
+
+void TileCacheTests::testTileCacheSharing()
+{
+    // Blank tiles, in two documents.
+    TileCache first("file:///tmp/first.odt", Poco::Timestamp());
+    TileCache second("file:///tmp/second.odt", Poco::Timestamp());
+    const std::string blank(1000, 'b');
+    const std::string other(1000, 'o');
+    for (int i = 0; i < 10; ++i)
+    {
+        const TileDesc tile(0, 256, 256, i * 3840, 0, 3840, 3840, -1, 0, -1, false);
+        first.saveTileAndNotify(tile, blank.data(), blank.size());
+        second.saveTileAndNotify(tile, blank.data(), blank.size());
+    }
+
+    // Stored once, but counted in each document.
+    CPPUNIT_ASSERT_EQUAL(blank.size(), TileCache::getTotalMemorySize());
+    CPPUNIT_ASSERT_EQUAL(10 * blank.size(), first.getMemorySize());
+    CPPUNIT_ASSERT_EQUAL(10 * blank.size(), second.getMemorySize());
+    CPPUNIT_ASSERT_EQUAL(std::string("blobs=1 referencedkb=19 storedkb=0 dedup=20.00"),
+                         TileCache::getBlobStats());
+
+    // A tile that changes gets its own blob.
+    const TileDesc tile(0, 256, 256, 0, 0, 3840, 3840, -1, 0, -1, false);
+    second.saveTileAndNotify(tile, other.data(), other.size());
+    CPPUNIT_ASSERT_EQUAL(2 * blank.size(), TileCache::getTotalMemorySize());
+
+    // The blobs live as long as a tile refers to them.
+    first.invalidateTiles("invalidatetiles: EMPTY, 0");
+    CPPUNIT_ASSERT_EQUAL(2 * blank.size(), TileCache::getTotalMemorySize());
+    second.invalidateTiles("invalidatetiles: part=0 x=0 y=0 width=100 height=100");
+    CPPUNIT_ASSERT_EQUAL(blank.size(), TileCache::getTotalMemorySize());
+    second.invalidateTiles("invalidatetiles: EMPTY, 0");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), TileCache::getTotalMemorySize());
+}
+
+void TileCacheTests::testTilePrerenderHits()
+{
+    TileCache tileCache("file:///tmp/prerender.odt", Poco::Timestamp());
+    const std::string data(1000, 'p');
+
+    // Prerendered tiles have no version.
+    for (int i = 0; i < 4; ++i)
+    {
+        const TileDesc tile(0, 256, 256, i * 3840, 3840, 3840, 3840, -1, 0, -1, false);
+        tileCache.saveTileAndNotify(tile, data.data(), data.size());
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(4), tileCache.getPrerenderedCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), tileCache.getPrerenderHitCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), tileCache.getRenderedCount());
+
+    // Each hit counts once.
+    const TileDesc first(0, 256, 256, 0, 3840, 3840, 3840, 1, 0, -1, false);
+    CPPUNIT_ASSERT(tileCache.lookupTile(first));
+    CPPUNIT_ASSERT(tileCache.lookupTile(first));
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), tileCache.getPrerenderHitCount());
+
+    // Not once rendered again on request.
+    const TileDesc second(0, 256, 256, 3840, 3840, 3840, 3840, 2, 0, -1, false);
+    tileCache.saveTileAndNotify(second, data.data(), data.size());
+    CPPUNIT_ASSERT(tileCache.lookupTile(second));
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), tileCache.getPrerenderHitCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), tileCache.getRenderedCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), tileCache.getWastedCount());
+
+    // Nor once invalidated.
+    tileCache.invalidateTiles("invalidatetiles: EMPTY, 0");
+    const TileDesc third(0, 256, 256, 7680, 3840, 3840, 3840, 3, 0, -1, false);
+    CPPUNIT_ASSERT(!tileCache.lookupTile(third));
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1), tileCache.getPrerenderHitCount());
+}
+
+void TileCacheTests::testTilePackEdited()
+{
+    const std::string tmpDir = Util::createRandomTmpDir();
+    const std::string dir = tmpDir + "/tiles";
+    TilePack::initialize(dir, 1024 * 1024);
+
+    const std::string uri = "file:///tmp/edited.odt";
+    const Poco::Timestamp modified = Poco::Timestamp::fromEpochTime(1000);
+    const std::string loaded(1000, 'l');
+    const std::string edited(1000, 'e');
+    const TileDesc first(0, 256, 256, 0, 0, 3840, 3840, 1, 0, -1, false);
+    const TileDesc second(0, 256, 256, 3840, 0, 3840, 3840, 2, 0, -1, false);
+    {
+        TileCache tileCache(uri, modified);
+        tileCache.setPack(TilePack::open(uri, modified, ""));
+        tileCache.saveTileAndNotify(first, loaded.data(), loaded.size());
+
+        // Edited, well before the document reports being modified.
+        tileCache.setEdited();
+        tileCache.invalidateTiles("invalidatetiles: part=0 x=0 y=0 width=100 height=100");
+        tileCache.saveTileAndNotify(first, edited.data(), edited.size());
+        tileCache.saveTileAndNotify(second, edited.data(), edited.size());
+    }
+
+    // Reopened, the pack has the tiles of the stored version only.
+    TileCache tileCache(uri, modified);
+    tileCache.setPack(TilePack::open(uri, modified, ""));
+    const TileCache::Tile tile = tileCache.lookupTile(first);
+    CPPUNIT_ASSERT(tile);
+    CPPUNIT_ASSERT_EQUAL(loaded, std::string(tile->begin(), tile->end()));
+    CPPUNIT_ASSERT(!tileCache.lookupTile(second));
+    tileCache.clear();
+
+    TilePack::initialize(std::string(), 0);
+    FileUtil::removeFile(dir, true);
+    ::rmdir(tmpDir.c_str());
+}
+
+void TileCacheTests::testTileCacheSolid()
+{
+    TileCache tileCache("file:///tmp/solid.odt", Poco::Timestamp());
+
+    // The kit sends uniform tiles as their colour only.
+    TileDesc uniform(0, 256, 256, 0, 0, 3840, 3840, 1, 0, -1, false);
+    uniform.setSolid("ff8000ff");
+    tileCache.saveTileAndNotify(uniform, nullptr, 0);
+
+    bool solid = false;
+    TileCache::Tile tile = tileCache.lookupTile(uniform, &solid);
+    CPPUNIT_ASSERT(tile);
+    CPPUNIT_ASSERT(solid);
+    CPPUNIT_ASSERT_EQUAL(std::string("ff8000ff"), TileCache::getSolidColor(tile));
+
+    // Whatever their size, the other tiles are images.
+    const TileDesc image(0, 256, 256, 3840, 0, 3840, 3840, 2, 0, -1, false);
+    const std::string data("\x89PNG");
+    tileCache.saveTileAndNotify(image, data.data(), data.size());
+    tile = tileCache.lookupTile(image, &solid);
+    CPPUNIT_ASSERT(tile);
+    CPPUNIT_ASSERT(!solid);
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(TileCacheTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
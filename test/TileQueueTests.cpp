@@ -9,6 +9,11 @@
 
 #include <config.h>
 
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+
 #include <cppunit/extensions/HelperMacros.h>
 
 #include <Common.hpp>
@@ -16,7 +21,9 @@
 #include <Message.hpp>
 #include <MessageQueue.hpp>
 #include <SenderQueue.hpp>
+#include <TileDesc.hpp>
 #include <Util.hpp>
+#include <test.hpp>
 
 namespace CPPUNIT_NS
 {
@@ -46,12 +53,16 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testTileRecombining);
     CPPUNIT_TEST(testViewOrder);
     CPPUNIT_TEST(testPreviewsDeprioritization);
+    CPPUNIT_TEST(testInputPriority);
+    CPPUNIT_TEST(testTileCancellation);
     CPPUNIT_TEST(testSenderQueue);
     CPPUNIT_TEST(testSenderQueueTileDeduplication);
     CPPUNIT_TEST(testInvalidateViewCursorDeduplication);
     CPPUNIT_TEST(testCallbackInvalidation);
     CPPUNIT_TEST(testCallbackIndicatorValue);
     CPPUNIT_TEST(testCallbackPageSize);
+    CPPUNIT_TEST(testTileQueueBenchmark);
+    CPPUNIT_TEST(testCallbackBenchmark);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -60,12 +71,16 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     void testTileRecombining();
     void testViewOrder();
     void testPreviewsDeprioritization();
+    void testInputPriority();
+    void testTileCancellation();
     void testSenderQueue();
     void testSenderQueueTileDeduplication();
     void testInvalidateViewCursorDeduplication();
     void testCallbackInvalidation();
     void testCallbackIndicatorValue();
     void testCallbackPageSize();
+    void testTileQueueBenchmark();
+    void testCallbackBenchmark();
 };
 
 void TileQueueTests::testTileQueuePriority()
@@ -163,7 +178,7 @@ void TileQueueTests::testTileRecombining()
     queue.put("tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 tilewidth=3840 tileheight=3840");
 
     // the tilecombine's get merged, resulting in 3 "tile" messages
-    CPPUNIT_ASSERT_EQUAL(3, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(3, static_cast<int>(queue.getQueueSize()));
 
     // but when we later extract that, it is just one "tilecombine" message
     std::string message(payloadAsString(queue.get()));
@@ -171,7 +186,7 @@ void TileQueueTests::testTileRecombining()
     CPPUNIT_ASSERT_EQUAL(std::string("tilecombine part=0 width=256 height=256 tileposx=7680,0,3840 tileposy=0,0,0 imgsize=0,0,0 tilewidth=3840 tileheight=3840 ver=-1,-1,-1 oldwid=0,0,0 wid=0,0,0"), message);
 
     // and nothing remains in the queue
-    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueueSize()));
 }
 
 void TileQueueTests::testViewOrder()
@@ -197,7 +212,7 @@ void TileQueueTests::testViewOrder()
     for (auto &tile : tiles)
         queue.put(tile);
 
-    CPPUNIT_ASSERT_EQUAL(4, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(4, static_cast<int>(queue.getQueueSize()));
 
     // should result in the 3, 2, 1, 0 order of the tiles thanks to the cursor
     // positions
@@ -229,7 +244,7 @@ void TileQueueTests::testPreviewsDeprioritization()
     }
 
     // stays empty after all is done
-    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueueSize()));
 
     // re-ordering case - put previews and normal tiles to the queue and get
     // everything back again but this time the tiles have to interleave with
@@ -256,7 +271,7 @@ void TileQueueTests::testPreviewsDeprioritization()
     CPPUNIT_ASSERT_EQUAL(previews[3], payloadAsString(queue.get()));
 
     // stays empty after all is done
-    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueueSize()));
 
     // cursor positioning case - the cursor position should not prioritize the
     // previews
@@ -269,7 +284,110 @@ void TileQueueTests::testPreviewsDeprioritization()
     CPPUNIT_ASSERT_EQUAL(previews[0], payloadAsString(queue.get()));
 
     // stays empty after all is done
-    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueueSize()));
+}
+
+void TileQueueTests::testInputPriority()
+{
+    TileQueue queue;
+
+    const std::string tile = "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=-1";
+    const std::string preview = "tile part=1 width=180 height=135 tileposx=0 tileposy=0 tilewidth=15875 tileheight=11906 ver=-1 id=1";
+    const std::string key = "child-0001 key type=input char=97 key=0";
+    const std::string mouse = "child-0001 mouse type=buttondown x=100 y=100 count=1 buttons=1 modifier=0";
+    const std::string save = "child-0001 uno .uno:Save";
+
+    CPPUNIT_ASSERT(TileQueue::MessageClass::Tile == TileQueue::getMessageClass(TileQueue::Payload(tile.begin(), tile.end())));
+    CPPUNIT_ASSERT(TileQueue::MessageClass::Preview == TileQueue::getMessageClass(TileQueue::Payload(preview.begin(), preview.end())));
+    CPPUNIT_ASSERT(TileQueue::MessageClass::Input == TileQueue::getMessageClass(TileQueue::Payload(key.begin(), key.end())));
+    CPPUNIT_ASSERT(TileQueue::MessageClass::Background == TileQueue::getMessageClass(TileQueue::Payload(save.begin(), save.end())));
+
+    // The input goes before the tiles and the previews, in order.
+    queue.put(tile);
+    queue.put(preview);
+    queue.put(key);
+    queue.put(mouse);
+
+    CPPUNIT_ASSERT_EQUAL(key, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(mouse, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(tile, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(preview, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueueSize()));
+
+    // But not before the other messages, nor the callbacks, put before it.
+    queue.put(tile);
+    queue.put(save);
+    queue.put(key);
+
+    CPPUNIT_ASSERT(queue.getInput().empty());
+    CPPUNIT_ASSERT_EQUAL(tile, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(save, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(key, payloadAsString(queue.getInput()));
+    CPPUNIT_ASSERT(queue.getInput().empty());
+
+    const std::string callback = "callback all 8 .uno:Bold=true";
+    queue.put(tile);
+    queue.put(callback);
+    queue.put(key);
+
+    CPPUNIT_ASSERT(queue.getInput().empty());
+    CPPUNIT_ASSERT_EQUAL(callback, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(key, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(tile, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueueSize()));
+}
+
+void TileQueueTests::testTileCancellation()
+{
+    TileQueue queue;
+
+    const std::string near = "tile part=0 width=256 height=256 tileposx=0 tileposy=3840 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=1";
+    const std::string far = "tile part=0 width=256 height=256 tileposx=0 tileposy=384000 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=2";
+    const std::string zoomed = "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=7680 tileheight=7680 oldwid=0 wid=0 ver=3";
+    const std::string area1 = "child-0001 clientvisiblearea x=0 y=0 width=20000 height=10000";
+    const std::string area2 = "child-0002 clientvisiblearea x=0 y=380000 width=20000 height=10000";
+
+    // Superseded by a newer request of the same tile.
+    queue.put(near);
+    queue.put(near);
+    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue.getQueueSize()));
+    queue.clear();
+
+    // Not while a view didn't tell what it sees.
+    queue.put("child-0002 load url=file:///doc.odt");
+    queue.put(near);
+    queue.put(far);
+    queue.put(area1);
+    CPPUNIT_ASSERT_EQUAL(4, static_cast<int>(queue.getQueueSize()));
+    CPPUNIT_ASSERT(queue.takeCancelledVersions().empty());
+
+    // Both views see the two tiles.
+    queue.put(area2);
+    CPPUNIT_ASSERT_EQUAL(5, static_cast<int>(queue.getQueueSize()));
+
+    // The far tile is seen by none once the second view is gone.
+    queue.put("child-0002 disconnect");
+    const std::vector<int> versions = queue.takeCancelledVersions();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), versions.size());
+    CPPUNIT_ASSERT_EQUAL(2, versions[0]);
+    CPPUNIT_ASSERT(queue.takeCancelledVersions().empty());
+
+    CPPUNIT_ASSERT_EQUAL(std::string("child-0002 load url=file:///doc.odt"), payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(near, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(area1, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(area2, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(std::string("child-0002 disconnect"), payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueueSize()));
+
+    // Of another zoom than the one of the view.
+    queue.put(near);
+    queue.put(zoomed);
+    queue.put("child-0001 clientzoom tilepixelwidth=256 tilepixelheight=256 tiletwipwidth=3840 tiletwipheight=3840");
+    CPPUNIT_ASSERT_EQUAL(near, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(3, queue.takeCancelledVersions()[0]);
+
+    CPPUNIT_ASSERT_EQUAL(std::string("cancelledtiles=0 supersededtiles=1 invisibletiles=1 otherzoomtiles=1"),
+                         queue.getCancelStats());
 }
 
 void TileQueueTests::testSenderQueue()
@@ -428,7 +546,7 @@ void TileQueueTests::testCallbackInvalidation()
     queue.put("callback all 0 284, 1418, 11105, 275, 0");
     queue.put("callback all 0 4299, 1418, 7090, 275, 0");
 
-    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue.getQueueSize()));
 
     CPPUNIT_ASSERT_EQUAL(std::string("callback all 0 284, 1418, 11105, 275, 0"), payloadAsString(queue.get()));
 
@@ -438,11 +556,11 @@ void TileQueueTests::testCallbackInvalidation()
     queue.put("callback all 0 4299, 10418, 7090, 275, 0");
     queue.put("callback all 0 4299, 20418, 7090, 275, 0");
 
-    CPPUNIT_ASSERT_EQUAL(4, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(4, static_cast<int>(queue.getQueueSize()));
 
     queue.put("callback all 0 EMPTY, 0");
 
-    CPPUNIT_ASSERT_EQUAL(2, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(2, static_cast<int>(queue.getQueueSize()));
     CPPUNIT_ASSERT_EQUAL(std::string("callback all 0 4299, 1418, 7090, 275, 1"), payloadAsString(queue.get()));
     CPPUNIT_ASSERT_EQUAL(std::string("callback all 0 EMPTY, 0"), payloadAsString(queue.get()));
 }
@@ -455,7 +573,7 @@ void TileQueueTests::testCallbackIndicatorValue()
     queue.put("callback all 10 25");
     queue.put("callback all 10 50");
 
-    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue.getQueueSize()));
     CPPUNIT_ASSERT_EQUAL(std::string("callback all 10 50"), payloadAsString(queue.get()));
 }
 
@@ -467,10 +585,185 @@ void TileQueueTests::testCallbackPageSize()
     queue.put("callback all 13 12474, 188626");
     queue.put("callback all 13 12474, 205748");
 
-    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue.getQueue().size()));
+    CPPUNIT_ASSERT_EQUAL(1, static_cast<int>(queue.getQueueSize()));
     CPPUNIT_ASSERT_EQUAL(std::string("callback all 13 12474, 205748"), payloadAsString(queue.get()));
 }
 
+void TileQueueTests::testTileQueueBenchmark()
+{
+    TileQueue queue;
+
+    // Two views, editing far from each other in a large sheet.
+    queue.updateCursorPosition(0, 0, 0, 0, 10, 100);
+    queue.updateCursorPosition(1, 0, 38400, 76800, 10, 100);
+
+    const int columns = 20;
+    const int rows = 250;
+    const auto request = [](int column, int row, int ver)
+    {
+        return "tile part=0 width=256 height=256 tileposx=" + std::to_string(column * 3840) +
+               " tileposy=" + std::to_string(row * 3840) +
+               " tilewidth=3840 tileheight=3840 ver=" + std::to_string(ver);
+    };
+
+    // Request all the tiles, then half of them again, as when scrolling
+    // back and forth.
+    const auto start = std::chrono::steady_clock::now();
+    for (int row = 0; row < rows; ++row)
+    {
+        for (int column = 0; column < columns; ++column)
+            queue.put(request(column, row, 1));
+    }
+
+    for (int row = 0; row < rows; row += 2)
+    {
+        for (int column = 0; column < columns; ++column)
+            queue.put(request(column, row, 2));
+    }
+
+    const auto putTime = std::chrono::steady_clock::now() - start;
+    CPPUNIT_ASSERT_EQUAL(columns * rows, static_cast<int>(queue.getQueueSize()));
+
+    // Every tile comes out once, starting with the ones at the cursor of
+    // the view edited last.
+    std::set<std::pair<int, int>> positions;
+    int messages = 0;
+    while (queue.getQueueSize() > 0)
+    {
+        const std::string message = payloadAsString(queue.get());
+        std::vector<TileDesc> tiles;
+        if (LOOLProtocol::matchPrefix("tilecombine", message))
+            tiles = TileCombined::parse(message).getTiles();
+        else
+            tiles.push_back(TileDesc::parse(message));
+
+        for (const auto& tile : tiles)
+            CPPUNIT_ASSERT(positions.emplace(tile.getTilePosX(), tile.getTilePosY()).second);
+
+        if (messages++ == 0)
+            CPPUNIT_ASSERT(positions.find(std::make_pair(38400, 76800)) != positions.end());
+    }
+
+    const auto totalTime = std::chrono::steady_clock::now() - start;
+    CPPUNIT_ASSERT_EQUAL(columns * rows, static_cast<int>(positions.size()));
+
+    if (isBenchmark())
+        std::cerr << "Queued " << columns * rows * 3 / 2 << " tile requests in "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(putTime).count()
+                  << " us, and got them in " << messages << " messages in "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(totalTime - putTime).count()
+                  << " us" << std::endl;
+}
+
+void TileQueueTests::testCallbackBenchmark()
+{
+    const int threads = 4;
+    // Enough to race the producers with the consumer; many more when timing.
+    const int callbacksPerThread = isBenchmark() ? 50000 : 5000;
+
+    // Fire callbacks from several threads, as the core does while editing,
+    // either as strings under the lock of the queue, or as records through
+    // its ring, and take them from another thread meanwhile.
+    const auto run = [callbacksPerThread](bool typed, TileQueue& queue, std::vector<std::vector<int>>& selections)
+    {
+        std::atomic<bool> done(false);
+        int received = 0;
+        std::thread consumer([&]()
+        {
+            for (;;)
+            {
+                TileQueue::Callback callback;
+                const TileQueue::Payload payload = queue.get(10, callback);
+                if (!callback.isValid() && payload.empty())
+                {
+                    if (done)
+                        break;
+                    continue;
+                }
+
+                ++received;
+                if (callback._type == LOK_CALLBACK_TEXT_SELECTION)
+                    selections[callback._viewId].push_back(std::stoi(callback._payload));
+            }
+        });
+
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> producers;
+        for (int view = 0; view < threads; ++view)
+        {
+            producers.emplace_back([&queue, typed, view, callbacksPerThread]()
+            {
+                for (int i = 0; i < callbacksPerThread; ++i)
+                {
+                    TileQueue::Callback callback;
+                    switch (i % 4)
+                    {
+                        case 0:
+                            callback = TileQueue::Callback(TileQueue::Callback::Target::All, -1, LOK_CALLBACK_INVALIDATE_TILES,
+                                                           std::to_string(i % 7 * 1000) + ", 1418, 2000, 275, 0");
+                            break;
+                        case 1:
+                            callback = TileQueue::Callback(TileQueue::Callback::Target::View, view, LOK_CALLBACK_STATE_CHANGED,
+                                                           i % 8 == 1 ? ".uno:Bold=true" : ".uno:Bold=false");
+                            break;
+                        case 2:
+                            callback = TileQueue::Callback(TileQueue::Callback::Target::View, view, LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR,
+                                                           std::to_string(i) + ", 1418, 0, 275");
+                            break;
+                        default:
+                            callback = TileQueue::Callback(TileQueue::Callback::Target::View, view, LOK_CALLBACK_TEXT_SELECTION,
+                                                           std::to_string(i));
+                            break;
+                    }
+
+                    if (typed)
+                        queue.putCallback(std::move(callback));
+                    else
+                        queue.put(callback.serialize());
+                }
+            });
+        }
+
+        for (auto& producer : producers)
+            producer.join();
+
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        done = true;
+        consumer.join();
+
+        if (isBenchmark())
+            std::cerr << (typed ? "Ring: " : "Locked: ")
+                      << threads * callbacksPerThread * 1000. /
+                             std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(), 1)
+                      << " callbacks/ms put, " << received << " taken, " << queue.getCallbackStats() << std::endl;
+        return received;
+    };
+
+    for (const bool typed : { false, true })
+    {
+        TileQueue queue;
+        std::vector<std::vector<int>> selections(threads);
+        const int received = run(typed, queue, selections);
+
+        // Nothing is lost: every callback is taken, or merged into a later one.
+        CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue.getQueueSize()));
+        if (typed)
+        {
+            CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(threads * callbacksPerThread), queue._callbacksPut.load());
+            CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(threads * callbacksPerThread),
+                                 received + queue._callbacksCoalesced.load());
+        }
+
+        // The selections are never merged, and come in the order of each view.
+        for (const auto& selection : selections)
+        {
+            CPPUNIT_ASSERT_EQUAL(callbacksPerThread / 4, static_cast<int>(selection.size()));
+            for (size_t i = 1; i < selection.size(); ++i)
+                CPPUNIT_ASSERT(selection[i - 1] < selection[i]);
+        }
+    }
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(TileQueueTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
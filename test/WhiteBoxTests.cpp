@@ -9,19 +9,31 @@
 
 #include <config.h>
 
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
 #include <cppunit/extensions/HelperMacros.h>
 
 #include <Auth.hpp>
 #include <ChildSession.hpp>
 #include <Common.hpp>
 #include <Kit.hpp>
+#include <Message.hpp>
 #include <MessageQueue.hpp>
+#include <Png.hpp>
 #include <Protocol.hpp>
+#include <Rectangle.hpp>
 #include <TileDesc.hpp>
+#include <TilePack.hpp>
 #include <Util.hpp>
 #include <JsonUtil.hpp>
 
 #include <common/Authorization.hpp>
+#include <common/FileUtil.hpp>
+#include <test.hpp>
 
 /// WhiteBox unit-tests.
 class WhiteBoxTests : public CPPUNIT_NS::TestFixture
@@ -37,9 +49,16 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testRegexListMatcher_Init);
     CPPUNIT_TEST(testEmptyCellCursor);
     CPPUNIT_TEST(testRectanglesIntersect);
+    CPPUNIT_TEST(testRegion);
     CPPUNIT_TEST(testAuthorization);
     CPPUNIT_TEST(testJson);
     CPPUNIT_TEST(testAnonymization);
+    CPPUNIT_TEST(testUnpremultiply);
+    CPPUNIT_TEST(testTileCodecs);
+    CPPUNIT_TEST(testSolidTiles);
+    CPPUNIT_TEST(testWatermarkBlend);
+    CPPUNIT_TEST(testTilePack);
+    CPPUNIT_TEST(testSharedPayload);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -52,9 +71,16 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     void testRegexListMatcher_Init();
     void testEmptyCellCursor();
     void testRectanglesIntersect();
+    void testRegion();
     void testAuthorization();
     void testJson();
     void testAnonymization();
+    void testUnpremultiply();
+    void testTileCodecs();
+    void testSolidTiles();
+    void testWatermarkBlend();
+    void testTilePack();
+    void testSharedPayload();
 };
 
 void WhiteBoxTests::testLOOLProtocolFunctions()
@@ -596,6 +622,79 @@ void WhiteBoxTests::testRectanglesIntersect()
                                                   1000, 1000, 2000, 1000));
 }
 
+void WhiteBoxTests::testRegion()
+{
+    Util::Region region;
+    CPPUNIT_ASSERT(region.empty());
+
+    // Overlapping, the second adds only what isn't covered.
+    region.add(Util::Rectangle(0, 0, 1000, 1000));
+    region.add(Util::Rectangle(500, 0, 1000, 1000));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), region.getRectangles().size());
+    CPPUNIT_ASSERT_EQUAL(1500, region.getRectangles()[0].getWidth());
+    CPPUNIT_ASSERT(region.contains(Util::Rectangle(0, 0, 1500, 1000)));
+    CPPUNIT_ASSERT(!region.contains(Util::Rectangle(0, 0, 1500, 1001)));
+
+    // Covered already.
+    region.add(Util::Rectangle(100, 100, 100, 100));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), region.getRectangles().size());
+
+    // Disjoint, and sharing only a corner.
+    region.add(Util::Rectangle(1500, 1000, 500, 500));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), region.getRectangles().size());
+    CPPUNIT_ASSERT(!region.intersects(Util::Rectangle(1500, 0, 500, 1000)));
+    CPPUNIT_ASSERT(region.intersects(Util::Rectangle(1400, 900, 200, 200)));
+
+    // Covering everything.
+    region.add(Util::Rectangle(0, 0, 2000, 1500));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), region.getRectangles().size());
+
+    // A typing storm: the lines of a paragraph, joined into one rectangle.
+    region.clear();
+    for (int line = 0; line < 100; ++line)
+    {
+        region.add(Util::Rectangle(1000, 1000 + line * 200, 8000, 200));
+        region.add(Util::Rectangle(1000 + line * 10, 1000 + line * 200, 300, 200));
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), region.getRectangles().size());
+    CPPUNIT_ASSERT_EQUAL(20000, region.getRectangles()[0].getHeight());
+
+    // Scattered rectangles are kept apart, up to the limit, and always covered.
+    region.clear();
+    std::vector<Util::Rectangle> scattered;
+    for (int i = 0; i < 40; ++i)
+    {
+        scattered.push_back(Util::Rectangle((i * 7919) % 50000, (i * 104729) % 50000, 300, 200));
+        region.add(scattered.back());
+        CPPUNIT_ASSERT(region.getRectangles().size() <= Util::Region::MaxRectangles);
+    }
+
+    for (const Util::Rectangle& rectangle : scattered)
+        CPPUNIT_ASSERT(region.contains(rectangle));
+
+    const std::vector<Util::Rectangle>& rectangles = region.getRectangles();
+    for (size_t i = 0; i < rectangles.size(); ++i)
+    {
+        for (size_t j = i + 1; j < rectangles.size(); ++j)
+            CPPUNIT_ASSERT(!rectangles[i].overlaps(rectangles[j]));
+    }
+
+    // Intersection.
+    region.clear();
+    region.add(Util::Rectangle(0, 0, 1000, 1000));
+    region.add(Util::Rectangle(2000, 0, 1000, 1000));
+    region.intersect(Util::Rectangle(500, 500, 2000, 2000));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), region.getRectangles().size());
+    CPPUNIT_ASSERT(region.contains(Util::Rectangle(500, 500, 500, 500)));
+    CPPUNIT_ASSERT(region.contains(Util::Rectangle(2000, 500, 500, 500)));
+    CPPUNIT_ASSERT(!region.intersects(Util::Rectangle(1000, 0, 1000, 1000)));
+    CPPUNIT_ASSERT(!region.intersects(Util::Rectangle(0, 0, 500, 500)));
+
+    region.intersect(Util::Rectangle(5000, 5000, 10, 10));
+    CPPUNIT_ASSERT(region.empty());
+}
+
 void WhiteBoxTests::testAuthorization()
 {
     Authorization auth1(Authorization::Type::Token, "abc");
@@ -704,6 +803,375 @@ void WhiteBoxTests::testAnonymization()
     CPPUNIT_ASSERT_EQUAL(urlAnonymized3, Util::anonymizeUrl(fileUrl));
 }
 
+void WhiteBoxTests::testUnpremultiply()
+{
+    // Every (color, alpha) combination, including invalid color > alpha ones,
+    // plus a few pixels to exercise the scalar tail of the vector kernels.
+    const int width = 256 * 256 + 7;
+    std::vector<unsigned char> pixmap(width * 4);
+    for (int i = 0; i < width; ++i)
+    {
+        const int alpha = i & 0xff;
+        const int color = (i >> 8) & 0xff;
+        pixmap[i * 4 + 0] = color;
+        pixmap[i * 4 + 1] = (color * 7) & 0xff;
+        pixmap[i * 4 + 2] = 255 - color;
+        pixmap[i * 4 + 3] = alpha;
+    }
+
+    // The original libpng user-transform, using integer division.
+    std::vector<unsigned char> expected(pixmap);
+    for (size_t i = 0; i < expected.size(); i += 4)
+    {
+        uint8_t* b = &expected[i];
+        uint32_t pixel;
+        std::memcpy(&pixel, b, sizeof(uint32_t));
+        const uint8_t alpha = (pixel & 0xff000000) >> 24;
+        if (alpha == 0)
+        {
+            b[0] = b[1] = b[2] = b[3] = 0;
+        }
+        else
+        {
+            b[0] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
+            b[1] = (((pixel & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
+            b[2] = (((pixel & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
+            b[3] = alpha;
+        }
+    }
+
+    std::vector<Png::UnpremultiplyRowFn> kernels = { Png::unpremultiplyRowScalar, Png::unpremultiplyRow };
+#ifdef HAVE_SIMD_UNPREMULTIPLY
+    if (__builtin_cpu_supports("sse4.1"))
+        kernels.push_back(Png::unpremultiplyRowSSE41);
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back(Png::unpremultiplyRowAVX2);
+#endif
+
+    for (const auto& kernel : kernels)
+    {
+        // Vary the start to exercise the unaligned heads and tails.
+        for (int offset = 0; offset < 9; ++offset)
+        {
+            std::vector<unsigned char> output((width - offset) * 4);
+            kernel(pixmap.data() + offset * 4, output.data(), width - offset);
+            CPPUNIT_ASSERT(std::equal(output.begin(), output.end(), expected.begin() + offset * 4));
+        }
+    }
+}
+
+void WhiteBoxTests::testTileCodecs()
+{
+    // The codec is negotiated per-tile and must survive the round-trip.
+    TileDesc tile = TileDesc::parse("tile part=0 width=256 height=256 tileposx=0 tileposy=0 "
+                                    "tilewidth=3840 tileheight=3840 codec=fastpng");
+    CPPUNIT_ASSERT_EQUAL(std::string("fastpng"), tile.getCodec());
+    CPPUNIT_ASSERT(TileDesc::parse(tile.serialize("tile")).getCodec() == "fastpng");
+    CPPUNIT_ASSERT(TileDesc::parse("tile part=0 width=256 height=256 tileposx=0 tileposy=0 "
+                                   "tilewidth=3840 tileheight=3840").getCodec().empty());
+
+    TileCombined combined = TileCombined::parse("tilecombine part=0 width=256 height=256 "
+                                                "tileposx=0,3840 tileposy=0,0 "
+                                                "tilewidth=3840 tileheight=3840 codec=fastpng");
+    CPPUNIT_ASSERT_EQUAL(std::string("fastpng"), combined.getCodec());
+    CPPUNIT_ASSERT_EQUAL(std::string("fastpng"), combined.getTiles()[1].getCodec());
+
+    CPPUNIT_ASSERT(Png::codecFromString("fastpng") == Png::Codec::FastPng);
+    CPPUNIT_ASSERT(Png::codecFromString("") == Png::Codec::Png);
+    CPPUNIT_ASSERT(Png::codecFromString("bogus") == Png::Codec::Png);
+
+    // Compare the backends on a real tile: all must decode to the same pixels.
+    std::ifstream file(TDOC "/delta-text.png");
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+
+    png_uint_32 height, width, rowBytes;
+    std::vector<png_bytep> rows = Png::decodePNG(buffer, height, width, rowBytes);
+    std::vector<unsigned char> pixmap;
+    for (png_uint_32 y = 0; y < height; ++y)
+        pixmap.insert(pixmap.end(), rows[y], rows[y] + rowBytes);
+
+    // Encode each once, or time them over a few runs when benchmarking.
+    const int iterations = isBenchmark() ? 20 : 1;
+    for (const Png::Codec codec : { Png::Codec::Png, Png::Codec::FastPng })
+    {
+        std::vector<char> output;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+        {
+            output.clear();
+            CPPUNIT_ASSERT(Png::encodeBufferToPNG(pixmap.data(), width, height, output,
+                                                  LOK_TILEMODE_RGBA, codec));
+        }
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+        if (isBenchmark())
+            std::cerr << "Codec " << Png::codecToString(codec) << ": " << output.size()
+                      << " bytes, " << elapsed / iterations << " us per tile" << std::endl;
+
+        std::stringstream encoded(std::string(output.data(), output.size()));
+        png_uint_32 decodedHeight, decodedWidth, decodedRowBytes;
+        std::vector<png_bytep> decoded = Png::decodePNG(encoded, decodedHeight, decodedWidth, decodedRowBytes);
+        CPPUNIT_ASSERT_EQUAL(width, decodedWidth);
+        CPPUNIT_ASSERT_EQUAL(height, decodedHeight);
+        for (png_uint_32 y = 0; y < height; ++y)
+            CPPUNIT_ASSERT(std::equal(decoded[y], decoded[y] + rowBytes, rows[y]));
+    }
+}
+
+void WhiteBoxTests::testSolidTiles()
+{
+    TileDesc tile = TileDesc::parse("tile: part=0 width=256 height=256 tileposx=0 tileposy=0 "
+                                    "tilewidth=3840 tileheight=3840 wid=5 solid=ffffffff");
+    CPPUNIT_ASSERT_EQUAL(std::string("ffffffff"), tile.getSolid());
+    CPPUNIT_ASSERT_EQUAL(std::string("ffffffff"), TileDesc::parse(tile.serialize("tile:")).getSolid());
+
+    // Only the uniform tiles of a tilecombine carry a colour.
+    TileCombined combined = TileCombined::parse("tilecombine: part=0 width=256 height=256 "
+                                                "tileposx=0,3840,7680 tileposy=0,0,0 "
+                                                "tilewidth=3840 tileheight=3840 "
+                                                "solid=-,ff000080,-");
+    CPPUNIT_ASSERT(combined.getTiles()[0].getSolid().empty());
+    CPPUNIT_ASSERT_EQUAL(std::string("ff000080"), combined.getTiles()[1].getSolid());
+    CPPUNIT_ASSERT(combined.getTiles()[2].getSolid().empty());
+
+    const std::string serialized = combined.serialize("tilecombine:");
+    CPPUNIT_ASSERT(serialized.find(" solid=-,ff000080,-") != std::string::npos);
+    combined.getTiles()[1].setSolid(std::string());
+    CPPUNIT_ASSERT(combined.serialize("tilecombine:").find("solid=") == std::string::npos);
+
+    // Two tiles side-by-side in one buffer, the second with a single odd pixel.
+    const int width = 37;
+    const int height = 19;
+    std::vector<uint32_t> pixmap(width * 2 * height, 0x80800000); // Premultiplied, half-transparent red.
+    pixmap[(height - 1) * width * 2 + width * 2 - 1] = 0x80800001;
+
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(pixmap.data());
+    std::string color;
+    CPPUNIT_ASSERT(Png::isSolidSubBuffer(data, 0, 0, width, height, width * 2, LOK_TILEMODE_BGRA, color));
+    CPPUNIT_ASSERT_EQUAL(std::string("ff000080"), color);
+    CPPUNIT_ASSERT(!Png::isSolidSubBuffer(data, width, 0, width, height, width * 2, LOK_TILEMODE_BGRA, color));
+    CPPUNIT_ASSERT(Png::isSolidSubBuffer(data, width, 0, width - 1, height, width * 2, LOK_TILEMODE_RGBA, color));
+    CPPUNIT_ASSERT_EQUAL(std::string("00008080"), color);
+}
+
+namespace
+{
+    /// The floating point blending that the watermark used to do.
+    void alphaBlendRowReference(const unsigned char* from, unsigned char* to, int width)
+    {
+        for (int i = 0; i < width; ++i)
+        {
+            const unsigned char* f = from + i * 4;
+            unsigned char* t = to + i * 4;
+            const double srcAlpha = f[3] / 255.0;
+            const double outAlpha = srcAlpha + t[3] / 255.0 * (1.0 - srcAlpha);
+            for (int c = 0; c < 3; ++c)
+                t[c] = f[c] + t[c] * (1.0 - srcAlpha);
+            t[3] = static_cast<unsigned char>(outAlpha * 255.0);
+        }
+    }
+}
+
+void WhiteBoxTests::testWatermarkBlend()
+{
+    // Random premultiplied pixels, over all the widths around a SIMD block.
+    std::srand(42);
+    for (int width = 1; width < 40; ++width)
+    {
+        std::vector<unsigned char> from(width * 4);
+        std::vector<unsigned char> to(width * 4);
+        for (int i = 0; i < width; ++i)
+        {
+            from[i * 4 + 3] = (i % 5 == 0 ? 0 : std::rand() % 256);
+            to[i * 4 + 3] = std::rand() % 256;
+            for (int c = 0; c < 3; ++c)
+            {
+                from[i * 4 + c] = from[i * 4 + 3] ? std::rand() % (from[i * 4 + 3] + 1) : 0;
+                to[i * 4 + c] = std::rand() % (to[i * 4 + 3] + 1);
+            }
+        }
+
+        std::vector<unsigned char> expected = to;
+        alphaBlendRowReference(from.data(), expected.data(), width);
+        Png::alphaBlendRow(from.data(), to.data(), width);
+        for (int i = 0; i < width * 4; ++i)
+            CPPUNIT_ASSERT(std::abs(expected[i] - to[i]) <= 1);
+    }
+
+    // A watermark-like overlay on a real tile: a band of text in the middle.
+    std::ifstream file(TDOC "/delta-text.png");
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+
+    png_uint_32 height, width, rowBytes;
+    std::vector<png_bytep> rows = Png::decodePNG(buffer, height, width, rowBytes);
+    std::vector<unsigned char> tile;
+    for (png_uint_32 y = 0; y < height; ++y)
+        tile.insert(tile.end(), rows[y], rows[y] + rowBytes);
+
+    std::vector<unsigned char> watermark(tile.size(), 0);
+    for (png_uint_32 y = height / 3; y < height * 2 / 3; ++y)
+    {
+        for (png_uint_32 x = 0; x < width; ++x)
+        {
+            unsigned char* p = &watermark[(y * width + x) * 4];
+            p[3] = (x * 7 + y * 3) % 51; // 20% opaque at most.
+            p[0] = p[1] = p[2] = p[3];
+        }
+    }
+
+    std::vector<unsigned char> blended = tile;
+    std::vector<unsigned char> expected = tile;
+    for (png_uint_32 y = 0; y < height; ++y)
+    {
+        Png::alphaBlendRow(&watermark[y * rowBytes], &blended[y * rowBytes], width);
+        alphaBlendRowReference(&watermark[y * rowBytes], &expected[y * rowBytes], width);
+    }
+    for (size_t i = 0; i < tile.size(); ++i)
+        CPPUNIT_ASSERT(std::abs(expected[i] - blended[i]) <= 1);
+
+    if (!isBenchmark())
+        return;
+
+    // The cost of the watermark, compared to the rest of the work on a tile.
+    const int iterations = 20;
+    std::chrono::steady_clock::duration referenceTime(0);
+    std::chrono::steady_clock::duration blendTime(0);
+    std::chrono::steady_clock::duration encodeTime(0);
+    for (int i = 0; i < iterations; ++i)
+    {
+        blended = tile;
+        auto start = std::chrono::steady_clock::now();
+        for (png_uint_32 y = 0; y < height; ++y)
+            alphaBlendRowReference(&watermark[y * rowBytes], &blended[y * rowBytes], width);
+        referenceTime += std::chrono::steady_clock::now() - start;
+
+        blended = tile;
+        start = std::chrono::steady_clock::now();
+        for (png_uint_32 y = 0; y < height; ++y)
+            Png::alphaBlendRow(&watermark[y * rowBytes], &blended[y * rowBytes], width);
+        blendTime += std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        Png::TileHashes hashes;
+        Png::hashSubBufferRows(tile.data(), 0, 0, width, height, width, height, hashes);
+        std::vector<char> output;
+        CPPUNIT_ASSERT(Png::encodeBufferToPNG(tile.data(), width, height, output, LOK_TILEMODE_RGBA));
+        encodeTime += std::chrono::steady_clock::now() - start;
+    }
+
+    const auto toUs = [](std::chrono::steady_clock::duration duration)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / iterations;
+    };
+    std::cerr << "Watermark blend: " << toUs(blendTime) << " us per tile (was "
+              << toUs(referenceTime) << " us), hash and encode without watermark: "
+              << toUs(encodeTime) << " us" << std::endl;
+}
+
+void WhiteBoxTests::testTilePack()
+{
+    const std::string tmpDir = Util::createRandomTmpDir();
+    const std::string dir = tmpDir + "/tiles";
+    TilePack::initialize(dir, 3500);
+
+    const std::string uri = "file:///tmp/pack.odt";
+    const Poco::Timestamp modified = Poco::Timestamp::fromEpochTime(1000);
+    const TileCacheKey key(0, 256, 256, 3840, 3840, 0, 3840);
+    const TileCache::Tile tile = std::make_shared<std::vector<char>>(1000, 't');
+    const TileCache::Tile newer = std::make_shared<std::vector<char>>(1000, 'n');
+    std::vector<char> data;
+    bool solid = true;
+
+    std::unique_ptr<TilePack> pack = TilePack::open(uri, modified, "");
+    CPPUNIT_ASSERT(pack);
+    CPPUNIT_ASSERT(!TilePack::open(uri, modified, ""));
+    CPPUNIT_ASSERT(!pack->read(key, data, solid));
+    pack->append(key, tile);
+    CPPUNIT_ASSERT(pack->read(key, data, solid));
+    CPPUNIT_ASSERT(data == *tile);
+
+    // Opened again, the last tile of a key wins.
+    pack.reset();
+    pack = TilePack::open(uri, modified, "");
+    CPPUNIT_ASSERT(pack);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), pack->getKeys().size());
+    CPPUNIT_ASSERT(pack->read(key, data, solid));
+    CPPUNIT_ASSERT(data == *tile);
+    CPPUNIT_ASSERT(!solid);
+    pack->append(key, newer);
+    CPPUNIT_ASSERT(pack->read(key, data, solid));
+    CPPUNIT_ASSERT(data == *newer);
+
+    // Uniform tiles are their colour, and known as such once opened again.
+    const TileCacheKey solidKey(0, 256, 256, 3840, 3840, 7680, 3840);
+    const TileCache::Tile color = std::make_shared<std::vector<char>>(4, 'c');
+    pack->append(solidKey, color, true);
+    pack.reset();
+
+    pack = TilePack::open(uri, modified, "");
+    CPPUNIT_ASSERT(pack->read(key, data, solid));
+    CPPUNIT_ASSERT(data == *newer);
+    CPPUNIT_ASSERT(!solid);
+    CPPUNIT_ASSERT(pack->read(solidKey, data, solid));
+    CPPUNIT_ASSERT(data == *color);
+    CPPUNIT_ASSERT(solid);
+
+    // Read-only once the document is modified.
+    pack->setReadOnly();
+    pack->append(TileCacheKey(0, 256, 256, 3840, 3840, 3840, 3840), tile);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), pack->getKeys().size());
+    pack.reset();
+
+    // Other versions, or watermarks, have their own packs.
+    pack = TilePack::open(uri, Poco::Timestamp::fromEpochTime(2000), "");
+    CPPUNIT_ASSERT(pack->getKeys().empty());
+    pack->append(key, tile);
+    pack.reset();
+
+    pack = TilePack::open(uri, modified, "watermark");
+    CPPUNIT_ASSERT(pack->getKeys().empty());
+    pack->append(key, tile);
+
+    // Over the size: the least recently used pack goes when this one closes.
+    pack.reset();
+    pack = TilePack::open(uri, modified, "");
+    CPPUNIT_ASSERT(pack->getKeys().empty());
+    pack.reset();
+    pack = TilePack::open(uri, Poco::Timestamp::fromEpochTime(2000), "");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), pack->getKeys().size());
+    pack.reset();
+
+    // Nothing without a version.
+    CPPUNIT_ASSERT(!TilePack::open(uri, Poco::Timestamp::fromEpochTime(0), ""));
+
+    TilePack::initialize(std::string(), 0);
+    FileUtil::removeFile(dir, true);
+    ::rmdir(tmpDir.c_str());
+}
+
+void WhiteBoxTests::testSharedPayload()
+{
+    auto tile = std::make_shared<std::vector<char>>(1000, 'p');
+    const std::string header = "tile: part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840";
+
+    // Each message has its own header, but not its own copy of the tile.
+    Message first(header + '\n', tile, Message::Dir::Out);
+    Message cached(header + " renderid=cached\n", tile, Message::Dir::Out);
+    CPPUNIT_ASSERT(first.isBinary());
+    CPPUNIT_ASSERT_EQUAL(header, first.firstLine());
+    CPPUNIT_ASSERT_EQUAL(header + " renderid=cached", cached.firstLine());
+    CPPUNIT_ASSERT_EQUAL(header.size() + 1, first.size());
+    CPPUNIT_ASSERT(first.payload().get() == tile.get());
+    CPPUNIT_ASSERT(cached.payload().get() == tile.get());
+    CPPUNIT_ASSERT_EQUAL(3L, tile.use_count());
+
+    Message text("status: ok", Message::Dir::Out);
+    CPPUNIT_ASSERT(!text.payload());
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(WhiteBoxTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
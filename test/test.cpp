@@ -79,6 +79,12 @@ bool isStandalone()
     return IsStandalone;
 }
 
+bool isBenchmark()
+{
+    static const bool benchmark = std::getenv("LOOL_TEST_BENCHMARK") != nullptr;
+    return benchmark;
+}
+
 // returns true on success
 bool runClientTests(bool standalone, bool verbose)
 {
@@ -116,7 +122,7 @@ bool runClientTests(bool standalone, bool verbose)
         }
     }
 
-    if (!verbose)
+    if (!verbose && !isBenchmark())
     {
         // redirect std::cerr temporarily
         std::stringstream errorBuffer;
@@ -15,6 +15,9 @@
 /// Are we running inside WSD or by ourselves.
 bool isStandalone();
 
+/// Do we run the timing loops of the tests, and print their results.
+bool isBenchmark();
+
 /// Run the set of client tests we have
 bool runClientTests(bool standalone, bool verbose);
 
@@ -157,6 +157,9 @@ void AdminSocketHandler::handleMessage(bool /* fin */, WSOpCode /* code */,
     else if (tokens[0] == "recv_bytes")
         sendTextFrame("recv_bytes " + std::to_string(model.getRecvBytesTotal() / 1024));
 
+    else if (tokens[0] == "tile_cache_stats")
+        sendTextFrame("tile_cache_stats " + TileCache::getBlobStats());
+
     else if (tokens[0] == "kill" && tokens.count() == 2)
     {
         try
@@ -569,6 +572,17 @@ void Admin::addBytes(const std::string& docKey, uint64_t sent, uint64_t recv)
     addCallback([=] { _model.addBytes(docKey, sent, recv); });
 }
 
+void Admin::updateTileCacheStats(const std::string& docKey, size_t bytes, uint64_t hits, uint64_t lookups)
+{
+    addCallback([=] { _model.updateTileCacheStats(docKey, bytes, hits, lookups); });
+}
+
+void Admin::updateTileDeltaStats(const std::string& docKey, uint64_t hits, uint64_t misses,
+                                 uint64_t deltaWins, uint64_t pngWins)
+{
+    addCallback([=] { _model.updateTileDeltaStats(docKey, hits, misses, deltaWins, pngWins); });
+}
+
 void Admin::notifyForkit()
 {
     std::ostringstream oss;
@@ -600,6 +614,14 @@ void Admin::triggerMemoryCleanup(const size_t totalMem)
     const double memToFreePercentage = (totalMem / static_cast<double>(_totalSysMemKb)) - memLimit / 100.;
     int memToFreeKb = static_cast<int>(memToFreePercentage > 0.0 ? memToFreePercentage * _totalSysMemKb : 0);
     // Don't kill documents to save a KB or two.
+    if (memToFreeKb > 1024)
+    {
+        // The tiles are cheap to render again, drop them before the documents.
+        const size_t tilesFreedKb = TileCache::shrinkAll(static_cast<size_t>(memToFreeKb) * 1024) / 1024;
+        LOG_DBG("OOM: Dropped " << tilesFreedKb << " KB of cached tiles.");
+        memToFreeKb -= tilesFreedKb;
+    }
+
     if (memToFreeKb > 1024)
     {
         // prepare document list sorted by most idle times
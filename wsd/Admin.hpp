@@ -109,6 +109,9 @@ public:
     void updateLastActivityTime(const std::string& docKey);
     void updateMemoryDirty(const std::string& docKey, int dirty);
     void addBytes(const std::string& docKey, uint64_t sent, uint64_t recv);
+    void updateTileCacheStats(const std::string& docKey, size_t bytes, uint64_t hits, uint64_t lookups);
+    void updateTileDeltaStats(const std::string& docKey, uint64_t hits, uint64_t misses,
+                              uint64_t deltaWins, uint64_t pngWins);
 
     void dumpState(std::ostream& os) override;
 
@@ -445,6 +445,37 @@ void AdminModel::addBytes(const std::string& docKey, uint64_t sent, uint64_t rec
     _recvBytesTotal += recv;
 }
 
+void AdminModel::updateTileCacheStats(const std::string& docKey, size_t bytes, uint64_t hits, uint64_t lookups)
+{
+    assertCorrectThread();
+
+    auto doc = _documents.find(docKey);
+    if (doc == _documents.end())
+        return;
+
+    const size_t oldKb = doc->second.getTileCacheBytes() / 1024;
+    const unsigned oldHitRate = doc->second.getTileCacheHitRate();
+    doc->second.setTileCacheStats(bytes, hits, lookups);
+
+    const size_t kb = doc->second.getTileCacheBytes() / 1024;
+    const unsigned hitRate = doc->second.getTileCacheHitRate();
+    if (kb != oldKb || hitRate != oldHitRate)
+    {
+        notify("propchange " + std::to_string(doc->second.getPid()) +
+               " tilecache " + std::to_string(kb) + ' ' + std::to_string(hitRate));
+    }
+}
+
+void AdminModel::updateTileDeltaStats(const std::string& docKey, uint64_t hits, uint64_t misses,
+                                      uint64_t deltaWins, uint64_t pngWins)
+{
+    assertCorrectThread();
+
+    auto doc = _documents.find(docKey);
+    if (doc != _documents.end())
+        doc->second.setTileDeltaStats(hits, misses, deltaWins, pngWins);
+}
+
 void AdminModel::modificationAlert(const std::string& docKey, Poco::Process::PID pid, bool value)
 {
     assertCorrectThread();
@@ -670,6 +701,10 @@ std::string AdminModel::getDocuments() const
                 << "\"fileName\"" << ':' << '"' << encodedFilename << '"' << ','
                 << "\"activeViews\"" << ':' << it.second.getActiveViews() << ','
                 << "\"memory\"" << ':' << it.second.getMemoryDirty() << ','
+                << "\"tileCacheKb\"" << ':' << it.second.getTileCacheBytes() / 1024 << ','
+                << "\"tileCacheHitRate\"" << ':' << it.second.getTileCacheHitRate() << ','
+                << "\"tileDeltaHitRate\"" << ':' << it.second.getTileDeltaHitRate() << ','
+                << "\"tileDeltaWinRate\"" << ':' << it.second.getTileDeltaWinRate() << ','
                 << "\"elapsedTime\"" << ':' << it.second.getElapsedTime() << ','
                 << "\"idleTime\"" << ':' << it.second.getIdleTime() << ','
                 << "\"modified\"" << ':' << '"' << (it.second.getModifiedStatus() ? "Yes" : "No") << '"' << ','
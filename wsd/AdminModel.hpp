@@ -108,6 +108,13 @@ public:
           _end(0),
           _sentBytes(0),
           _recvBytes(0),
+          _tileCacheBytes(0),
+          _tileCacheHits(0),
+          _tileCacheLookups(0),
+          _tileDeltaHits(0),
+          _tileDeltaMisses(0),
+          _tileDeltaWins(0),
+          _tilePngWins(0),
           _isModified(false)
     {
     }
@@ -152,6 +159,43 @@ public:
         _recvBytes += recv;
     }
 
+    void setTileCacheStats(size_t bytes, uint64_t hits, uint64_t lookups)
+    {
+        _tileCacheBytes = bytes;
+        _tileCacheHits = hits;
+        _tileCacheLookups = lookups;
+    }
+
+    size_t getTileCacheBytes() const { return _tileCacheBytes; }
+
+    /// The percentage of the tile lookups found in the cache.
+    unsigned getTileCacheHitRate() const
+    {
+        return _tileCacheLookups ? _tileCacheHits * 100 / _tileCacheLookups : 0;
+    }
+
+    void setTileDeltaStats(uint64_t hits, uint64_t misses, uint64_t deltaWins, uint64_t pngWins)
+    {
+        _tileDeltaHits = hits;
+        _tileDeltaMisses = misses;
+        _tileDeltaWins = deltaWins;
+        _tilePngWins = pngWins;
+    }
+
+    /// The percentage of the deltas requested whose old tile was still known.
+    unsigned getTileDeltaHitRate() const
+    {
+        const uint64_t requests = _tileDeltaHits + _tileDeltaMisses;
+        return requests ? _tileDeltaHits * 100 / requests : 0;
+    }
+
+    /// The percentage of the deltas made that were smaller than the PNG.
+    unsigned getTileDeltaWinRate() const
+    {
+        const uint64_t deltas = _tileDeltaWins + _tilePngWins;
+        return deltas ? _tileDeltaWins * 100 / deltas : 0;
+    }
+
     const DocProcSettings& getDocProcSettings() const { return _docProcSettings; }
     void setDocProcSettings(const DocProcSettings& docProcSettings) { _docProcSettings = docProcSettings; }
 
@@ -179,6 +223,15 @@ private:
     /// Total bytes sent and recv'd by this document.
     uint64_t _sentBytes, _recvBytes;
 
+    /// The memory of the cached tiles, and their lookups.
+    size_t _tileCacheBytes;
+    uint64_t _tileCacheHits, _tileCacheLookups;
+
+    /// The tile deltas of the kit: the old tiles found or not, and how often
+    /// the delta or the PNG was the smaller.
+    uint64_t _tileDeltaHits, _tileDeltaMisses;
+    uint64_t _tileDeltaWins, _tilePngWins;
+
     /// Per-doc kit process settings.
     DocProcSettings _docProcSettings;
     bool _isModified;
@@ -281,6 +334,11 @@ public:
 
     void addBytes(const std::string& docKey, uint64_t sent, uint64_t recv);
 
+    void updateTileCacheStats(const std::string& docKey, size_t bytes, uint64_t hits, uint64_t lookups);
+
+    void updateTileDeltaStats(const std::string& docKey, uint64_t hits, uint64_t misses,
+                              uint64_t deltaWins, uint64_t pngWins);
+
     uint64_t getSentBytesTotal() { return _sentBytesTotal; }
     uint64_t getRecvBytesTotal() { return _recvBytesTotal; }
 
@@ -373,6 +373,15 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         if (tokens[0] == "key")
             _keyEvents++;
 
+        // The tiles rendered from now on may no longer be those of the stored version.
+        if (!isReadOnly() &&
+            (tokens[0] == "key" || tokens[0] == "textinput" || tokens[0] == "windowkey" ||
+             tokens[0] == "mouse" || tokens[0] == "windowmouse" || tokens[0] == "uno" ||
+             tokens[0] == "paste" || tokens[0] == "insertfile" || tokens[0] == "selectgraphic"))
+        {
+            docBroker->tileCache().setEdited();
+        }
+
         if (!filterMessage(firstLine))
         {
             const std::string dummyFrame = "dummymsg";
@@ -639,7 +648,12 @@ void ClientSession::performWrites()
         try
         {
             const std::vector<char>& data = item->data();
-            if (item->isBinary())
+            const auto& payload = item->payload();
+            if (payload)
+            {
+                Session::sendBinaryFrame(data.data(), data.size(), payload->data(), payload->size());
+            }
+            else if (item->isBinary())
             {
                 Session::sendBinaryFrame(data.data(), data.size());
             }
@@ -1289,6 +1303,12 @@ void ClientSession::resetWireIdMap()
     _oldWireIds.clear();
 }
 
+TileWireId ClientSession::getSentWireId(const TileDesc& tile) const
+{
+    const auto iter = _oldWireIds.find(tile.generateID());
+    return iter != _oldWireIds.end() ? iter->second : 0;
+}
+
 void ClientSession::traceTileBySend(const TileDesc& tile, bool deduplicated)
 {
     const std::string tileID = tile.generateID();
@@ -1315,14 +1335,14 @@ void ClientSession::traceTileBySend(const TileDesc& tile, bool deduplicated)
         addTileOnFly(tile);
 }
 
-void ClientSession::traceSubscribeToTile(const std::string& cacheName)
+void ClientSession::traceSubscribeToTile(const TileCacheKey& key)
 {
-    _tilesBeingRendered.insert(cacheName);
+    _tilesBeingRendered.insert(key);
 }
 
-void ClientSession::traceUnSubscribeToTile(const std::string& cacheName)
+void ClientSession::traceUnSubscribeToTile(const TileCacheKey& key)
 {
-    _tilesBeingRendered.erase(cacheName);
+    _tilesBeingRendered.erase(key);
 }
 
 void ClientSession::removeOutdatedTileSubscriptions()
@@ -65,16 +65,21 @@ public:
         return true;
     }
 
-    bool sendTile(const std::string &header, const TileCache::Tile &tile)
+    bool sendTile(const std::string &header, const TileCache::Tile &tile, bool solid = false)
     {
-        // FIXME: performance - optimize away this copy ...
-        std::vector<char> output;
-
-        output.resize(header.size() + tile->size());
-        std::memcpy(output.data(), header.data(), header.size());
-        std::memcpy(output.data() + header.size(), tile->data(), tile->size());
-
-        return sendBinaryFrame(output.data(), output.size());
+        // Uniform tiles go out as their colour in the header, without an image.
+        if (solid)
+        {
+            std::string solidHeader = header;
+            if (!solidHeader.empty() && solidHeader.back() == '\n')
+                solidHeader.pop_back();
+            solidHeader += " solid=" + TileCache::getSolidColor(tile) + '\n';
+            return sendBinaryFrame(solidHeader.data(), solidHeader.size());
+        }
+
+        // The tile is shared with the cache, and copied only to the socket.
+        enqueueSendMessage(std::make_shared<Message>(header, tile, Message::Dir::Out));
+        return true;
     }
 
     bool sendTextFrame(const char* buffer, const int length) override
@@ -131,8 +136,8 @@ public:
     void traceTileBySend(const TileDesc& tile, bool deduplicated = false);
 
     /// Trask tiles what we a subscription to
-    void traceSubscribeToTile(const std::string& tileCacheName);
-    void traceUnSubscribeToTile(const std::string& tileCacheName);
+    void traceSubscribeToTile(const TileCacheKey& key);
+    void traceUnSubscribeToTile(const TileCacheKey& key);
     void removeOutdatedTileSubscriptions();
     void clearTileSubscription();
 
@@ -141,6 +146,9 @@ public:
     /// Clear wireId map anytime when client visible area changes (visible area, zoom, part number)
     void resetWireIdMap();
 
+    /// The wireId of this tile last sent to the client, or 0 if not tracked.
+    TileWireId getSentWireId(const TileDesc& tile) const;
+
     bool isTextDocument() const { return _isTextDocument; }
 private:
 
@@ -227,9 +235,9 @@ private:
     /// TileID's of the sent tiles. Push by sending and pop by tileprocessed message from the client.
     std::list<std::pair<std::string, std::chrono::steady_clock::time_point>> _tilesOnFly;
 
-    /// Names of tiles requested from kit, which this session is subsrcibed to
+    /// Tiles requested from kit, which this session is subsrcibed to
     /// Track only non-thumbnail tiles (getId() == -1)
-    std::unordered_set<std::string> _tilesBeingRendered;
+    std::unordered_set<TileCacheKey, TileCacheKeyHash> _tilesBeingRendered;
 
     /// Requested tiles are stored in this list, before we can send them to the client
     std::deque<TileDesc> _requestedTiles;
@@ -11,9 +11,11 @@
 
 #include "DocumentBroker.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstdlib>
 #include <ctime>
 #include <fstream>
 #include <sstream>
@@ -33,6 +35,7 @@
 #include "SenderQueue.hpp"
 #include "Storage.hpp"
 #include "TileCache.hpp"
+#include "TilePack.hpp"
 #include <common/Log.hpp>
 #include <common/Message.hpp>
 #include <common/Protocol.hpp>
@@ -291,6 +294,11 @@ void DocumentBroker::pollThread()
             LOG_DBG("Doc [" << _docKey << "] added sent: " << sent << " recv: " << recv << " bytes to totals");
             adminSent = sent;
             adminRecv = recv;
+
+            if (_tileCache)
+                Admin::instance().updateTileCacheStats(getDocKey(), _tileCache->getMemorySize(),
+                                                       _tileCache->getHitCount(),
+                                                       _tileCache->getLookupCount());
         }
 #endif
 
@@ -724,6 +732,10 @@ bool DocumentBroker::load(const std::shared_ptr<ClientSession>& session, const s
 
         _tileCache.reset(new TileCache(_storage->getUriString(), _lastFileModifiedTime, dontUseCache));
         _tileCache->setThreadOwner(std::this_thread::get_id());
+
+        // Serve the tiles kept from an earlier opening of this version.
+        _tileCache->setPack(TilePack::open(_storage->getUriString(), _documentLastModifiedTime,
+                                           watermarkText));
     }
 
 #if !MOBILEAPP
@@ -1282,6 +1294,20 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
         {
             handleTileCombinedResponse(payload);
         }
+        else if (command == "tilescancelled:")
+        {
+            // The kit dropped these tiles before rendering them, no view needing them.
+            LOG_CHECK_RET(message->tokens().size() == 2, false);
+            std::set<int> versions;
+            for (const std::string& version : LOOLProtocol::tokenize((*message)[1], ','))
+            {
+                int value = 0;
+                if (LOOLProtocol::stringToInteger(version, value))
+                    versions.insert(value);
+            }
+
+            tileCache().forgetCancelledTiles(versions);
+        }
         else if (command == "errortoall:")
         {
             LOG_CHECK_RET(message->tokens().size() == 3, false);
@@ -1300,6 +1326,111 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
             {
                 Admin::instance().updateMemoryDirty(_docKey, dirty);
             }
+
+            int pngCacheHits;
+            int pngCacheTests;
+            if (message->getTokenInteger("pngcachehits", pngCacheHits) &&
+                message->getTokenInteger("pngcachetests", pngCacheTests) &&
+                pngCacheTests > 0)
+            {
+                LOG_DBG("PNG cache of [" << _docKey << "]: " << pngCacheHits << " hits of " <<
+                        pngCacheTests << " (" << (pngCacheHits * 100. / pngCacheTests) << "% hit rate).");
+            }
+
+            int deltaHits;
+            int deltaMisses;
+            int deltaWins;
+            int pngWins;
+            if (message->getTokenInteger("deltahits", deltaHits) &&
+                message->getTokenInteger("deltamisses", deltaMisses) &&
+                message->getTokenInteger("deltawins", deltaWins) &&
+                message->getTokenInteger("pngwins", pngWins))
+            {
+                Admin::instance().updateTileDeltaStats(_docKey, deltaHits, deltaMisses, deltaWins, pngWins);
+                if (deltaHits + deltaMisses > 0)
+                {
+                    LOG_DBG("Tile delta history of [" << _docKey << "]: " << deltaHits << " hits, " <<
+                            deltaMisses << " misses (" << (deltaHits * 100. / (deltaHits + deltaMisses)) <<
+                            "% hit rate).");
+                }
+            }
+
+            int renderedTiles;
+            int renderMs;
+            if (message->getTokenInteger("renderedtiles", renderedTiles) &&
+                message->getTokenInteger("rendermsec", renderMs) &&
+                renderMs > 0)
+            {
+                LOG_DBG("Tile rendering of [" << _docKey << "]: " << renderedTiles << " tiles in " <<
+                        renderMs << " ms (" << (renderedTiles * 1000. / renderMs) << " tiles/sec).");
+            }
+
+            int callbacks;
+            int coalescedCallbacks;
+            if (message->getTokenInteger("callbacks", callbacks) &&
+                message->getTokenInteger("coalescedcallbacks", coalescedCallbacks) &&
+                callbacks > 0)
+            {
+                LOG_DBG("Callbacks of [" << _docKey << "]: " << callbacks << ", " << coalescedCallbacks <<
+                        " merged into later ones (" << (coalescedCallbacks * 100. / callbacks) << "%).");
+            }
+
+            int invalidations;
+            int invalidationsSent;
+            int invalidatedTiles;
+            int invalidatedTilesSent;
+            if (message->getTokenInteger("invalidations", invalidations) &&
+                message->getTokenInteger("invalidationssent", invalidationsSent) &&
+                message->getTokenInteger("invalidatedtiles", invalidatedTiles) &&
+                message->getTokenInteger("invalidatedtilessent", invalidatedTilesSent) &&
+                invalidations > 0)
+            {
+                LOG_DBG("Invalidations of [" << _docKey << "]: " << invalidations << " sent as " <<
+                        invalidationsSent << " (" << (invalidationsSent * 100. / invalidations) <<
+                        "%), covering " << invalidatedTilesSent << " tiles instead of " <<
+                        invalidatedTiles << ".");
+            }
+
+            int cancelledTiles;
+            int supersededTiles;
+            int invisibleTiles;
+            int otherZoomTiles;
+            if (message->getTokenInteger("cancelledtiles", cancelledTiles) &&
+                message->getTokenInteger("supersededtiles", supersededTiles) &&
+                message->getTokenInteger("invisibletiles", invisibleTiles) &&
+                message->getTokenInteger("otherzoomtiles", otherZoomTiles))
+            {
+                LOG_DBG("Tiles of [" << _docKey << "] not rendered: " << cancelledTiles <<
+                        " cancelled, " << supersededTiles << " superseded, " << invisibleTiles <<
+                        " out of the views, " << otherZoomTiles << " of another zoom; rendered for "
+                        "no one: " << tileCache().getWastedCount() << " of " <<
+                        tileCache().getRenderedCount() << ".");
+            }
+
+            int prerenderedTiles;
+            int prerenderMs;
+            if (message->getTokenInteger("prerenderedtiles", prerenderedTiles) &&
+                message->getTokenInteger("prerendermsec", prerenderMs) &&
+                prerenderedTiles > 0)
+            {
+                const uint64_t cached = tileCache().getPrerenderedCount();
+                const uint64_t served = tileCache().getPrerenderHitCount();
+                LOG_DBG("Prerendered " << prerenderedTiles << " tiles of [" << _docKey << "] in " <<
+                        prerenderMs << " ms, " << served << " of " << cached << " served (" <<
+                        (cached ? served * 100 / cached : 0) << "%).");
+            }
+
+            int renderChunks;
+            int chunkInputs;
+            std::string keyLatencies;
+            if (message->getTokenInteger("renderchunks", renderChunks) &&
+                message->getTokenInteger("chunkinputs", chunkInputs) &&
+                LOOLProtocol::getTokenString(message->tokens(), "keylatencyms", keyLatencies))
+            {
+                LOG_DBG("Input of [" << _docKey << "]: " << chunkInputs << " handled between " <<
+                        renderChunks << " chunks of tiles, key to invalidation latencies (<5, <10, <20, "
+                        "<50, <100, <200, <500, <1000, more ms): " << keyLatencies << ".");
+            }
         }
 #endif
         else
@@ -1314,6 +1445,10 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
 
 void DocumentBroker::invalidateTiles(const std::string& tiles)
 {
+    // Once loaded, the document changes well before it reports being modified.
+    if (_isLoaded)
+        _tileCache->setEdited();
+
     // Remove from cache.
     _tileCache->invalidateTiles(tiles);
 }
@@ -1328,7 +1463,8 @@ void DocumentBroker::handleTileRequest(TileDesc& tile,
     const std::string tileMsg = tile.serialize();
     LOG_TRC("Tile request for " << tileMsg);
 
-    TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
+    bool solid = false;
+    TileCache::Tile cachedTile = _tileCache->lookupTile(tile, &solid);
     if (cachedTile)
     {
 #if ENABLE_DEBUG
@@ -1336,7 +1472,7 @@ void DocumentBroker::handleTileRequest(TileDesc& tile,
 #else
         const std::string response = tile.serialize("tile:") + '\n';
 #endif
-        session->sendTile(response, cachedTile);
+        session->sendTile(response, cachedTile, solid);
         return;
     }
 
@@ -1494,7 +1630,8 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
             }
 
             // Satisfy as many tiles from the cache.
-            TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
+            bool solid = false;
+            TileCache::Tile cachedTile = _tileCache->lookupTile(tile, &solid);
             if (cachedTile)
             {
                 //TODO: Combine the response to reduce latency.
@@ -1503,7 +1640,7 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
 #else
                 const std::string response = tile.serialize("tile:") + "\n";
 #endif
-                session->sendTile(response, cachedTile);
+                session->sendTile(response, cachedTile, solid);
             }
             else
             {
@@ -1562,15 +1699,17 @@ void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
     try
     {
         const size_t length = payload.size();
-        if (firstLine.size() < static_cast<std::string::size_type>(length) - 1)
+        const TileDesc tile = TileDesc::parse(firstLine);
+        // Solid tiles are fully described by their header.
+        if (firstLine.size() < static_cast<std::string::size_type>(length) - 1 || !tile.getSolid().empty())
         {
-            const TileDesc tile = TileDesc::parse(firstLine);
             const char* buffer = payload.data();
             const size_t offset = firstLine.size() + 1;
 
             std::unique_lock<std::mutex> lock(_mutex);
 
-            tileCache().saveTileAndNotify(tile, buffer + offset, length - offset);
+            if (tileCache().saveTileAndNotify(tile, buffer + offset, length - offset))
+                requestFullTile(tile);
         }
         else
         {
@@ -1592,9 +1731,11 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
     try
     {
         const size_t length = payload.size();
-        if (firstLine.size() < static_cast<std::string::size_type>(length) - 1)
+        const TileCombined tileCombined = TileCombined::parse(firstLine);
+        const bool allSolid = std::all_of(tileCombined.getTiles().begin(), tileCombined.getTiles().end(),
+                                          [](const TileDesc& tile) { return !tile.getSolid().empty(); });
+        if (firstLine.size() < static_cast<std::string::size_type>(length) - 1 || allSolid)
         {
-            const TileCombined tileCombined = TileCombined::parse(firstLine);
             const char* buffer = payload.data();
             size_t offset = firstLine.size() + 1;
 
@@ -1602,7 +1743,14 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
 
             for (const auto& tile : tileCombined.getTiles())
             {
-                tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize());
+                if (offset + tile.getImgSize() > length)
+                {
+                    LOG_ERR("Truncated tilecombine response: " << firstLine);
+                    break;
+                }
+
+                if (tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize()))
+                    requestFullTile(tile);
                 offset += tile.getImgSize();
             }
         }
@@ -1618,6 +1766,20 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
     }
 }
 
+void DocumentBroker::requestFullTile(const TileDesc& delta)
+{
+    TileDesc tile(delta);
+    tile.setVersion(++_tileVersion);
+    tile.setOldWireId(0);
+    tile.setWireId(0);
+    tile.setImgSize(0);
+
+    const std::string request = tile.serialize("tile");
+    LOG_DBG("Sending render request for the full tile: " << request);
+    _childProcess->sendTextFrame(request);
+    _debugRenderedTileCount++;
+}
+
 bool DocumentBroker::haveAnotherEditableSession(const std::string& id) const
 {
     assertCorrectThread();
@@ -390,6 +390,10 @@ private:
     /// Removes a session by ID. Returns the new number of sessions.
     size_t removeSessionInternal(const std::string& id);
 
+    /// Renders the tile of the @delta again, in full, for the subscribers
+    /// that had another version of it.
+    void requestFullTile(const TileDesc& delta);
+
     /// Forward a message from child session to its respective client session.
     bool forwardToClient(const std::shared_ptr<Message>& payload);
 
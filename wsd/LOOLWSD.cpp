@@ -35,6 +35,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <clocale>
@@ -121,6 +122,8 @@ using Poco::Net::PartHandler;
 #  include <SslSocket.hpp>
 #endif
 #include "Storage.hpp"
+#include "TileCache.hpp"
+#include "TilePack.hpp"
 #include "TraceFile.hpp"
 #include <Unit.hpp>
 #include <UnitHTTP.hpp>
@@ -793,13 +796,18 @@ void LOOLWSD::initialize(Application& self)
             { "per_document.document_signing_url", VEREIGN_URL },
             { "per_document.idle_timeout_secs", "3600" },
             { "per_document.idlesave_duration_secs", "30" },
+            { "per_document.invalidation_delay_ms", "10" },
             { "per_document.limit_file_size_mb", "0" },
             { "per_document.limit_num_open_files", "0" },
             { "per_document.limit_load_secs", "100" },
             { "per_document.limit_stack_mem_kb", "8000" },
             { "per_document.limit_virt_mem_mb", "0" },
             { "per_document.max_concurrency", "4" },
+            { "per_document.png_cache_size_kb", "256" },
+            { "per_document.prerender_budget_ms", "0" },
             { "per_document.redlining_as_comments", "true" },
+            { "per_document.tile_deltas", "false" },
+            { "per_document.tile_deltas_history_kb", "32768" },
             { "per_view.idle_timeout_secs", "900" },
             { "per_view.out_of_focus_timeout_secs", "60" },
             { "security.capabilities", "true" },
@@ -821,6 +829,10 @@ void LOOLWSD::initialize(Application& self)
             { "storage.wopi.max_file_size", "0" },
             { "storage.wopi[@allow]", "true" },
             { "sys_template_path", "systemplate" },
+            { "tile_cache_disk_size_mb", "1024" },
+            { "tile_cache_path", "" },
+            { "tile_cache_persistent", "true" },
+            { "tile_cache_size_mb", "1024" },
             { "trace.path[@compress]", "true" },
             { "trace.path[@snapshot]", "false" },
             { "trace[@enable]", "false" }
@@ -1037,6 +1049,40 @@ void LOOLWSD::initialize(Application& self)
         LOG_INF("DISABLE_REDLINE set");
     }
 
+    const auto pngCacheKb = getConfigValue<int>(conf, "per_document.png_cache_size_kb", 256);
+    setenv("LOOL_PNG_CACHE_KB", std::to_string(pngCacheKb).c_str(), 1);
+    LOG_INF("LOOL_PNG_CACHE_KB set to " << pngCacheKb << ".");
+
+    const auto invalidationDelayMs = getConfigValue<int>(conf, "per_document.invalidation_delay_ms", 10);
+    setenv("LOOL_INVALIDATION_DELAY_MS", std::to_string(invalidationDelayMs).c_str(), 1);
+    LOG_INF("LOOL_INVALIDATION_DELAY_MS set to " << invalidationDelayMs << ".");
+
+    const auto prerenderBudgetMs = getConfigValue<int>(conf, "per_document.prerender_budget_ms", 0);
+    setenv("LOOL_PRERENDER_BUDGET_MS", std::to_string(prerenderBudgetMs).c_str(), 1);
+    LOG_INF("LOOL_PRERENDER_BUDGET_MS set to " << prerenderBudgetMs << ".");
+
+    const auto tileCacheMb = getConfigValue<int>(conf, "tile_cache_size_mb", 1024);
+    TileCache::setMaxMemorySize(static_cast<size_t>(std::max(tileCacheMb, 0)) * 1024 * 1024);
+    LOG_INF("Tile cache size limited to " << tileCacheMb << " MB.");
+
+    const std::string tileCachePath = getConfigValue<std::string>(conf, "tile_cache_path", "");
+    if (!tileCachePath.empty() && getConfigValue<bool>(conf, "tile_cache_persistent", true))
+    {
+        const auto tileCacheDiskMb = getConfigValue<int>(conf, "tile_cache_disk_size_mb", 1024);
+        TilePack::initialize(tileCachePath, static_cast<size_t>(std::max(tileCacheDiskMb, 0)) * 1024 * 1024);
+        LOG_INF("Keeping tiles in [" << tileCachePath << "], up to " << tileCacheDiskMb << " MB.");
+    }
+
+    if (getConfigValue<bool>(conf, "per_document.tile_deltas", false))
+    {
+        setenv("LOOL_TILE_DELTAS", "1", 1);
+        LOG_INF("LOOL_TILE_DELTAS set");
+
+        const auto historyKb = getConfigValue<int>(conf, "per_document.tile_deltas_history_kb", 32768);
+        setenv("LOOL_TILE_DELTAS_HISTORY_KB", std::to_string(historyKb).c_str(), 1);
+        LOG_INF("LOOL_TILE_DELTAS_HISTORY_KB set to " << historyKb << ".");
+    }
+
     // Otherwise we profile the soft-device at jail creation time.
     setenv("SAL_DISABLE_OPENCL", "true", 1);
 
@@ -22,9 +22,9 @@ void DocumentBroker::assertCorrectThread() const {}
 
 void ClientSession::traceTileBySend(const TileDesc& /*tile*/, bool /*deduplicated = false*/) {}
 
-void ClientSession::traceSubscribeToTile(const std::string& /*tileCacheName*/) {};
+void ClientSession::traceSubscribeToTile(const TileCacheKey& /*key*/) {};
 
-void ClientSession::traceUnSubscribeToTile(const std::string& /*tileCacheName*/) {};
+void ClientSession::traceUnSubscribeToTile(const TileCacheKey& /*key*/) {};
 
 void ClientSession::clearTileSubscription() {};
 
@@ -11,9 +11,12 @@
 
 #include "TileCache.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
+#include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -31,8 +34,10 @@
 #include <Poco/URI.h>
 
 #include "ClientSession.hpp"
+#include "TilePack.hpp"
 #include <Common.hpp>
 #include <Protocol.hpp>
+#include <SpookyV2.h>
 #include <Unit.hpp>
 #include <Util.hpp>
 #include <common/FileUtil.hpp>
@@ -42,11 +47,91 @@ using namespace LOOLProtocol;
 using Poco::StringTokenizer;
 using Poco::Timestamp;
 
+namespace
+{
+    /// All the caches, to evict the least recently used tiles of any of them.
+    std::mutex CachesMutex;
+    std::set<TileCache*> Caches;
+
+    /// The memory used by the tiles of all the caches, and its budget.
+    std::atomic<size_t> TotalBytes(0);
+    std::atomic<size_t> MaxBytes(0);
+
+    /// The size of the tiles of all the caches, were they not shared.
+    std::atomic<size_t> ReferencedBytes(0);
+
+    /// Counts the uses of tiles, to order them from least to most recent.
+    std::atomic<uint64_t> UseCount(0);
+
+    /// The tile payloads by the hash of their content, so that identical
+    /// tiles, eg. blank ones, are stored once whatever their position or
+    /// document. A blob lives as long as some cached tile refers to it.
+    struct Blob
+    {
+        const std::vector<char>* _data;
+        std::weak_ptr<std::vector<char>> _blob;
+    };
+    std::mutex BlobsMutex;
+    std::unordered_multimap<uint64_t, Blob> Blobs;
+
+    void removeBlob(uint64_t hash, const std::vector<char>* data)
+    {
+        std::unique_lock<std::mutex> lock(BlobsMutex);
+        const auto range = Blobs.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second._data == data)
+            {
+                Blobs.erase(it);
+                break;
+            }
+        }
+
+        TotalBytes -= data->size();
+    }
+
+    /// The blob with the given content, shared if it is stored already.
+    TileCache::Tile findOrAddBlob(const char* data, size_t size)
+    {
+        const uint64_t hash = SpookyHash::Hash64(data, size, 1073741789);
+
+        // Released after the lock, as dropping the last reference removes the blob.
+        std::vector<TileCache::Tile> candidates;
+
+        std::unique_lock<std::mutex> lock(BlobsMutex);
+        const auto range = Blobs.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            candidates.push_back(it->second._blob.lock());
+            const TileCache::Tile& blob = candidates.back();
+            if (blob && blob->size() == size && std::memcmp(blob->data(), data, size) == 0)
+                return blob;
+        }
+
+        std::vector<char>* bytes = new std::vector<char>(data, data + size);
+        TileCache::Tile blob(bytes, [hash](std::vector<char>* p)
+                                    {
+                                        removeBlob(hash, p);
+                                        delete p;
+                                    });
+        Blobs.emplace(hash, Blob{ bytes, blob });
+        TotalBytes += size;
+        return blob;
+    }
+}
+
 TileCache::TileCache(const std::string& docURL,
                      const Timestamp& modifiedTime,
                      bool dontCache) :
     _docURL(docURL),
-    _dontCache(dontCache)
+    _dontCache(dontCache),
+    _cacheBytes(0),
+    _lookups(0),
+    _hits(0),
+    _rendered(0),
+    _wasted(0),
+    _prerendered(0),
+    _prerenderHits(0)
 {
 #ifndef BUILDING_TESTS
     LOG_INF("TileCache ctor for uri [" << LOOLWSD::anonymizeUrl(_docURL) <<
@@ -54,10 +139,19 @@ TileCache::TileCache(const std::string& docURL,
             "], dontCache=" << _dontCache);
 #endif
     (void)modifiedTime;
+
+    std::unique_lock<std::mutex> lock(CachesMutex);
+    Caches.insert(this);
 }
 
 TileCache::~TileCache()
 {
+    {
+        std::unique_lock<std::mutex> lock(CachesMutex);
+        Caches.erase(this);
+    }
+    ReferencedBytes -= _cacheBytes;
+
     _owner = std::thread::id();
 #ifndef BUILDING_TESTS
     LOG_INF("~TileCache dtor for uri [" << LOOLWSD::anonymizeUrl(_docURL) << "].");
@@ -66,7 +160,19 @@ TileCache::~TileCache()
 
 void TileCache::clear()
 {
-    _cache.clear();
+    // Closed outside the lock, as it finishes writing the tiles.
+    std::unique_ptr<TilePack> pack;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cache.clear();
+        _tileIndex.clear();
+        _lru.clear();
+        pack = std::move(_pack);
+        ReferencedBytes -= _cacheBytes;
+        _cacheBytes = 0;
+    }
+    pack.reset();
+    _streamCache.clear();
     LOG_INF("Completely cleared tile cache for: " << _docURL);
 }
 
@@ -75,15 +181,15 @@ void TileCache::clear()
 /// rendering latency.
 struct TileCache::TileBeingRendered
 {
-    TileBeingRendered(const std::string& cachedName, const TileDesc& tile)
+    TileBeingRendered(const TileCacheKey& key, const TileDesc& tile)
      : _startTime(std::chrono::steady_clock::now()),
        _tile(tile),
-       _cachedName(cachedName)
+       _key(key)
     {
     }
 
     const TileDesc& getTile() const { return _tile; }
-    const std::string& getCacheName() const { return _cachedName; }
+    const TileCacheKey& getKey() const { return _key; }
     int getVersion() const { return _tile.getVersion(); }
     void setVersion(int version) { _tile.setVersion(version); }
 
@@ -95,16 +201,14 @@ private:
     std::vector<std::weak_ptr<ClientSession>> _subscribers;
     std::chrono::steady_clock::time_point _startTime;
     TileDesc _tile;
-    std::string _cachedName;
+    TileCacheKey _key;
 };
 
 std::shared_ptr<TileCache::TileBeingRendered> TileCache::findTileBeingRendered(const TileDesc& tileDesc)
 {
-    const std::string cachedName = cacheFileName(tileDesc);
-
     assertCorrectThread();
 
-    const auto tile = _tilesBeingRendered.find(cachedName);
+    const auto tile = _tilesBeingRendered.find(TileCacheKey(tileDesc));
     return tile != _tilesBeingRendered.end() ? tile->second : nullptr;
 }
 
@@ -112,21 +216,21 @@ void TileCache::forgetTileBeingRendered(const std::shared_ptr<TileCache::TileBei
 {
     assertCorrectThread();
     assert(tileBeingRendered);
-    assert(_tilesBeingRendered.find(tileBeingRendered->getCacheName()) != _tilesBeingRendered.end());
+    assert(_tilesBeingRendered.find(tileBeingRendered->getKey()) != _tilesBeingRendered.end());
 
     for(auto& subscriber : tileBeingRendered->getSubscribers())
     {
         std::shared_ptr<ClientSession> session = subscriber.lock();
         if(session && tile.getId() == -1)
-            session->traceUnSubscribeToTile(tileBeingRendered->getCacheName());
+            session->traceUnSubscribeToTile(tileBeingRendered->getKey());
     }
 
-    _tilesBeingRendered.erase(tileBeingRendered->getCacheName());
+    _tilesBeingRendered.erase(tileBeingRendered->getKey());
 }
 
-double TileCache::getTileBeingRenderedElapsedTimeMs(const std::string& tileCacheName) const
+double TileCache::getTileBeingRenderedElapsedTimeMs(const TileCacheKey& key) const
 {
-    auto iterator = _tilesBeingRendered.find(tileCacheName);
+    auto iterator = _tilesBeingRendered.find(key);
     if(iterator == _tilesBeingRendered.end())
         return -1.0; // Negativ value means that we did not find tileBeingRendered object
 
@@ -147,13 +251,56 @@ int TileCache::getTileBeingRenderedVersion(const TileDesc& tile)
         return 0;
 }
 
-TileCache::Tile TileCache::lookupTile(const TileDesc& tile)
+TileCache::Tile TileCache::lookupTile(const TileDesc& tile, bool* solid)
 {
+    if (solid)
+        *solid = false;
+
     if (_dontCache)
         return TileCache::Tile();
 
-    const std::string fileName = cacheFileName(tile);
-    TileCache::Tile ret = loadTile(fileName);
+    TileCache::Tile ret;
+    bool inPack = false;
+    const TileCacheKey key(tile);
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        ++_lookups;
+        const auto it = _cache.find(key);
+        if (it != _cache.end())
+        {
+            ++_hits;
+            if (it->second._prerendered)
+            {
+                it->second._prerendered = false;
+                ++_prerenderHits;
+            }
+
+            ret = it->second._tile;
+            if (solid)
+                *solid = it->second._solid;
+            _lru.splice(_lru.begin(), _lru, it->second._lru);
+            it->second._lastUsed = ++UseCount;
+        }
+        else
+            inPack = _pack && _pack->contains(key);
+    }
+
+    // Read outside the lock, which the other documents take to shrink the caches.
+    std::vector<char> data;
+    bool packedSolid = false;
+    if (inPack && _pack->read(key, data, packedSolid))
+    {
+        ret = findOrAddBlob(data.data(), data.size());
+        if (solid)
+            *solid = packedSolid;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            ++_hits;
+            addTileUnlocked(key, ret, false, packedSolid);
+        }
+
+        shrinkToBudget();
+    }
 
     UnitWSD::get().lookupTile(tile.getPart(), tile.getWidth(), tile.getHeight(),
                               tile.getTilePosX(), tile.getTilePosY(),
@@ -162,6 +309,177 @@ TileCache::Tile TileCache::lookupTile(const TileDesc& tile)
     return ret;
 }
 
+TileCache::Tile TileCache::saveTileToCache(const TileCacheKey& key, const char *data, const size_t size,
+                                           bool prerendered, bool solid)
+{
+    if (_dontCache)
+        return TileCache::Tile();
+
+    TileCache::Tile tile = findOrAddBlob(data, size);
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        addTileUnlocked(key, tile, prerendered, solid);
+    }
+
+    // Written by the pack's thread.
+    if (_pack)
+        _pack->append(key, tile, solid);
+
+    shrinkToBudget();
+    return tile;
+}
+
+void TileCache::addTileUnlocked(const TileCacheKey& key, const Tile& tile, bool prerendered, bool solid)
+{
+    auto it = _cache.find(key);
+    if (it != _cache.end())
+    {
+        _cacheBytes -= it->second._tile->size();
+        ReferencedBytes -= it->second._tile->size();
+        it->second._tile = tile;
+        _lru.splice(_lru.begin(), _lru, it->second._lru);
+        it->second._lastUsed = ++UseCount;
+        it->second._prerendered = prerendered;
+        it->second._solid = solid;
+    }
+    else
+    {
+        _lru.push_front(key);
+        _cache.emplace(key, CachedTile{ tile, _lru.begin(), ++UseCount, prerendered, solid });
+        _tileIndex.insert(key);
+    }
+
+    _cacheBytes += tile->size();
+    ReferencedBytes += tile->size();
+}
+
+void TileCache::shrinkToBudget()
+{
+    // Make some room at once, rather than for each new tile.
+    const size_t maxBytes = MaxBytes;
+    if (maxBytes > 0 && TotalBytes > maxBytes)
+        shrinkAll(TotalBytes - maxBytes * 9 / 10);
+}
+
+void TileCache::setPack(std::unique_ptr<TilePack> pack)
+{
+    if (_dontCache || !pack)
+        return;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _pack = std::move(pack);
+    for (const TileCacheKey& key : _pack->getKeys())
+        _tileIndex.insert(key);
+}
+
+size_t TileCache::dropTileUnlocked(const TileCacheKey& key)
+{
+    const auto it = _cache.find(key);
+    if (it == _cache.end())
+        return 0;
+
+    const size_t size = it->second._tile->size();
+    const bool shared = it->second._tile.use_count() > 1;
+    _cacheBytes -= size;
+    ReferencedBytes -= size;
+    _lru.erase(it->second._lru);
+    _cache.erase(it);
+
+    return shared ? 0 : size;
+}
+
+uint64_t TileCache::getLeastRecentUseUnlocked() const
+{
+    return _lru.empty() ? UINT64_MAX : _cache.find(_lru.back())->second._lastUsed;
+}
+
+size_t TileCache::shrinkUnlocked(size_t bytes, uint64_t usedAfter)
+{
+    size_t freed = 0;
+    while (freed < bytes && !_lru.empty() && getLeastRecentUseUnlocked() <= usedAfter)
+    {
+        const TileCacheKey key = _lru.back();
+        freed += dropTileUnlocked(key);
+        if (!_pack || !_pack->contains(key))
+            _tileIndex.erase(key);
+    }
+
+    return freed;
+}
+
+size_t TileCache::shrinkAll(size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(CachesMutex);
+
+    size_t freed = 0;
+    while (freed < bytes)
+    {
+        // The cache with the least recently used tile goes down to the
+        // least recently used tile of the others.
+        TileCache* oldest = nullptr;
+        uint64_t oldestUse = UINT64_MAX;
+        uint64_t nextUse = UINT64_MAX;
+        for (TileCache* cache : Caches)
+        {
+            std::unique_lock<std::mutex> cacheLock(cache->_mutex);
+            const uint64_t use = cache->getLeastRecentUseUnlocked();
+            if (use < oldestUse)
+            {
+                nextUse = oldestUse;
+                oldestUse = use;
+                oldest = cache;
+            }
+            else if (use < nextUse)
+                nextUse = use;
+        }
+
+        if (!oldest)
+            break;
+
+        std::unique_lock<std::mutex> cacheLock(oldest->_mutex);
+        freed += oldest->shrinkUnlocked(bytes - freed, nextUse);
+    }
+
+    LOG_DBG("Dropped " << freed << " bytes of least recently used tiles, " <<
+            TotalBytes << " bytes of tiles left.");
+    return freed;
+}
+
+void TileCache::setMaxMemorySize(size_t bytes)
+{
+    MaxBytes = bytes;
+}
+
+size_t TileCache::getTotalMemorySize()
+{
+    return TotalBytes;
+}
+
+std::string TileCache::getBlobStats()
+{
+    size_t blobs;
+    {
+        std::unique_lock<std::mutex> lock(BlobsMutex);
+        blobs = Blobs.size();
+    }
+
+    const size_t referenced = ReferencedBytes;
+    const size_t stored = TotalBytes;
+    char dedup[32];
+    snprintf(dedup, sizeof(dedup), "%.2f", stored ? static_cast<double>(referenced) / stored : 1.0);
+
+    return "blobs=" + std::to_string(blobs) +
+           " referencedkb=" + std::to_string(referenced / 1024) +
+           " storedkb=" + std::to_string(stored / 1024) +
+           " dedup=" + dedup;
+}
+
+size_t TileCache::getTileCount() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _cache.size();
+}
+
 void TileCache::saveDataToCache(const std::string &fileName, const char *data, const size_t size)
 {
     if (_dontCache)
@@ -169,40 +487,127 @@ void TileCache::saveDataToCache(const std::string &fileName, const char *data, c
 
     TileCache::Tile tile = std::make_shared<std::vector<char>>(size);
     std::memcpy(tile->data(), data, size);
-    _cache[fileName] = tile;
+    _streamCache[fileName] = tile;
+}
+
+namespace
+{
+    /// Parse a 'rrggbbaa' hex colour into its 4 bytes.
+    bool parseSolidColor(const std::string& color, char* rgba)
+    {
+        if (color.size() != 8)
+            return false;
+
+        for (size_t i = 0; i < 4; ++i)
+        {
+            char* end = nullptr;
+            const std::string component = color.substr(i * 2, 2);
+            const unsigned long value = std::strtoul(component.c_str(), &end, 16);
+            if (end == nullptr || *end != '\0')
+                return false;
+
+            rgba[i] = static_cast<char>(value);
+        }
+
+        return true;
+    }
+}
+
+std::string TileCache::getSolidColor(const Tile& tile)
+{
+    assert(tile && tile->size() == 4);
+
+    char hex[9];
+    snprintf(hex, sizeof(hex), "%02x%02x%02x%02x",
+             static_cast<unsigned char>((*tile)[0]), static_cast<unsigned char>((*tile)[1]),
+             static_cast<unsigned char>((*tile)[2]), static_cast<unsigned char>((*tile)[3]));
+    return hex;
 }
 
-void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size)
+bool TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size)
 {
     assertCorrectThread();
 
     std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
+    const bool hasSubscribers = tileBeingRendered && !tileBeingRendered->getSubscribers().empty();
 
-    // Save to disk.
-    const std::string cachedName = (tileBeingRendered ? tileBeingRendered->getCacheName()
-                                               : cacheFileName(tile));
+    // The kit prerenders the tiles next to the views with no version, for
+    // them to be cached before anyone requests them.
+    const bool prerendered = tile.getVersion() < 0;
+    if (prerendered)
+    {
+        ++_prerendered;
+        if (hasSubscribers)
+            ++_prerenderHits;
+    }
+    else
+    {
+        ++_rendered;
+        if (!hasSubscribers)
+            ++_wasted;
+    }
+
+    // Served already if anyone waits for it.
+    const bool keepPrerendered = prerendered && !hasSubscribers;
+
+    const bool isDelta = size > 0 && data[0] == 'D';
+
+    const TileCacheKey key(tile);
 
     // Ignore if we can't save the tile, things will work anyway, but slower.
     // An error indication is supposed to be sent to all users in that case.
-    const auto fileName = cachedName;
-    saveDataToCache(fileName, data, size);
-    LOG_TRC("Saved cache tile: " << fileName);
+    // Deltas only apply on top of the client's previous tile, so don't cache them;
+    // the (now stale) previous version gets invalidated as usual.
+    TileCache::Tile image;
+    if (!tile.getSolid().empty())
+    {
+        char rgba[4];
+        if (parseSolidColor(tile.getSolid(), rgba))
+        {
+            saveTileToCache(key, rgba, sizeof(rgba), keepPrerendered, true);
+            LOG_TRC("Saved solid cache tile: " << key.toString());
+        }
+    }
+    else if (isDelta)
+        LOG_TRC("Not caching delta tile: " << key.toString());
+    else
+    {
+        image = saveTileToCache(key, data, size, keepPrerendered);
+        LOG_TRC("Saved cache tile: " << key.toString());
+    }
 
     // Notify subscribers, if any.
+    bool needsFullTile = false;
     if (tileBeingRendered)
     {
+        // A delta only applies on top of the tile it was made against, the
+        // other subscribers keep waiting for the full tile.
+        std::vector<std::weak_ptr<ClientSession>> waiting;
+        if (isDelta)
+        {
+            std::vector<std::weak_ptr<ClientSession>>& subscribers = tileBeingRendered->getSubscribers();
+            const auto it = std::stable_partition(subscribers.begin(), subscribers.end(),
+                [&tile](const std::weak_ptr<ClientSession>& subscriber)
+                {
+                    std::shared_ptr<ClientSession> session = subscriber.lock();
+                    return session && session->getSentWireId(tile) == tile.getOldWireId();
+                });
+            waiting.assign(it, subscribers.end());
+            subscribers.erase(it, subscribers.end());
+        }
+
         const size_t subscriberCount = tileBeingRendered->getSubscribers().size();
         if (subscriberCount > 0)
         {
             std::string response = tile.serialize("tile:");
             LOG_DBG("Sending tile message to " << subscriberCount << " subscribers: " << response);
 
+            // All the messages share the image, only their headers are their own.
+            if (!image && size > 0)
+                image = std::make_shared<std::vector<char>>(data, data + size);
+
             // Send to first subscriber as-is (without cache marker).
-            auto payload = std::make_shared<Message>(response,
-                                                     Message::Dir::Out,
-                                                     response.size() + 1 + size);
-            payload->append("\n", 1);
-            payload->append(data, size);
+            auto payload = std::make_shared<Message>(response + '\n', image, Message::Dir::Out);
 
             auto& firstSubscriber = tileBeingRendered->getSubscribers()[0];
             std::shared_ptr<ClientSession> firstSession = firstSubscriber.lock();
@@ -215,13 +620,7 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
             {
                 // All others must get served from the cache.
                 response += " renderid=cached\n";
-
-                // Create a new Payload.
-                payload.reset();
-                payload = std::make_shared<Message>(response,
-                                                    Message::Dir::Out,
-                                                    response.size() + size);
-                payload->append(data, size);
+                payload = std::make_shared<Message>(response, image, Message::Dir::Out);
 
                 for (size_t i = 1; i < subscriberCount; ++i)
                 {
@@ -236,11 +635,25 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
         }
         else
         {
-            LOG_DBG("No subscribers for: " << cachedName);
+            LOG_DBG("No subscribers for: " << key.toString());
         }
 
-        // Remove subscriptions.
-        if (tileBeingRendered->getVersion() <= tile.getVersion())
+        if (!waiting.empty())
+        {
+            LOG_DBG("Requesting the full tile for " << waiting.size() << " subscribers: " << key.toString());
+            for (auto& subscriber : tileBeingRendered->getSubscribers())
+            {
+                std::shared_ptr<ClientSession> session = subscriber.lock();
+                if (session && tile.getId() == -1)
+                    session->traceUnSubscribeToTile(key);
+            }
+
+            tileBeingRendered->getSubscribers() = waiting;
+            needsFullTile = true;
+        }
+        // Remove subscriptions, also when a prerendered tile served them: it
+        // was rendered after they were made, so the requested one is no newer.
+        else if (tileBeingRendered->getVersion() <= tile.getVersion() || (prerendered && hasSubscribers))
         {
             LOG_DBG("STATISTICS: tile " << tile.getVersion() << " internal roundtrip " <<
                     tileBeingRendered->getElapsedTimeMs() << " ms.");
@@ -249,8 +662,10 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
     }
     else
     {
-        LOG_DBG("No subscribers for: " << cachedName);
+        LOG_DBG("No subscribers for: " << key.toString());
     }
+
+    return needsFullTile;
 }
 
 bool TileCache::getTextFile(const std::string& fileName, std::string& content)
@@ -285,11 +700,22 @@ void TileCache::saveTextFile(const std::string& text, const std::string& fileNam
 void TileCache::setUnsavedChanges(bool state)
 {
     if (state)
+    {
+        setEdited();
         saveTextFile("1", "unsaved.txt");
+    }
     else
         removeFile("unsaved.txt");
 }
 
+void TileCache::setEdited()
+{
+    // The pack has the tiles of the document as it was loaded.
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_pack)
+        _pack->setReadOnly();
+}
+
 void TileCache::saveRendering(const std::string& name, const std::string& dir, const char *data, std::size_t size)
 {
     // can fonts be invalidated?
@@ -303,6 +729,14 @@ TileCache::Tile TileCache::lookupCachedTile(const std::string& name, const std::
     return loadTile(dir + "/" + name);
 }
 
+namespace
+{
+    int clampToInt(int64_t value)
+    {
+        return static_cast<int>(std::max<int64_t>(INT_MIN, std::min<int64_t>(INT_MAX, value)));
+    }
+}
+
 void TileCache::invalidateTiles(int part, int x, int y, int width, int height)
 {
     LOG_TRC("Removing invalidated tiles: part: " << part <<
@@ -312,17 +746,56 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height)
 
     assertCorrectThread();
 
-    for (auto it = _cache.begin(); it != _cache.end();)
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto it = _tileIndex.begin();
+    if (part != -1)
+        it = _tileIndex.lower_bound(TileCacheKey(part, INT_MIN, INT_MIN, INT_MIN, INT_MIN, INT_MIN, INT_MIN));
+
+    while (it != _tileIndex.end() && (part == -1 || it->_part == part))
+        it = invalidateZoom(it, x, y, width, height);
+}
+
+std::set<TileCacheKey>::iterator TileCache::invalidateZoom(std::set<TileCacheKey>::iterator first,
+                                                           int x, int y, int width, int height)
+{
+    const TileCacheKey zoom = *first;
+
+    // The tiles that touch the area are invalidated too.
+    const int64_t right = static_cast<int64_t>(x) + width;
+    const int64_t bottom = static_cast<int64_t>(y) + height;
+    TileCacheKey key = zoom;
+    key._tilePosY = clampToInt(static_cast<int64_t>(y) - zoom._tileHeight);
+    key._tilePosX = INT_MIN;
+
+    auto it = _tileIndex.lower_bound(key);
+    while (it != _tileIndex.end() && it->sameZoom(zoom) && it->_tilePosY <= bottom)
     {
-        const std::string fileName = it->first;
-        if (intersectsTile(fileName, part, x, y, width, height))
+        // Skip to the first tile of the row that can intersect.
+        key._tilePosY = it->_tilePosY;
+        key._tilePosX = clampToInt(static_cast<int64_t>(x) - zoom._tileWidth);
+        it = _tileIndex.lower_bound(key);
+        while (it != _tileIndex.end() && it->sameZoom(zoom) &&
+               it->_tilePosY == key._tilePosY && it->_tilePosX <= right)
         {
-            LOG_DBG("Removing tile: " << it->first);
-            it = _cache.erase(it);
+            LOG_DBG("Removing tile: " << it->toString());
+            dropTileUnlocked(*it);
+            if (_pack)
+                _pack->remove(*it);
+            it = _tileIndex.erase(it);
         }
-        else
-            ++it;
+
+        // And the rest of the row.
+        if (key._tilePosY == INT_MAX)
+            break;
+
+        ++key._tilePosY;
+        key._tilePosX = INT_MIN;
+        it = _tileIndex.lower_bound(key);
     }
+
+    key._tilePosY = INT_MAX;
+    key._tilePosX = INT_MAX;
+    return _tileIndex.upper_bound(key);
 }
 
 void TileCache::invalidateTiles(const std::string& tiles)
@@ -371,48 +844,23 @@ std::pair<int, Util::Rectangle> TileCache::parseInvalidateMsg(const std::string&
 
 void TileCache::removeFile(const std::string& fileName)
 {
-    auto it = _cache.find(fileName);
-    if (it != _cache.end())
+    auto it = _streamCache.find(fileName);
+    if (it != _streamCache.end())
     {
         LOG_INF("Removed file: " << fileName);
-        _cache.erase(it);
+        _streamCache.erase(it);
     }
 }
 
-std::string TileCache::cacheFileName(const TileDesc& tile)
+std::string TileCacheKey::toString() const
 {
     std::ostringstream oss;
-    oss << tile.getPart() << '_' << tile.getWidth() << 'x' << tile.getHeight() << '.'
-        << tile.getTilePosX() << ',' << tile.getTilePosY() << '.'
-        << tile.getTileWidth() << 'x' << tile.getTileHeight() << ".png";
+    oss << _part << '_' << _width << 'x' << _height << '.'
+        << _tilePosX << ',' << _tilePosY << '.'
+        << _tileWidth << 'x' << _tileHeight << ".png";
     return oss.str();
 }
 
-bool TileCache::parseCacheFileName(const std::string& fileName, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight)
-{
-    return std::sscanf(fileName.c_str(), "%d_%dx%d.%d,%d.%dx%d.png", &part, &width, &height, &tilePosX, &tilePosY, &tileWidth, &tileHeight) == 7;
-}
-
-bool TileCache::intersectsTile(const std::string& fileName, int part, int x, int y, int width, int height)
-{
-    int tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight;
-    if (parseCacheFileName(fileName, tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight))
-    {
-        if (part != -1 && tilePart != part)
-            return false;
-
-        const int left = std::max(x, tilePosX);
-        const int right = std::min(x + width, tilePosX + tileWidth);
-        const int top = std::max(y, tilePosY);
-        const int bottom = std::min(y + height, tilePosY + tileHeight);
-
-        if (left <= right && top <= bottom)
-            return true;
-    }
-
-    return false;
-}
-
 // FIXME: to be further simplified when we centralize tile messages.
 void TileCache::subscribeToTileRendering(const TileDesc& tile, const std::shared_ptr<ClientSession>& subscriber)
 {
@@ -440,7 +888,7 @@ void TileCache::subscribeToTileRendering(const TileDesc& tile, const std::shared
                 tileBeingRendered->getSubscribers().size() << " subscribers already.");
         tileBeingRendered->getSubscribers().push_back(subscriber);
         if(tile.getId() == -1)
-            subscriber->traceSubscribeToTile(tileBeingRendered->getCacheName());
+            subscriber->traceSubscribeToTile(tileBeingRendered->getKey());
 
         const auto duration = (std::chrono::steady_clock::now() - tileBeingRendered->getStartTime());
         if (std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() > COMMAND_TIMEOUT_MS)
@@ -454,15 +902,15 @@ void TileCache::subscribeToTileRendering(const TileDesc& tile, const std::shared
         LOG_DBG("Subscribing " << subscriber->getName() << " to tile " << name <<
                 " ver=" << tile.getVersion() << " which has no subscribers.");
 
-        const std::string cachedName = cacheFileName(tile);
+        const TileCacheKey key(tile);
 
-        assert(_tilesBeingRendered.find(cachedName) == _tilesBeingRendered.end());
+        assert(_tilesBeingRendered.find(key) == _tilesBeingRendered.end());
 
-        tileBeingRendered = std::make_shared<TileBeingRendered>(cachedName, tile);
+        tileBeingRendered = std::make_shared<TileBeingRendered>(key, tile);
         tileBeingRendered->getSubscribers().push_back(subscriber);
         if(tile.getId() == -1)
-            subscriber->traceSubscribeToTile(tileBeingRendered->getCacheName());
-        _tilesBeingRendered[cachedName] = tileBeingRendered;
+            subscriber->traceSubscribeToTile(key);
+        _tilesBeingRendered[key] = tileBeingRendered;
     }
 }
 
@@ -480,12 +928,12 @@ void TileCache::registerTileBeingRendered(const TileDesc& tile)
     }
     else
     {
-        const std::string cachedName = cacheFileName(tile);
+        const TileCacheKey key(tile);
 
-        assert(_tilesBeingRendered.find(cachedName) == _tilesBeingRendered.end());
+        assert(_tilesBeingRendered.find(key) == _tilesBeingRendered.end());
 
-        tileBeingRendered = std::make_shared<TileBeingRendered>(cachedName, tile);
-        _tilesBeingRendered[cachedName] = tileBeingRendered;
+        tileBeingRendered = std::make_shared<TileBeingRendered>(key, tile);
+        _tilesBeingRendered[key] = tileBeingRendered;
     }
 }
 
@@ -510,13 +958,13 @@ std::string TileCache::cancelTiles(const std::shared_ptr<ClientSession> &subscri
         }
 
         auto& subscribers = it->second->getSubscribers();
-        LOG_TRC("Tile " << it->first << " has " << subscribers.size() << " subscribers.");
+        LOG_TRC("Tile " << it->first.toString() << " has " << subscribers.size() << " subscribers.");
 
         const auto itRem = std::find_if(subscribers.begin(), subscribers.end(),
                                         [sub](std::weak_ptr<ClientSession>& ptr){ return ptr.lock().get() == sub; });
         if (itRem != subscribers.end())
         {
-            LOG_TRC("Tile " << it->first << " has " << subscribers.size() <<
+            LOG_TRC("Tile " << it->first.toString() << " has " << subscribers.size() <<
                     " subscribers. Removing " << subscriber->getName() << ".");
             subscribers.erase(itRem, itRem + 1);
             if (subscribers.empty())
@@ -535,6 +983,22 @@ std::string TileCache::cancelTiles(const std::shared_ptr<ClientSession> &subscri
     return canceltiles.empty() ? canceltiles : "canceltiles " + canceltiles;
 }
 
+void TileCache::forgetCancelledTiles(const std::set<int>& versions)
+{
+    assertCorrectThread();
+
+    for (auto it = _tilesBeingRendered.begin(); it != _tilesBeingRendered.end(); )
+    {
+        const std::shared_ptr<TileBeingRendered> tileBeingRendered = it->second;
+        ++it;
+        if (versions.find(tileBeingRendered->getVersion()) != versions.end())
+        {
+            LOG_TRC("Tile " << tileBeingRendered->getKey().toString() << " was cancelled by the kit.");
+            forgetTileBeingRendered(tileBeingRendered, tileBeingRendered->getTile());
+        }
+    }
+}
+
 void TileCache::assertCorrectThread()
 {
     const bool correctThread = _owner == std::thread::id() || std::this_thread::get_id() == _owner;
@@ -547,8 +1011,8 @@ void TileCache::assertCorrectThread()
 
 TileCache::Tile TileCache::loadTile(const std::string &fileName)
 {
-    auto it = _cache.find(fileName);
-    if (it != _cache.end())
+    auto it = _streamCache.find(fileName);
+    if (it != _streamCache.end())
     {
         LOG_TRC("Found cache tile: " << fileName);
         return it->second;
@@ -559,15 +1023,21 @@ TileCache::Tile TileCache::loadTile(const std::string &fileName)
 
 void TileCache::dumpState(std::ostream& os)
 {
-    size_t num = 0, size = 0;
-    for (auto it : _cache)
+    std::unique_lock<std::mutex> lock(_mutex);
+    os << "  tile cache: num: " << _cache.size() << " size: " << _cacheBytes << " bytes, hits: " <<
+        _hits << " of " << _lookups << " lookups\n";
+    for (const auto& it : _tileIndex)
     {
-        num++; size += it.second->size();
+        const auto tile = _cache.find(it);
+        os << "    " /* << std::setw(4) << it.first->getWireId() */ << " - '" << it.toString() << "' - ";
+        if (tile != _cache.end())
+            os << tile->second._tile->size() << " bytes\n";
+        else
+            os << "on disk\n";
     }
-    os << "  tile cache: num: " << num << " size: " << size << " bytes\n";
-    for (auto it : _cache)
+    for (const auto& it : _streamCache)
     {
-        os << "    " /* << std::setw(4) << it.first->getWireId() */ << " - '" << it.first << "' - " << it.second->size() << " bytes\n";
+        os << "    - '" << it.first << "' - " << it.second->size() << " bytes\n";
     }
 }
 
@@ -10,11 +10,17 @@
 #ifndef INCLUDED_TILECACHE_HPP
 #define INCLUDED_TILECACHE_HPP
 
+#include <atomic>
+#include <cstdint>
 #include <iosfwd>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <thread>
 #include <string>
+#include <unordered_map>
 
 #include <Poco/Timestamp.h>
 #include <Rectangle.hpp>
@@ -22,8 +28,92 @@
 #include "TileDesc.hpp"
 
 class ClientSession;
+class TilePack;
+
+/// What identifies a tile in the cache: its part, zoom and position.
+struct TileCacheKey
+{
+    int _part;
+    int _width;
+    int _height;
+    int _tileWidth;
+    int _tileHeight;
+    int _tilePosY;
+    int _tilePosX;
+
+    TileCacheKey(int part, int width, int height, int tileWidth, int tileHeight, int tilePosX, int tilePosY)
+        : _part(part)
+        , _width(width)
+        , _height(height)
+        , _tileWidth(tileWidth)
+        , _tileHeight(tileHeight)
+        , _tilePosY(tilePosY)
+        , _tilePosX(tilePosX)
+    {
+    }
+
+    explicit TileCacheKey(const TileDesc& tile)
+        : TileCacheKey(tile.getPart(), tile.getWidth(), tile.getHeight(),
+                       tile.getTileWidth(), tile.getTileHeight(),
+                       tile.getTilePosX(), tile.getTilePosY())
+    {
+    }
+
+    /// The same zoom of the same part.
+    bool sameZoom(const TileCacheKey& other) const
+    {
+        return _part == other._part && _width == other._width && _height == other._height &&
+               _tileWidth == other._tileWidth && _tileHeight == other._tileHeight;
+    }
+
+    bool operator==(const TileCacheKey& other) const
+    {
+        return sameZoom(other) && _tilePosY == other._tilePosY && _tilePosX == other._tilePosX;
+    }
+
+    /// Orders by part and zoom, then by rows and columns, so that the
+    /// tiles of an area are found with a few ranges of the order.
+    bool operator<(const TileCacheKey& other) const
+    {
+        if (_part != other._part)
+            return _part < other._part;
+        if (_width != other._width)
+            return _width < other._width;
+        if (_height != other._height)
+            return _height < other._height;
+        if (_tileWidth != other._tileWidth)
+            return _tileWidth < other._tileWidth;
+        if (_tileHeight != other._tileHeight)
+            return _tileHeight < other._tileHeight;
+        if (_tilePosY != other._tilePosY)
+            return _tilePosY < other._tilePosY;
+        return _tilePosX < other._tilePosX;
+    }
+
+    /// The name of the tile in logs, as its cache file used to be named.
+    std::string toString() const;
+};
+
+struct TileCacheKeyHash
+{
+    size_t operator()(const TileCacheKey& key) const
+    {
+        uint64_t hash = static_cast<uint32_t>(key._part);
+        hash = hash * 0x9e3779b97f4a7c15ULL + static_cast<uint32_t>(key._width);
+        hash = hash * 0x9e3779b97f4a7c15ULL + static_cast<uint32_t>(key._height);
+        hash = hash * 0x9e3779b97f4a7c15ULL + static_cast<uint32_t>(key._tileWidth);
+        hash = hash * 0x9e3779b97f4a7c15ULL + static_cast<uint32_t>(key._tileHeight);
+        hash = hash * 0x9e3779b97f4a7c15ULL + static_cast<uint32_t>(key._tilePosY);
+        hash = hash * 0x9e3779b97f4a7c15ULL + static_cast<uint32_t>(key._tilePosX);
+        return hash ^ (hash >> 29);
+    }
+};
 
 /// Handles the caching of tiles of one document.
+/// The tiles of all the documents share a memory budget, the least
+/// recently used ones of any document are dropped when it is exceeded.
+/// Identical tiles share their payload, across positions and documents.
+/// The tiles of the document as it was loaded can be kept on disk too.
 class TileCache
 {
     struct TileBeingRendered;
@@ -42,6 +132,9 @@ public:
     /// Completely clear the cache contents.
     void clear();
 
+    /// Serves the tiles of the pack too, and adds the new ones to it.
+    void setPack(std::unique_ptr<TilePack> pack);
+
     TileCache(const TileCache&) = delete;
 
     /// Subscribes if no subscription exists and returns the version number.
@@ -56,10 +149,22 @@ public:
     /// Cancels all tile requests by the given subscriber.
     std::string cancelTiles(const std::shared_ptr<ClientSession>& subscriber);
 
-    /// Find the tile with this description
-    Tile lookupTile(const TileDesc& tile);
+    /// Forgets the tiles being rendered that the kit dropped, by their
+    /// versions, so that they are requested again.
+    void forgetCancelledTiles(const std::set<int>& versions);
 
-    void saveTileAndNotify(const TileDesc& tile, const char* data, const size_t size);
+    /// Find the tile with this description, and whether it is uniform,
+    /// when it is cached as its colour only, see getSolidColor().
+    Tile lookupTile(const TileDesc& tile, bool* solid = nullptr);
+
+    /// Caches the rendered tile and sends it to its subscribers. Returns true
+    /// when some of them can't use the delta it carries, and still wait for
+    /// the full tile.
+    bool saveTileAndNotify(const TileDesc& tile, const char* data, const size_t size);
+
+    /// The 'rrggbbaa' colour of a solid tile, which the kit sends as its
+    /// colour only, and is cached as its 4 RGBA bytes.
+    static std::string getSolidColor(const Tile& tile);
 
     /// Get the content of a cache file.
     /// @param content Valid only when the call returns true.
@@ -72,6 +177,11 @@ public:
     // Set the unsaved-changes state, used for sanity checks, ideally not needed
     void setUnsavedChanges(bool state);
 
+    /// The document is being edited: the tiles rendered from now on may
+    /// differ from those of the version it was loaded at, so they are no
+    /// longer added to the pack.
+    void setEdited();
+
     // Saves a font / style / etc rendering
     // The dir parameter should be the type of rendering, like "font", "style", etc
     void saveRendering(const std::string& name, const std::string& dir, const char* data, size_t size);
@@ -86,11 +196,43 @@ public:
     static std::pair<int, Util::Rectangle> parseInvalidateMsg(const std::string& tiles);
 
     void forgetTileBeingRendered(const std::shared_ptr<TileCache::TileBeingRendered>& tileBeingRendered, const TileDesc& tile);
-    double getTileBeingRenderedElapsedTimeMs(const std::string& tileCacheName) const;
+    double getTileBeingRenderedElapsedTimeMs(const TileCacheKey& key) const;
 
     bool hasTileBeingRendered(const TileDesc& tile);
     int getTileBeingRenderedVersion(const TileDesc& tile);
 
+    /// The number of tiles in the cache.
+    size_t getTileCount() const;
+
+    /// The size of the cached tiles, including the ones shared with others.
+    size_t getMemorySize() const { return _cacheBytes; }
+
+    /// The lookups of cached tiles so far, and how many found it.
+    uint64_t getLookupCount() const { return _lookups; }
+    uint64_t getHitCount() const { return _hits; }
+
+    /// The tiles rendered by the kit so far, and how many no one waited for.
+    uint64_t getRenderedCount() const { return _rendered; }
+    uint64_t getWastedCount() const { return _wasted; }
+
+    /// The tiles the kit prerendered next to the views so far, and how
+    /// many of them were served.
+    uint64_t getPrerenderedCount() const { return _prerendered; }
+    uint64_t getPrerenderHitCount() const { return _prerenderHits; }
+
+    /// Sets the memory budget of the tiles of all the documents, 0 for none.
+    static void setMaxMemorySize(size_t bytes);
+
+    /// The memory used by the tiles of all the documents.
+    static size_t getTotalMemorySize();
+
+    /// The sharing of identical tiles, as "blobs= referencedkb= storedkb= dedup=".
+    static std::string getBlobStats();
+
+    /// Drops the least recently used tiles of any document, until bytes
+    /// are freed or all the caches are empty; returns the bytes freed.
+    static size_t shrinkAll(size_t bytes);
+
     // Debugging bits ...
     void dumpState(std::ostream& os);
     void setThreadOwner(const std::thread::id &id) { _owner = id; }
@@ -99,17 +241,38 @@ public:
 private:
     void invalidateTiles(int part, int x, int y, int width, int height);
 
-    /// Lookup tile in our cache.
+    /// Removes the tiles of one zoom, starting at first, that intersect with
+    /// [x, y, width, height]; returns the first tile of the next zoom.
+    std::set<TileCacheKey>::iterator invalidateZoom(std::set<TileCacheKey>::iterator first,
+                                                    int x, int y, int width, int height);
+
+    /// Lookup a text file or rendering in our cache.
     TileCache::Tile loadTile(const std::string &fileName);
 
     /// Removes the given file from the cache
     void removeFile(const std::string& fileName);
 
-    static std::string cacheFileName(const TileDesc& tile);
-    static bool parseCacheFileName(const std::string& fileName, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight);
+    /// Returns the cached tile, to share it with the messages sending it.
+    Tile saveTileToCache(const TileCacheKey& key, const char *data, const size_t size,
+                         bool prerendered = false, bool solid = false);
+
+    /// Adds or replaces a tile, with the lock taken.
+    void addTileUnlocked(const TileCacheKey& key, const Tile& tile, bool prerendered = false,
+                         bool solid = false);
+
+    /// Drops tiles of any document if they take more than the budget.
+    static void shrinkToBudget();
 
-    /// Extract location from fileName, and check if it intersects with [x, y, width, height].
-    static bool intersectsTile(const std::string& fileName, int part, int x, int y, int width, int height);
+    /// Drops a cached tile from memory, but not its key from the index, with
+    /// the lock taken; returns the memory freed, none when its blob is still shared.
+    size_t dropTileUnlocked(const TileCacheKey& key);
+
+    /// Drops the least recently used tiles of this cache, until bytes are
+    /// freed or the remaining ones were used after usedAfter.
+    size_t shrinkUnlocked(size_t bytes, uint64_t usedAfter);
+
+    /// The use of the least recently used tile, with the lock taken.
+    uint64_t getLeastRecentUseUnlocked() const;
 
     void saveDataToCache(const std::string &fileName, const char *data, const size_t size);
 
@@ -118,8 +281,39 @@ private:
     std::thread::id _owner;
 
     bool _dontCache;
-    std::map<std::string, Tile> _cache;
-    std::map<std::string, std::shared_ptr<TileBeingRendered> > _tilesBeingRendered;
+
+    struct CachedTile
+    {
+        Tile _tile;
+        std::list<TileCacheKey>::iterator _lru;
+        /// When it was last used, in uses of the tiles of all the documents.
+        uint64_t _lastUsed;
+        /// Prerendered by the kit, and not served yet.
+        bool _prerendered;
+        /// Uniform: the kit sent its colour only, which the tile holds.
+        bool _solid;
+    };
+
+    /// Guards the tiles, as the tiles of any document are evicted
+    /// by the thread that exceeds the budget.
+    mutable std::mutex _mutex;
+    /// The tiles, and their keys in order, to find the ones of an area.
+    std::unordered_map<TileCacheKey, CachedTile, TileCacheKeyHash> _cache;
+    std::set<TileCacheKey> _tileIndex;
+    /// The tiles on disk, which are in the index too.
+    std::unique_ptr<TilePack> _pack;
+    /// The keys of the tiles, the most recently used first.
+    std::list<TileCacheKey> _lru;
+    std::atomic<size_t> _cacheBytes;
+    std::atomic<uint64_t> _lookups;
+    std::atomic<uint64_t> _hits;
+    uint64_t _rendered;
+    uint64_t _wasted;
+    std::atomic<uint64_t> _prerendered;
+    std::atomic<uint64_t> _prerenderHits;
+    /// The text files and renderings.
+    std::map<std::string, Tile> _streamCache;
+    std::unordered_map<TileCacheKey, std::shared_ptr<TileBeingRendered>, TileCacheKeyHash> _tilesBeingRendered;
 };
 
 #endif
@@ -10,6 +10,7 @@
 #ifndef INCLUDED_TILEDESC_HPP
 #define INCLUDED_TILEDESC_HPP
 
+#include <algorithm>
 #include <cassert>
 #include <map>
 #include <sstream>
@@ -74,6 +75,13 @@ public:
     TileWireId getOldWireId() const { return _oldWireId; }
     void setWireId(TileWireId id) { _wireId = id; }
     TileWireId getWireId() const { return _wireId; }
+    /// The encoder the client asked for, empty for the default one.
+    const std::string& getCodec() const { return _codec; }
+    void setCodec(const std::string& codec) { _codec = codec; }
+    /// The colour of the whole tile as 'rrggbbaa' hex when it is uniform,
+    /// in which case there is no image, empty otherwise.
+    const std::string& getSolid() const { return _solid; }
+    void setSolid(const std::string& solid) { _solid = solid; }
 
     bool operator==(const TileDesc& other) const
     {
@@ -127,7 +135,8 @@ public:
             other.getWidth() != getWidth() ||
             other.getHeight() != getHeight() ||
             other.getTileWidth() != getTileWidth() ||
-            other.getTileHeight() != getTileHeight())
+            other.getTileHeight() != getTileHeight() ||
+            other.getCodec() != getCodec())
         {
             return false;
         }
@@ -170,6 +179,16 @@ public:
             oss << " broadcast=yes";
         }
 
+        if (!_codec.empty())
+        {
+            oss << " codec=" << _codec;
+        }
+
+        if (!_solid.empty())
+        {
+            oss << " solid=" << _solid;
+        }
+
         return oss.str();
     }
 
@@ -208,6 +227,12 @@ public:
         const bool broadcast = (LOOLProtocol::getTokenString(tokens, "broadcast", s) &&
                                 s == "yes");
 
+        std::string codec;
+        LOOLProtocol::getTokenString(tokens, "codec", codec);
+
+        std::string solid;
+        LOOLProtocol::getTokenString(tokens, "solid", solid);
+
         TileDesc result(pairs["part"], pairs["width"], pairs["height"],
                         pairs["tileposx"], pairs["tileposy"],
                         pairs["tilewidth"], pairs["tileheight"],
@@ -215,6 +240,8 @@ public:
                         pairs["imgsize"], pairs["id"], broadcast);
         result.setOldWireId(oldWireId);
         result.setWireId(wireId);
+        result.setCodec(codec);
+        result.setSolid(solid);
 
         return result;
     }
@@ -247,6 +274,8 @@ private:
     bool _broadcast;
     TileWireId _oldWireId;
     TileWireId _wireId;
+    std::string _codec;
+    std::string _solid;
 };
 
 /// One or more tile header.
@@ -260,13 +289,16 @@ private:
                  int tileWidth, int tileHeight, const std::string& vers,
                  const std::string& imgSizes, int id,
                  const std::string& oldWireIds,
-                 const std::string& wireIds) :
+                 const std::string& wireIds,
+                 const std::string& solids,
+                 const std::string& codec) :
         _part(part),
         _width(width),
         _height(height),
         _tileWidth(tileWidth),
         _tileHeight(tileHeight),
-        _id(id)
+        _id(id),
+        _codec(codec)
     {
         if (_part < 0 ||
             _width <= 0 ||
@@ -283,6 +315,7 @@ private:
         Poco::StringTokenizer verTokens(vers, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
         Poco::StringTokenizer oldWireIdTokens(oldWireIds, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
         Poco::StringTokenizer wireIdTokens(wireIds, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+        Poco::StringTokenizer solidTokens(solids, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
 
         const size_t numberOfPositions = positionXtokens.count();
 
@@ -291,7 +324,8 @@ private:
             (!imgSizes.empty() && numberOfPositions != imgSizeTokens.count()) ||
             (!vers.empty() && numberOfPositions != verTokens.count()) ||
             (!oldWireIds.empty() && numberOfPositions != oldWireIdTokens.count()) ||
-            (!wireIds.empty() && numberOfPositions != wireIdTokens.count()))
+            (!wireIds.empty() && numberOfPositions != wireIdTokens.count()) ||
+            (!solids.empty() && numberOfPositions != solidTokens.count()))
         {
             throw BadArgumentException("Invalid tilecombine descriptor. Unequal number of tiles in parameters.");
         }
@@ -337,6 +371,11 @@ private:
             _tiles.emplace_back(_part, _width, _height, x, y, _tileWidth, _tileHeight, ver, imgSize, id, false);
             _tiles.back().setOldWireId(oldWireId);
             _tiles.back().setWireId(wireId);
+            _tiles.back().setCodec(codec);
+
+            // Tiles which are not uniform have a '-' placeholder.
+            if (solidTokens.count() && solidTokens[i] != "-")
+                _tiles.back().setSolid(solidTokens[i]);
         }
     }
 
@@ -346,6 +385,7 @@ public:
     int getHeight() const { return _height; }
     int getTileWidth() const { return _tileWidth; }
     int getTileHeight() const { return _tileHeight; }
+    const std::string& getCodec() const { return _codec; }
 
     const std::vector<TileDesc>& getTiles() const { return _tiles; }
     std::vector<TileDesc>& getTiles() { return _tiles; }
@@ -404,11 +444,28 @@ public:
         }
         oss.seekp(-1, std::ios_base::cur); // See beow.
 
+        const bool hasSolid = std::any_of(_tiles.begin(), _tiles.end(),
+                                          [](const TileDesc& tile) { return !tile.getSolid().empty(); });
+        if (hasSolid)
+        {
+            oss << " solid=";
+            for (const auto& tile : _tiles)
+            {
+                oss << (tile.getSolid().empty() ? "-" : tile.getSolid()) << ',';
+            }
+            oss.seekp(-1, std::ios_base::cur); // Ditto.
+        }
+
         if (_id >= 0)
         {
             oss << " id=" << _id;
         }
 
+        if (!_codec.empty())
+        {
+            oss << " codec=" << _codec;
+        }
+
         // Make sure we don't return a potential trailing comma that
         // we have seeked back over but not overwritten after all.
         return oss.str().substr(0, oss.tellp());
@@ -430,6 +487,8 @@ public:
         std::string versions;
         std::string oldwireIds;
         std::string wireIds;
+        std::string solids;
+        std::string codec;
 
         for (const auto& token : tokens)
         {
@@ -461,6 +520,14 @@ public:
                 {
                     wireIds = value;
                 }
+                else if (name == "solid")
+                {
+                    solids = value;
+                }
+                else if (name == "codec")
+                {
+                    codec = value;
+                }
                 else
                 {
                     int v = 0;
@@ -476,7 +543,7 @@ public:
                             tilePositionsX, tilePositionsY,
                             pairs["tilewidth"], pairs["tileheight"],
                             versions,
-                            imgSizes, pairs["id"], oldwireIds, wireIds);
+                            imgSizes, pairs["id"], oldwireIds, wireIds, solids, codec);
     }
 
     /// Deserialize a TileDesc from a string format.
@@ -507,7 +574,7 @@ public:
         vers.seekp(-1, std::ios_base::cur); // Remove last comma.
         return TileCombined(tiles[0].getPart(), tiles[0].getWidth(), tiles[0].getHeight(),
                             xs.str(), ys.str(), tiles[0].getTileWidth(), tiles[0].getTileHeight(),
-                            vers.str(), "", -1, oldhs.str(), hs.str());
+                            vers.str(), "", -1, oldhs.str(), hs.str(), "", tiles[0].getCodec());
     }
 
 private:
@@ -518,6 +585,7 @@ private:
     int _tileWidth;
     int _tileHeight;
     int _id;
+    std::string _codec;
 };
 
 #endif
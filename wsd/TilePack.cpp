@@ -0,0 +1,560 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "TilePack.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <Poco/DigestEngine.h>
+#include <Poco/DirectoryIterator.h>
+#include <Poco/Exception.h>
+#include <Poco/File.h>
+#include <Poco/SHA1Engine.h>
+
+#include <Log.hpp>
+#include <Util.hpp>
+#include <common/FileUtil.hpp>
+
+namespace
+{
+    /// Where the packs are, none if empty, and how much they can take.
+    std::string PacksPath;
+    size_t MaxBytes = 0;
+
+    /// The directories of the packs in use, which are never removed.
+    std::mutex PacksMutex;
+    std::set<std::string> OpenPacks;
+
+    /// All the packs, by directory, and the bytes they take in total, kept
+    /// up to date rather than listed again each time.
+    struct PackInfo
+    {
+        Poco::Timestamp _lastUsed;
+        uint64_t _size;
+    };
+    std::map<std::string, PackInfo> Packs;
+    uint64_t TotalBytes = 0;
+
+    /// Sets the size of the pack in dir, and when it was last used.
+    void updatePackUnlocked(const std::string& dir, uint64_t size)
+    {
+        PackInfo& info = Packs[dir];
+        TotalBytes = TotalBytes - info._size + size;
+        info._size = size;
+        info._lastUsed = Poco::Timestamp();
+    }
+
+    const char IndexMagic[8] = { 'L', 'O', 'O', 'L', 'T', 'P', 'K', '2' };
+
+    /// The tile is the 4 RGBA bytes of a uniform one.
+    const uint32_t SolidFlag = 1;
+
+    /// The index file is the magic, followed by these.
+    struct IndexEntry
+    {
+        int32_t _part;
+        int32_t _width;
+        int32_t _height;
+        int32_t _tileWidth;
+        int32_t _tileHeight;
+        int32_t _tilePosX;
+        int32_t _tilePosY;
+        uint32_t _size;
+        uint64_t _offset;
+        uint32_t _flags;
+        uint32_t _reserved;
+    };
+
+    static_assert(sizeof(IndexEntry) == 48, "TilePack index entries must have no padding");
+
+    bool writeAll(int fd, const char* data, size_t size, uint64_t offset)
+    {
+        while (size > 0)
+        {
+            const ssize_t written = ::pwrite(fd, data, size, offset);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+
+            data += written;
+            size -= written;
+            offset += written;
+        }
+
+        return true;
+    }
+
+    bool readAll(int fd, char* data, size_t size, uint64_t offset)
+    {
+        while (size > 0)
+        {
+            const ssize_t bytes = ::pread(fd, data, size, offset);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes <= 0)
+                return false;
+
+            data += bytes;
+            size -= bytes;
+            offset += bytes;
+        }
+
+        return true;
+    }
+}
+
+TilePack::TilePack(const std::string& dir, int packFd, int indexFd) :
+    _dir(dir),
+    _packFd(packFd),
+    _indexFd(indexFd),
+    _mapping(nullptr),
+    _mappingSize(0),
+    _packSize(0),
+    _indexSize(0),
+    _readOnly(false),
+    _reads(0),
+    _queuedBytes(0),
+    _stop(false)
+{
+}
+
+TilePack::~TilePack()
+{
+    if (_writer.joinable())
+    {
+        // Write what is left, for the next time the document is opened.
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cond.notify_one();
+        _writer.join();
+    }
+
+    LOG_DBG("Closing tile pack [" << _dir << "] with " << _index.size() << " tiles, " <<
+            _reads << " read.");
+
+    if (_mapping)
+        munmap(_mapping, _mappingSize);
+    ::close(_indexFd);
+    ::close(_packFd);
+
+    {
+        std::unique_lock<std::mutex> lock(PacksMutex);
+        OpenPacks.erase(_dir);
+    }
+
+    shrink();
+}
+
+void TilePack::initialize(const std::string& path, size_t maxBytes)
+{
+    std::unique_lock<std::mutex> lock(PacksMutex);
+    PacksPath = path;
+    while (PacksPath.size() > 1 && PacksPath.back() == '/')
+        PacksPath.pop_back();
+    MaxBytes = maxBytes;
+
+    // The only time the packs are listed, their sizes are kept track of after.
+    Packs.clear();
+    TotalBytes = 0;
+    if (PacksPath.empty() || !Poco::File(PacksPath).exists())
+        return;
+
+    try
+    {
+        for (Poco::DirectoryIterator it(PacksPath), end; it != end; ++it)
+        {
+            if (!it->isDirectory())
+                continue;
+
+            uint64_t size = 0;
+            for (Poco::DirectoryIterator file(it->path()); file != end; ++file)
+                size += file->getSize();
+
+            Packs[it->path()] = PackInfo{ it->getLastModified(), size };
+            TotalBytes += size;
+        }
+    }
+    catch (const Poco::Exception& exc)
+    {
+        LOG_ERR("Failed to list tile packs in [" << PacksPath << "]: " << exc.displayText());
+    }
+}
+
+std::unique_ptr<TilePack> TilePack::open(const std::string& uri,
+                                         const Poco::Timestamp& modifiedTime,
+                                         const std::string& watermarkText)
+{
+    std::string dir;
+    {
+        std::unique_lock<std::mutex> lock(PacksMutex);
+        if (PacksPath.empty() || MaxBytes == 0)
+            return nullptr;
+
+        // Without its version, we can't tell an outdated pack.
+        if (modifiedTime == Poco::Timestamp::fromEpochTime(0))
+        {
+            LOG_DBG("No modified time for the document, not keeping its tiles.");
+            return nullptr;
+        }
+
+        // The tiles are watermarked by the kit, so keep them apart.
+        Poco::SHA1Engine sha1;
+        sha1.update(uri + '\n' + std::to_string(modifiedTime.epochMicroseconds()) + '\n' + watermarkText);
+        dir = PacksPath + '/' + Poco::DigestEngine::digestToHex(sha1.digest());
+
+        if (!OpenPacks.insert(dir).second)
+            return nullptr;
+    }
+
+    int packFd = -1;
+    int indexFd = -1;
+    try
+    {
+        Poco::File(dir).createDirectories();
+
+        indexFd = ::open((dir + "/tiles.index").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (indexFd >= 0 && flock(indexFd, LOCK_EX | LOCK_NB) == 0)
+            packFd = ::open((dir + "/tiles.pack").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    }
+    catch (const Poco::Exception& exc)
+    {
+        LOG_ERR("Failed to create tile pack [" << dir << "]: " << exc.displayText());
+    }
+
+    if (packFd < 0)
+    {
+        LOG_SYS("Failed to open tile pack [" << dir << "].");
+        if (indexFd >= 0)
+            ::close(indexFd);
+
+        std::unique_lock<std::mutex> lock(PacksMutex);
+        OpenPacks.erase(dir);
+        return nullptr;
+    }
+
+    std::unique_ptr<TilePack> pack(new TilePack(dir, packFd, indexFd));
+    pack->load();
+
+    // The time of the directory is when it was last used.
+    ::utimes(dir.c_str(), nullptr);
+    {
+        std::unique_lock<std::mutex> lock(PacksMutex);
+        updatePackUnlocked(dir, pack->_packSize + pack->_indexSize);
+    }
+    shrink();
+
+    TilePack* writer = pack.get();
+    pack->_writer = std::thread([writer]() { writer->writeTiles(); });
+
+    return pack;
+}
+
+void TilePack::load()
+{
+    struct stat st;
+    if (fstat(_packFd, &st) == 0)
+        _packSize = st.st_size;
+
+    std::vector<char> index;
+    if (fstat(_indexFd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(IndexMagic)))
+    {
+        index.resize(st.st_size);
+        if (!readAll(_indexFd, index.data(), index.size(), 0) ||
+            std::memcmp(index.data(), IndexMagic, sizeof(IndexMagic)) != 0)
+        {
+            LOG_WRN("Invalid tile pack index [" << _dir << "], starting over.");
+            index.clear();
+        }
+    }
+
+    if (index.empty())
+    {
+        // A new pack, or one we can't use.
+        _packSize = 0;
+        if (ftruncate(_packFd, 0) != 0 || ftruncate(_indexFd, 0) != 0 ||
+            !writeAll(_indexFd, IndexMagic, sizeof(IndexMagic), 0))
+        {
+            LOG_SYS("Failed to reset tile pack [" << _dir << "].");
+            _readOnly = true;
+        }
+
+        _indexSize = sizeof(IndexMagic);
+        return;
+    }
+
+    // Drop the last entry if it was cut short, eg. on a crash.
+    const size_t count = (index.size() - sizeof(IndexMagic)) / sizeof(IndexEntry);
+    _indexSize = sizeof(IndexMagic) + count * sizeof(IndexEntry);
+    if (_indexSize != index.size() && ftruncate(_indexFd, _indexSize) != 0)
+        _readOnly = true;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        IndexEntry entry;
+        std::memcpy(&entry, index.data() + sizeof(IndexMagic) + i * sizeof(IndexEntry), sizeof(entry));
+        if (entry._offset + entry._size > _packSize)
+            continue;
+
+        const TileCacheKey key(entry._part, entry._width, entry._height, entry._tileWidth,
+                               entry._tileHeight, entry._tilePosX, entry._tilePosY);
+        _index[key] = Entry{ entry._offset, entry._size, (entry._flags & SolidFlag) != 0 };
+    }
+
+    if (_packSize > 0)
+    {
+        void* mapping = mmap(nullptr, _packSize, PROT_READ, MAP_SHARED, _packFd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            _mapping = static_cast<char*>(mapping);
+            _mappingSize = _packSize;
+        }
+    }
+
+    LOG_INF("Opened tile pack [" << _dir << "] with " << _index.size() << " tiles in " <<
+            _packSize << " bytes.");
+}
+
+std::vector<TileCacheKey> TilePack::getKeys() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    std::vector<TileCacheKey> keys;
+    keys.reserve(_index.size() + _pending.size());
+    for (const auto& it : _index)
+        keys.push_back(it.first);
+
+    for (const auto& it : _pending)
+    {
+        if (_index.find(it.first) == _index.end())
+            keys.push_back(it.first);
+    }
+
+    return keys;
+}
+
+bool TilePack::contains(const TileCacheKey& key) const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _pending.find(key) != _pending.end() || _index.find(key) != _index.end();
+}
+
+bool TilePack::read(const TileCacheKey& key, std::vector<char>& data, bool& solid) const
+{
+    Entry entry;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto pending = _pending.find(key);
+        if (pending != _pending.end())
+        {
+            data.assign(pending->second._tile->begin(), pending->second._tile->end());
+            solid = pending->second._solid;
+            ++_reads;
+            return true;
+        }
+
+        const auto it = _index.find(key);
+        if (it == _index.end())
+            return false;
+
+        entry = it->second;
+    }
+
+    solid = entry._solid;
+
+    // The tiles are never overwritten, nor the mapping changed.
+    data.resize(entry._size);
+    if (entry._offset + entry._size <= _mappingSize)
+        std::memcpy(data.data(), _mapping + entry._offset, entry._size);
+    else if (!readAll(_packFd, data.data(), entry._size, entry._offset))
+    {
+        LOG_SYS("Failed to read tile " << key.toString() << " from pack [" << _dir << "].");
+        return false;
+    }
+
+    ++_reads;
+    return true;
+}
+
+void TilePack::append(const TileCacheKey& key, const TileCache::Tile& tile, bool solid)
+{
+    if (_readOnly || !tile)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_packSize + _queuedBytes + tile->size() > MaxBytes)
+        {
+            LOG_INF("Tile pack [" << _dir << "] is full.");
+            _readOnly = true;
+            return;
+        }
+
+        const auto it = _pending.find(key);
+        if (it != _pending.end())
+        {
+            // Only the last one of the key is written.
+            _queuedBytes -= it->second._tile->size();
+            it->second = PendingTile{ tile, solid };
+        }
+        else
+        {
+            _pending.emplace(key, PendingTile{ tile, solid });
+            _queue.push_back(key);
+        }
+
+        _queuedBytes += tile->size();
+    }
+
+    _cond.notify_one();
+}
+
+void TilePack::remove(const TileCacheKey& key)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _index.erase(key);
+
+    const auto it = _pending.find(key);
+    if (it != _pending.end())
+    {
+        _queuedBytes -= it->second._tile->size();
+        _pending.erase(it);
+    }
+}
+
+void TilePack::writeTiles()
+{
+    Util::setThreadName("tilepack");
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;)
+    {
+        _cond.wait(lock, [this]() { return _stop || !_queue.empty(); });
+        if (_queue.empty())
+            break;
+
+        const TileCacheKey key = _queue.front();
+        _queue.pop_front();
+        const auto it = _pending.find(key);
+        if (it == _pending.end())
+            continue;
+
+        // Still served from _pending while being written.
+        const TileCache::Tile tile = it->second._tile;
+        const bool solid = it->second._solid;
+        lock.unlock();
+        uint64_t offset = 0;
+        const bool written = !_readOnly && write(key, tile, solid, offset);
+        lock.lock();
+
+        const auto pending = _pending.find(key);
+        const bool current = pending != _pending.end() && pending->second._tile == tile;
+        if (written && current)
+            _index[key] = Entry{ offset, static_cast<uint32_t>(tile->size()), solid };
+
+        if (current)
+        {
+            _queuedBytes -= tile->size();
+            _pending.erase(pending);
+        }
+        else if (pending != _pending.end())
+        {
+            // Appended again meanwhile, write it again.
+            _queue.push_back(key);
+        }
+    }
+}
+
+bool TilePack::write(const TileCacheKey& key, const TileCache::Tile& tile, bool solid, uint64_t& offset)
+{
+    IndexEntry entry;
+    entry._part = key._part;
+    entry._width = key._width;
+    entry._height = key._height;
+    entry._tileWidth = key._tileWidth;
+    entry._tileHeight = key._tileHeight;
+    entry._tilePosX = key._tilePosX;
+    entry._tilePosY = key._tilePosY;
+    entry._size = tile->size();
+    entry._flags = solid ? SolidFlag : 0;
+    entry._reserved = 0;
+
+    // Only this thread changes them, once the pack is open.
+    uint64_t indexSize;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        offset = _packSize;
+        indexSize = _indexSize;
+    }
+    entry._offset = offset;
+
+    // The tile first, so that the index never refers to a missing one.
+    if (!writeAll(_packFd, tile->data(), tile->size(), offset) ||
+        !writeAll(_indexFd, reinterpret_cast<const char*>(&entry), sizeof(entry), indexSize))
+    {
+        LOG_SYS("Failed to write tile " << key.toString() << " to pack [" << _dir << "].");
+        _readOnly = true;
+        return false;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _packSize += tile->size();
+        _indexSize += sizeof(entry);
+    }
+
+    std::unique_lock<std::mutex> lock(PacksMutex);
+    updatePackUnlocked(_dir, offset + tile->size() + indexSize + sizeof(entry));
+    return true;
+}
+
+void TilePack::shrink()
+{
+    std::unique_lock<std::mutex> lock(PacksMutex);
+    if (PacksPath.empty() || TotalBytes <= MaxBytes)
+        return;
+
+    std::vector<std::pair<Poco::Timestamp, std::string>> packs;
+    for (const auto& it : Packs)
+    {
+        if (OpenPacks.find(it.first) == OpenPacks.end())
+            packs.emplace_back(it.second._lastUsed, it.first);
+    }
+
+    std::sort(packs.begin(), packs.end());
+    for (const auto& pack : packs)
+    {
+        if (TotalBytes <= MaxBytes)
+            break;
+
+        const uint64_t size = Packs[pack.second]._size;
+        LOG_DBG("Removing least recently used tile pack [" << pack.second << "] of " <<
+                size << " bytes.");
+        FileUtil::removeFile(pack.second, true);
+        TotalBytes -= size;
+        Packs.erase(pack.second);
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
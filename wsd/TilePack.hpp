@@ -0,0 +1,132 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILEPACK_HPP
+#define INCLUDED_TILEPACK_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <Poco/Timestamp.h>
+
+#include "TileCache.hpp"
+
+/// The tiles of one version of a document kept on disk, to serve them at
+/// once when it is opened again, eg. after a restart or its eviction.
+///
+/// The tiles are appended to a pack file, which is mapped to read them,
+/// and their keys and positions to an index file; the last entry of a
+/// key wins. Each version of a document, as given by its storage URI
+/// and last modified time, has its own directory, and the least recently
+/// used ones are removed when they take more than the configured size.
+///
+/// The tiles are written by a thread of the pack, not to block the
+/// document's; until then they are served from memory.
+class TilePack
+{
+    TilePack(const std::string& dir, int packFd, int indexFd);
+
+public:
+    ~TilePack();
+
+    TilePack(const TilePack&) = delete;
+    TilePack& operator=(const TilePack&) = delete;
+
+    /// Keeps the packs in path, in up to maxBytes; none when path is empty.
+    static void initialize(const std::string& path, size_t maxBytes);
+
+    /// Opens, or creates, the pack of a version of a document, or returns
+    /// nullptr when there is none, eg. when the version is unknown or
+    /// another process uses it.
+    static std::unique_ptr<TilePack> open(const std::string& uri,
+                                          const Poco::Timestamp& modifiedTime,
+                                          const std::string& watermarkText);
+
+    /// The keys of the tiles in the pack.
+    std::vector<TileCacheKey> getKeys() const;
+
+    bool contains(const TileCacheKey& key) const;
+
+    /// Reads a tile, and whether it is the colour of a uniform one,
+    /// returns false when it isn't in the pack.
+    bool read(const TileCacheKey& key, std::vector<char>& data, bool& solid) const;
+
+    /// Adds a tile, unless the pack is read-only or full.
+    void append(const TileCacheKey& key, const TileCache::Tile& tile, bool solid = false);
+
+    /// Forgets an outdated tile, until the pack is opened again.
+    void remove(const TileCacheKey& key);
+
+    /// Stops adding tiles, eg. once the document is modified.
+    void setReadOnly() { _readOnly = true; }
+
+    /// The tiles read from the pack so far.
+    uint64_t getReadCount() const { return _reads; }
+
+private:
+    void load();
+
+    /// Writes the appended tiles, until the pack is closed.
+    void writeTiles();
+
+    /// Writes a tile at the end of the pack, at offset, returns false on failure.
+    bool write(const TileCacheKey& key, const TileCache::Tile& tile, bool solid, uint64_t& offset);
+
+    /// Removes the least recently used packs not in use, until all
+    /// take less than the configured size.
+    static void shrink();
+
+    struct Entry
+    {
+        uint64_t _offset;
+        uint32_t _size;
+        bool _solid;
+    };
+
+    struct PendingTile
+    {
+        TileCache::Tile _tile;
+        bool _solid;
+    };
+
+    const std::string _dir;
+    const int _packFd;
+    const int _indexFd;
+    /// The pack as it was when opened; the tiles added since are read from the file.
+    char* _mapping;
+    size_t _mappingSize;
+    uint64_t _packSize;
+    uint64_t _indexSize;
+    std::unordered_map<TileCacheKey, Entry, TileCacheKeyHash> _index;
+    std::atomic<bool> _readOnly;
+    mutable std::atomic<uint64_t> _reads;
+
+    /// The tiles appended but not written yet, by key, and in order.
+    std::unordered_map<TileCacheKey, PendingTile, TileCacheKeyHash> _pending;
+    std::deque<TileCacheKey> _queue;
+    /// The bytes of the queued tiles.
+    uint64_t _queuedBytes;
+    bool _stop;
+    /// Guards the above from _index on, which the writer thread shares.
+    mutable std::mutex _mutex;
+    std::condition_variable _cond;
+    std::thread _writer;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */